@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <cstring>
+
+#include "archive.h"
+
+/**
+ * File format, host byte order:
+ *
+ *   char         magic[4]    "C8AR"
+ *   uint16_t     version     1
+ *   uint16_t     reserved
+ *   uint32_t     count
+ *   uint32_t     reserved
+ *   ArchiveEntry entries[count]
+ *   ROM data, at the offsets given in the entries
+ */
+
+namespace Chip8 {
+
+    const char kArchiveMagic[4] = { 'C', '8', 'A', 'R' };
+    const uint16_t kArchiveVersion = 1;
+    const size_t kArchiveHeaderSize = 16;
+
+    bool RomArchive::open(const char* filename) {
+        _entries = nullptr;
+        _count = 0;
+
+        if (!_file.open(filename) || _file.size() < kArchiveHeaderSize)
+            return false;
+
+        const uint8_t* data = _file.data();
+        uint16_t version;
+        uint32_t count;
+        std::memcpy(&version, data + 4, sizeof(version));
+        std::memcpy(&count, data + 8, sizeof(count));
+
+        if (std::memcmp(data, kArchiveMagic, sizeof(kArchiveMagic)) != 0 ||
+            version != kArchiveVersion ||
+            count > (_file.size() - kArchiveHeaderSize) / sizeof(ArchiveEntry))
+            return false;
+
+        // The header keeps the entries 8 byte aligned within the mapping
+        const ArchiveEntry* entries = reinterpret_cast<const ArchiveEntry*>(data + kArchiveHeaderSize);
+        for (uint32_t i = 0; i < count; i++) {
+            if (entries[i].offset > _file.size() || entries[i].size > _file.size() - entries[i].offset)
+                return false;
+        }
+
+        _entries = entries;
+        _count = count;
+        return true;
+    }
+
+    size_t RomArchive::size() const {
+        return _count;
+    }
+
+    std::string RomArchive::name(size_t index) const {
+        const char* name = _entries[index].name;
+        return std::string(name, std::find(name, name + kArchiveNameLength, '\0'));
+    }
+
+    const ArchiveEntry& RomArchive::entry(size_t index) const {
+        return _entries[index];
+    }
+
+    const uint8_t* RomArchive::data(size_t index) const {
+        return _file.data() + _entries[index].offset;
+    }
+
+    int RomArchive::find(const std::string& name) const {
+        for (size_t i = 0; i < _count; i++) {
+            if (this->name(i) == name)
+                return int(i);
+        }
+        return -1;
+    }
+
+    bool RomArchive::verify(size_t index) const {
+        return hash_rom(data(index), _entries[index].size) == _entries[index].hash;
+    }
+
+    bool RomArchive::write(std::ostream& out, const std::vector<std::string>& names,
+                           const std::vector<std::vector<uint8_t>>& roms) {
+        uint16_t version = kArchiveVersion;
+        uint16_t reserved16 = 0;
+        uint32_t count = roms.size();
+        uint32_t reserved32 = 0;
+
+        out.write(kArchiveMagic, sizeof(kArchiveMagic));
+        out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        out.write(reinterpret_cast<const char*>(&reserved16), sizeof(reserved16));
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        out.write(reinterpret_cast<const char*>(&reserved32), sizeof(reserved32));
+
+        uint32_t offset = kArchiveHeaderSize + count * sizeof(ArchiveEntry);
+        for (size_t i = 0; i < roms.size(); i++) {
+            ArchiveEntry entry = ArchiveEntry();
+            std::memcpy(entry.name, names[i].data(), std::min(names[i].size(), kArchiveNameLength));
+            entry.offset = offset;
+            entry.size = roms[i].size();
+            entry.hash = hash_rom(roms[i].data(), roms[i].size());
+            offset += entry.size;
+
+            out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        }
+
+        for (const auto& rom : roms)
+            out.write(reinterpret_cast<const char*>(rom.data()), rom.size());
+
+        return bool(out);
+    }
+
+} // namespace Chip8
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "rom.h"
+
+/**
+ * Many ROMs packed into one file behind an index, so a whole corpus is a
+ * single open and mapping. ROM data is used in place from the mapping.
+ */
+
+namespace Chip8 {
+
+    const size_t kArchiveNameLength = 32;
+
+    struct ArchiveEntry {
+        char name[kArchiveNameLength];    // NUL padded, not always terminated
+        uint32_t offset;                  // From the start of the file
+        uint32_t size;
+        uint64_t hash;                    // hash_rom() of the data
+    };
+
+    static_assert(sizeof(ArchiveEntry) == 48, "archive entries are written as-is");
+
+    class RomArchive {
+    public:
+        // Maps the file and checks the index; hashes are checked by verify()
+        bool open(const char* filename);
+
+        size_t size() const;
+        std::string name(size_t index) const;
+        const ArchiveEntry& entry(size_t index) const;
+        const uint8_t* data(size_t index) const;
+
+        // Index of the ROM with that name, or -1
+        int find(const std::string& name) const;
+
+        // True if the ROM's contents still match its hash
+        bool verify(size_t index) const;
+
+        // Packs ROMs into an archive. Names longer than 32 bytes are cut.
+        static bool write(std::ostream& out, const std::vector<std::string>& names,
+                          const std::vector<std::vector<uint8_t>>& roms);
+
+    private:
+        MappedFile _file;
+        const ArchiveEntry* _entries;
+        size_t _count;
+    };
+
+} // namespace Chip8
@@ -0,0 +1,93 @@
+#include "audio.h"
+
+namespace Chip8 {
+
+    namespace {
+
+        // Smooths the step where the wave jumps at phase t, see Valimaki &
+        // Huovilainen, "Antialiasing oscillators in subtractive synthesis"
+        inline double poly_blep(double t, double dt) {
+            if (t < dt) {
+                t /= dt;
+                return t + t - t * t - 1.0;
+            }
+            if (t > 1.0 - dt) {
+                t = (t - 1.0) / dt;
+                return t * t + t + t + 1.0;
+            }
+            return 0.0;
+        }
+
+    } // namespace
+
+    SampleRing::SampleRing(size_t capacity) : _read(0), _written(0) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+
+        _samples.resize(size);
+        _mask = size - 1;
+    }
+
+    size_t SampleRing::write(const int16_t* samples, size_t count) {
+        size_t written = _written.load(std::memory_order_relaxed);
+        size_t read = _read.load(std::memory_order_acquire);
+        size_t free = _samples.size() - (written - read);
+
+        if (count > free)
+            count = free;
+        for (size_t i = 0; i < count; i++)
+            _samples[(written + i) & _mask] = samples[i];
+
+        _written.store(written + count, std::memory_order_release);
+        return count;
+    }
+
+    size_t SampleRing::read(int16_t* samples, size_t count) {
+        size_t read = _read.load(std::memory_order_relaxed);
+        size_t written = _written.load(std::memory_order_acquire);
+
+        if (count > written - read)
+            count = written - read;
+        for (size_t i = 0; i < count; i++)
+            samples[i] = _samples[(read + i) & _mask];
+
+        _read.store(read + count, std::memory_order_release);
+        return count;
+    }
+
+    size_t SampleRing::size() const {
+        return _written.load(std::memory_order_acquire) - _read.load(std::memory_order_acquire);
+    }
+
+    size_t SampleRing::capacity() const {
+        return _samples.size();
+    }
+
+    SquareWave::SquareWave(int sample_rate, double frequency, int16_t amplitude)
+        : _phase(0.0), _increment(frequency / sample_rate), _gain(0.0f),
+          _ramp(1000.0f / sample_rate), _amplitude(amplitude) {
+    }
+
+    void SquareWave::render(int16_t* out, size_t count, bool gate) {
+        float target = gate ? 1.0f : 0.0f;
+
+        for (size_t i = 0; i < count; i++) {
+            double value = (_phase < 0.5) ? 1.0 : -1.0;
+            value += poly_blep(_phase, _increment);
+            value -= poly_blep(_phase >= 0.5 ? _phase - 0.5 : _phase + 0.5, _increment);
+
+            if (_gain < target)
+                _gain = (_gain + _ramp < target) ? _gain + _ramp : target;
+            else if (_gain > target)
+                _gain = (_gain - _ramp > target) ? _gain - _ramp : target;
+
+            out[i] = int16_t(value * _gain * _amplitude);
+
+            _phase += _increment;
+            if (_phase >= 1.0)
+                _phase -= 1.0;
+        }
+    }
+
+} // namespace Chip8
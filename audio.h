@@ -1,16 +1,61 @@
 #pragma once
 
-namespace Chip8 {
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Sound generation shared by the audio backends. The emulation thread
+ * renders samples a frame at a time and hands them to the device callback
+ * through a SampleRing, so neither side ever blocks on the other.
+ */
 
-    class Audio {
+namespace Chip8 {
 
+    /**
+     * Single-producer single-consumer ring of 16 bit samples. One thread
+     * may write and one other thread may read concurrently without locks.
+     */
+    class SampleRing {
     public:
-        Audio();
-        void beep();
+        // Capacity is rounded up to a power of two
+        explicit SampleRing(size_t capacity);
+
+        // Both return how many samples were actually moved
+        size_t write(const int16_t* samples, size_t count);
+        size_t read(int16_t* samples, size_t count);
+
+        size_t size() const;
+        size_t capacity() const;
 
     private:
+        std::vector<int16_t> _samples;
+        size_t _mask;
 
+        // Monotonic counters, only ever advanced by their own side
+        std::atomic<size_t> _read;
+        std::atomic<size_t> _written;
+    };
+
+    /**
+     * Band-limited (PolyBLEP) square wave, gated on and off per block. The
+     * gate is applied at the exact first sample of a block and ramped over
+     * about a millisecond so switching doesn't click. Phase runs on while
+     * gated off, so back-to-back tones join up seamlessly.
+     */
+    class SquareWave {
+    public:
+        SquareWave(int sample_rate, double frequency, int16_t amplitude);
 
+        void render(int16_t* out, size_t count, bool gate);
+
+    private:
+        double _phase;
+        double _increment;
+        float _gain;
+        float _ramp;
+        int16_t _amplitude;
     };
 
 } // namespace Chip8
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Host backends the emulation core talks to. The core (CPU, Memory, Graphics)
+ * never touches SDL directly; an SDL frontend and a headless one implement
+ * these interfaces.
+ */
+
+namespace Chip8 {
+
+    class Graphics;
+
+    class Input {
+    public:
+        virtual ~Input() {}
+
+        // Pump host events, called once per main loop iteration
+        virtual void poll() = 0;
+
+        // Keypad state, bit N set while key N is held. The core samples this
+        // once per frame.
+        virtual uint16_t keys() const = 0;
+        virtual bool quit_requested() const = 0;
+
+        // True once for every single-step request made since the last call
+        virtual bool step_requested() = 0;
+
+        // Runs time backwards while held, one frame per frame
+        virtual bool rewind_held() const = 0;
+
+        // True once for every save / load state request since the last call
+        virtual bool save_requested() = 0;
+        virtual bool load_requested() = 0;
+
+        // True once for every request to write out the profile
+        virtual bool profile_requested() = 0;
+    };
+
+    class Video {
+    public:
+        virtual ~Video() {}
+
+        virtual void present(const Graphics& graphics) = 0;
+
+        // True while the picture keeps changing without the screen doing so,
+        // e.g. a fade still running, so unchanged frames need presenting too
+        virtual bool animating() const { return false; }
+    };
+
+    class Audio {
+    public:
+        virtual ~Audio() {}
+
+        // Called at the end of every emulated 60hz frame with whether the
+        // sound timer was running during it
+        virtual void frame(bool tone) = 0;
+    };
+
+} // namespace Chip8
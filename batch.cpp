@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "batch.h"
+#include "chip8.h"
+
+namespace Chip8 {
+
+    BatchMachine::BatchMachine()
+        : _input(std::vector<KeyEvent>()), _chip8(&_input, &_video, &_audio) {
+    }
+
+    BatchResult BatchMachine::run(const BatchJob& job) {
+        BatchResult result = BatchResult();
+
+        // Settings first, so nothing the last job left behind shapes the
+        // power-on of this one
+        _input.reset(job.inputs);
+        _chip8.set_quirks(job.quirks);
+        _chip8.set_skip_idle(job.skip_idle);
+        _chip8.set_speed(job.speed != 0 ? job.speed : kDefaultSpeed);
+        _chip8.set_jit(job.jit);
+
+        result.loaded = job.program != nullptr && _chip8.reset(job.program, job.program_size);
+        if (!result.loaded)
+            return result;
+
+        _chip8.seed(job.seed);
+
+        uint64_t frames = _chip8.frame();
+        uint64_t skipped = _chip8.idle_skipped();
+        auto start = std::chrono::steady_clock::now();
+        result.cycles = _chip8.run_cycles(job.cycles);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        result.seconds = elapsed.count();
+        result.frames = _chip8.frame() - frames;
+        result.frame_hash = _chip8.graphics().hash();
+        result.idle_skipped = _chip8.idle_skipped() - skipped;
+        result.state = _chip8.cpu_state();
+        return result;
+    }
+
+    BatchResult run_job(const BatchJob& job) {
+        BatchMachine machine;
+        return machine.run(job);
+    }
+
+    BatchRunner::BatchRunner(unsigned threads) : _threads(threads) {
+        if (_threads == 0)
+            _threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (unsigned i = 0; i < _threads; i++)
+            _queues.emplace_back(new Queue);
+    }
+
+    unsigned BatchRunner::threads() const {
+        return _threads;
+    }
+
+    std::vector<BatchResult> BatchRunner::run(const std::vector<BatchJob>& jobs) {
+        std::vector<BatchResult> results(jobs.size());
+
+        for (size_t i = 0; i < jobs.size(); i++)
+            _queues[i % _threads]->jobs.push_back(i);
+
+        // The calling thread is worker 0
+        std::vector<std::thread> workers;
+        for (unsigned id = 1; id < _threads; id++)
+            workers.emplace_back(&BatchRunner::work, this, id, std::cref(jobs), std::ref(results));
+
+        work(0, jobs, results);
+        for (auto& worker : workers)
+            worker.join();
+
+        return results;
+    }
+
+    void BatchRunner::work(unsigned id, const std::vector<BatchJob>& jobs,
+                           std::vector<BatchResult>& results) {
+        BatchMachine machine;
+        size_t job;
+
+        while (take(id, job))
+            results[job] = machine.run(jobs[job]);
+    }
+
+    bool BatchRunner::take(unsigned id, size_t& job) {
+        {
+            Queue& own = *_queues[id];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.jobs.empty()) {
+                job = own.jobs.back();
+                own.jobs.pop_back();
+                return true;
+            }
+        }
+
+        // Nothing left locally, steal the oldest job from someone else.
+        // Jobs are never added once running, so one empty sweep means done.
+        for (unsigned i = 1; i < _threads; i++) {
+            Queue& victim = *_queues[(id + i) % _threads];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.jobs.empty()) {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+} // namespace Chip8
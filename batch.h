@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "chip8.h"
+#include "cpu.h"
+#include "headless.h"
+
+/**
+ * Runs many independent headless machines at once, e.g. to sweep a ROM
+ * over a set of input scripts. Each job gets its own Chip8 and backends,
+ * so machines share nothing but the (read-only) ROM image.
+ */
+
+namespace Chip8 {
+
+    struct BatchJob {
+        const uint8_t* program;       // Borrowed, e.g. from a RomArchive
+        size_t program_size;
+        uint64_t cycles;
+        uint32_t speed;               // 0 keeps the machine's default
+        bool jit;
+        uint64_t seed;
+        QuirkProfile quirks;
+        bool skip_idle;               // See CPU::set_skip_idle()
+        std::vector<KeyEvent> inputs;
+    };
+
+    struct BatchResult {
+        uint64_t cycles;
+        uint64_t frames;              // Emulated, whether the screen changed or not
+        uint64_t frame_hash;          // Graphics::hash() of the final screen
+        uint64_t idle_skipped;        // Instructions skipped in idle loops
+        CPUState state;
+        double seconds;
+        bool loaded;
+    };
+
+    /**
+     * A headless machine that's power cycled for each job rather than
+     * rebuilt, so decoded code, the JIT's buffer and all allocations carry
+     * over between jobs.
+     */
+    class BatchMachine {
+    public:
+        BatchMachine();
+
+        BatchResult run(const BatchJob& job);
+
+    private:
+        ScriptedInput _input;
+        HeadlessVideo _video;
+        HeadlessAudio _audio;
+        Chip8 _chip8;
+    };
+
+    /**
+     * Fixed pool of worker threads with one job deque each. Jobs are dealt
+     * round-robin up front; a worker takes from the back of its own deque
+     * and, once that is empty, steals from the front of the others. Jobs
+     * vary a lot in cost (JIT vs interpreter, DXYN-heavy ROMs), so stealing
+     * keeps every core busy until the batch drains.
+     */
+    class BatchRunner {
+    public:
+        // 0 threads means one per hardware thread
+        explicit BatchRunner(unsigned threads = 0);
+
+        unsigned threads() const;
+
+        // Runs every job and returns the results in job order
+        std::vector<BatchResult> run(const std::vector<BatchJob>& jobs);
+
+    private:
+        struct Queue {
+            std::mutex lock;
+            std::deque<size_t> jobs;
+        };
+
+        void work(unsigned id, const std::vector<BatchJob>& jobs,
+                  std::vector<BatchResult>& results);
+        bool take(unsigned id, size_t& job);
+
+        unsigned _threads;
+        std::vector<std::unique_ptr<Queue>> _queues;
+    };
+
+    // Runs a single job on a fresh machine
+    BatchResult run_job(const BatchJob& job);
+
+} // namespace Chip8
@@ -0,0 +1,254 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "batch.h"
+
+/**
+ * chip8-batch: runs one ROM, or every ROM in an archive (--archive, see
+ * chip8-pack), on many headless machines in parallel. Instances are
+ * numbered ROM by ROM, --instances of each.
+ *
+ * Per-instance keypad scripts come from --inputs, one event per line:
+ *
+ *     <instance|*> <frame> <keys>
+ *
+ * where keys is the whole keypad as a hex bitmask (bit N = key N) and '*'
+ * applies the event to every instance. Lines starting with '#' are ignored.
+ */
+
+namespace {
+
+    struct Options {
+        unsigned instances = 1;
+        unsigned threads = 0;
+        uint64_t cycles = 1000000;
+        uint32_t speed = 0;
+        bool jit = false;
+        bool archive = false;
+        bool skip_idle = true;
+        uint64_t seed = 0;
+        bool quirks_set = false;
+        Chip8::QuirkProfile quirks = Chip8::kDefaultQuirks;
+        const char* quirks_db = nullptr;
+        const char* filename = nullptr;
+        const char* inputs_file = nullptr;
+        const char* results_file = nullptr;
+    };
+
+    void usage(const char* name) {
+        std::cout << "usage: " << name
+            << " [--instances N] [--threads N] [--cycles N] [--ips N] [--cpu=interp|jit] [--seed N]"
+            << " [--quirks vip|chip48|schip|modern] [--quirks-db FILE] [--inputs FILE] [--results FILE] [--archive]"
+            << " [--no-idle-skip] <filename>\n" << std::endl;
+        std::exit(2);
+    }
+
+    Options parse_options(int argc, char *argv[]) {
+        Options options;
+
+        for (int i = 1; i < argc; i++) {
+            if (std::strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+                options.instances = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                options.threads = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+                options.cycles = std::strtoull(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+                options.speed = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                options.seed = std::strtoull(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+                if (!Chip8::parse_quirks(argv[++i], options.quirks))
+                    usage(argv[0]);
+                options.quirks_set = true;
+            } else if (std::strcmp(argv[i], "--quirks-db") == 0 && i + 1 < argc) {
+                options.quirks_db = argv[++i];
+            } else if (std::strcmp(argv[i], "--no-idle-skip") == 0) {
+                options.skip_idle = false;
+            } else if (std::strcmp(argv[i], "--archive") == 0) {
+                options.archive = true;
+            } else if (std::strcmp(argv[i], "--cpu=jit") == 0) {
+                options.jit = true;
+            } else if (std::strcmp(argv[i], "--cpu=interp") == 0) {
+                options.jit = false;
+            } else if (std::strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+                options.inputs_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--results") == 0 && i + 1 < argc) {
+                options.results_file = argv[++i];
+            } else if (argv[i][0] == '-' || options.filename != nullptr) {
+                usage(argv[0]);
+            } else {
+                options.filename = argv[i];
+            }
+        }
+
+        if (options.filename == nullptr || options.instances == 0)
+            usage(argv[0]);
+
+        return options;
+    }
+
+    bool read_inputs(const char* filename, std::vector<Chip8::BatchJob>& jobs) {
+        std::ifstream in(filename);
+        if (!in.is_open())
+            return false;
+
+        std::string line;
+        int number = 0;
+        while (std::getline(in, line)) {
+            number++;
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::istringstream fields(line);
+            std::string instance;
+            Chip8::KeyEvent event;
+            unsigned keys;
+
+            if (!(fields >> instance >> event.frame >> std::hex >> keys)) {
+                std::cerr << "[batch] " << filename << ":" << number << ": bad event" << std::endl;
+                return false;
+            }
+            event.keys = uint16_t(keys);
+
+            if (instance == "*") {
+                for (auto& job : jobs)
+                    job.inputs.push_back(event);
+            } else {
+                size_t index = std::strtoul(instance.c_str(), nullptr, 10);
+                if (index < jobs.size())
+                    jobs[index].inputs.push_back(event);
+            }
+        }
+
+        return true;
+    }
+
+    void write_results(const char* filename, const std::vector<std::string>& names,
+                       const std::vector<Chip8::BatchResult>& results) {
+        std::ofstream out(filename);
+
+        out << "instance,rom,cycles,frames,frame_hash,pc,i,sp,dt,st";
+        for (int r = 0; r < 16; r++)
+            out << ",v" << std::hex << std::uppercase << r << std::dec;
+        out << ",seconds\n";
+
+        for (size_t i = 0; i < results.size(); i++) {
+            const Chip8::BatchResult& result = results[i];
+            const Chip8::CPUState& state = result.state;
+
+            out << i << "," << names[i] << "," << result.cycles << "," << result.frames << ","
+                << std::hex << std::setw(16) << std::setfill('0') << result.frame_hash
+                << std::dec << std::setfill(' ') << "," << state.program_counter << ","
+                << state.index_register << "," << state.stack_pointer << ","
+                << int(state.delay_timer) << "," << int(state.sound_timer);
+            for (int r = 0; r < 16; r++)
+                out << "," << int(state.registers[r]);
+            out << "," << result.seconds << "\n";
+        }
+
+        if (!out)
+            std::cerr << "[batch] couldn't write results to " << filename << std::endl;
+    }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options options = parse_options(argc, argv);
+
+    // Either way the ROMs are used straight from one mapping
+    Chip8::MappedFile file;
+    Chip8::RomArchive archive;
+
+    if (options.archive) {
+        if (!archive.open(options.filename)) {
+            std::cerr << "couldn't open archive" << std::endl;
+            exit(1);
+        }
+    } else if (!file.open(options.filename)) {
+        std::cerr << "couldn't open program" << std::endl;
+        exit(1);
+    }
+
+    Chip8::QuirkTable quirk_table;
+    if (options.quirks_db != nullptr && !quirk_table.load(options.quirks_db)) {
+        std::cerr << "couldn't read quirks from " << options.quirks_db << std::endl;
+        exit(1);
+    }
+
+    Chip8::BatchJob job;
+    job.cycles = options.cycles;
+    job.speed = options.speed;
+    job.jit = options.jit;
+    job.seed = options.seed;
+    job.skip_idle = options.skip_idle;
+
+    std::vector<Chip8::BatchJob> jobs;
+    std::vector<std::string> names;
+    size_t count = options.archive ? archive.size() : 1;
+
+    for (size_t rom = 0; rom < count; rom++) {
+        if (options.archive) {
+            if (!archive.verify(rom)) {
+                std::cerr << "[batch] " << archive.name(rom) << " doesn't match its hash" << std::endl;
+                exit(1);
+            }
+            job.program = archive.data(rom);
+            job.program_size = archive.entry(rom).size;
+        } else {
+            job.program = file.data();
+            job.program_size = file.size();
+        }
+
+        // --quirks wins over the table, which wins over the default
+        job.quirks = options.quirks;
+        if (!options.quirks_set)
+            quirk_table.find(Chip8::hash_rom(job.program, job.program_size), job.quirks);
+
+        std::string name = options.archive ? archive.name(rom) : options.filename;
+        jobs.insert(jobs.end(), options.instances, job);
+        names.insert(names.end(), options.instances, name);
+    }
+
+    if (options.inputs_file != nullptr && !read_inputs(options.inputs_file, jobs)) {
+        std::cerr << "couldn't read inputs from " << options.inputs_file << std::endl;
+        exit(1);
+    }
+
+    Chip8::BatchRunner runner(options.threads);
+    std::cout << "[batch] Running " << jobs.size() << " instances of "
+        << options.cycles << " instructions on " << runner.threads() << " threads" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Chip8::BatchResult> results = runner.run(jobs);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    uint64_t executed = 0;
+    uint64_t skipped = 0;
+    for (const auto& result : results) {
+        if (!result.loaded) {
+            std::cerr << "a program doesn't fit in memory" << std::endl;
+            exit(1);
+        }
+        executed += result.cycles;
+        skipped += result.idle_skipped;
+    }
+
+    std::cout << "[batch] Executed " << executed << " instructions in " << elapsed.count()
+        << "s (" << uint64_t(executed / elapsed.count()) << " instructions/s aggregate, "
+        << skipped << " skipped in idle loops)" << std::endl;
+
+    if (options.results_file != nullptr)
+        write_results(options.results_file, names, results);
+
+    return 0;
+}
@@ -0,0 +1,702 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "compact.h"
+#include "cpu.h"
+#include "graphics.h"
+#include "headless.h"
+#include "memory.h"
+#include "upscale.h"
+#ifdef CHIP8_HAVE_SDL
+#include "sdl_backend.h"
+#endif
+
+/**
+ * chip8-bench: microbenchmarks of the core's hot paths and macrobenchmarks
+ * over a small synthetic ROM corpus built in below.
+ *
+ * Every benchmark runs once to warm up and then --repeat times; each run is
+ * one sample and the table shows min / median / mean / stddev over them.
+ * Compare medians between commits, the min is the least noisy bound.
+ * --results writes the same summaries as CSV.
+ */
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+
+    const uint32_t kFastSpeed = 100000000;
+    const uint32_t kGameSpeed = 700;
+
+    struct Options {
+        int repeat = 10;
+        double scale = 1.0;
+        const char* filter = nullptr;
+        const char* results_file = nullptr;
+    };
+
+    struct Summary {
+        std::string name;
+        std::string unit;
+        size_t samples;
+        double min;
+        double median;
+        double mean;
+        double stddev;
+        double max;
+    };
+
+    struct Benchmark {
+        std::string name;
+        std::string unit;
+
+        // Runs once and returns the measured value in unit
+        std::function<double()> measure;
+    };
+
+    // Keeps results alive so the measured loops aren't optimised away
+    volatile uint64_t sink;
+
+    double seconds_since(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    Summary summarize(const Benchmark& benchmark, std::vector<double> samples) {
+        Summary summary;
+        summary.name = benchmark.name;
+        summary.unit = benchmark.unit;
+        summary.samples = samples.size();
+
+        std::sort(samples.begin(), samples.end());
+        summary.min = samples.front();
+        summary.max = samples.back();
+
+        size_t middle = samples.size() / 2;
+        summary.median = (samples.size() % 2) ? samples[middle]
+            : (samples[middle - 1] + samples[middle]) / 2;
+
+        double sum = 0;
+        for (double sample : samples)
+            sum += sample;
+        summary.mean = sum / samples.size();
+
+        double squares = 0;
+        for (double sample : samples)
+            squares += (sample - summary.mean) * (sample - summary.mean);
+        summary.stddev = samples.size() > 1 ? std::sqrt(squares / (samples.size() - 1)) : 0;
+
+        return summary;
+    }
+
+    // Big-endian opcodes, starting at 0x200
+    std::vector<uint8_t> assemble(std::initializer_list<uint16_t> ops) {
+        std::vector<uint8_t> rom;
+        for (uint16_t op : ops) {
+            rom.push_back(op >> 8);
+            rom.push_back(op & 0xFF);
+        }
+        return rom;
+    }
+
+    struct Rom {
+        const char* name;
+        std::vector<uint8_t> data;
+    };
+
+    // Synthetic programs, each an endless loop stressing one kind of work
+    std::vector<Rom> corpus() {
+        std::vector<Rom> roms;
+
+        // Register arithmetic only
+        roms.push_back({ "alu", assemble({
+            0x6100, 0x7101, 0x8014, 0x8203, 0x8316, 0x8425, 0x8501, 0x8622,
+            0x4100, 0x6000, 0x1202,
+        }) });
+
+        // Font sprites walking across the screen
+        roms.push_back({ "sprites", assemble({
+            0x6000, 0x6100, 0xA050, 0xD015, 0xA055, 0xD105, 0x7003, 0x7102,
+            0xA05A, 0xD01F, 0x1204,
+        }) });
+
+        // Register stores and loads, BCD
+        roms.push_back({ "memory", assemble({
+            0xA400, 0xF755, 0xF765, 0xF033, 0x7001, 0xF21E, 0x1202,
+        }) });
+
+        // Subroutine calls and jumps
+        roms.push_back({ "calls", assemble({
+            0x220A, 0x220E, 0x7001, 0x1200, 0x0000, 0x7101, 0x00EE, 0x2210,
+            0x00EE, 0x7201, 0x00EE,
+        }) });
+
+        // A typical game frame: wait on the delay timer, read the keypad,
+        // redraw a sprite
+        roms.push_back({ "game", assemble({
+            0x6001, 0xF015, 0xF007, 0x3000, 0x1204, 0x6105, 0xE1A1, 0x7201,
+            0xA050, 0xD235, 0xD235, 0x1200,
+        }) });
+
+        // SUPER-CHIP: 16x16 sprites on the 128x64 screen, scrolling every
+        // iteration
+        roms.push_back({ "hires", assemble({
+            0x00FF, 0x6000, 0x6100, 0x6209, 0xF230, 0xD010, 0x7008, 0x7104,
+            0x00C1, 0x00FB, 0x00FC, 0x1208,
+        }) });
+
+        return roms;
+    }
+
+    void load(Chip8::Memory& memory, const std::vector<uint8_t>& rom) {
+        for (size_t i = 0; i < rom.size(); i++)
+            memory.putByte(0x200 + i, rom[i]);
+    }
+
+    // ns per instruction through the CPU alone
+    double measure_dispatch(const std::vector<uint8_t>& rom, bool jit, uint64_t cycles) {
+        Chip8::Graphics graphics;
+        Chip8::Memory memory;
+        Chip8::CPU cpu(&graphics, &memory);
+
+        load(memory, rom);
+        cpu.set_skip_idle(false);
+        if (jit)
+            cpu.set_jit(true);
+
+        Clock::time_point start = Clock::now();
+        cpu.run(cycles);
+        double elapsed = seconds_since(start);
+
+        sink = cpu.state().registers[0];
+        return elapsed * 1e9 / cycles;
+    }
+
+    // Whole machine, headless backends; returns ns per instruction. Idle
+    // loops are only skipped when measuring frames, so ns/instr stays the
+    // cost of actually executing.
+    double measure_rom(const std::vector<uint8_t>& rom, bool jit, uint32_t speed,
+                       uint64_t cycles, double* frames_per_second = nullptr) {
+        Chip8::HeadlessInput input;
+        Chip8::HeadlessVideo video;
+        Chip8::HeadlessAudio audio;
+        Chip8::Chip8 chip8(&input, &video, &audio);
+
+        chip8.load_program(rom.data(), rom.size());
+        chip8.set_speed(speed);
+        chip8.set_skip_idle(frames_per_second != nullptr);
+        if (jit)
+            chip8.set_jit(true);
+
+        Clock::time_point start = Clock::now();
+        uint64_t executed = chip8.run_cycles(cycles);
+        double elapsed = seconds_since(start);
+
+        // Emulated 60hz frames completed per wall-clock second
+        if (frames_per_second != nullptr)
+            *frames_per_second = (double(executed) * 60 / speed) / elapsed;
+
+        sink = chip8.graphics().hash();
+        return elapsed * 1e9 / executed;
+    }
+
+    // Same, through the compact machine's interpreter
+    double measure_compact_rom(const std::vector<uint8_t>& rom, uint64_t cycles) {
+        Chip8::CompactArena arena(1);
+        Chip8::CompactMachine& m = arena[0];
+        Chip8::compact_reset(m, rom.data(), rom.size());
+
+        Clock::time_point start = Clock::now();
+        Chip8::compact_run(m, cycles);
+        double elapsed = seconds_since(start);
+
+        sink = Chip8::compact_hash(m);
+        return elapsed * 1e9 / cycles;
+    }
+
+    // ns per machine to construct and destroy a whole Chip8
+    double measure_create(uint64_t machines) {
+        Chip8::HeadlessInput input;
+        Chip8::HeadlessVideo video;
+        Chip8::HeadlessAudio audio;
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < machines; i++) {
+            std::unique_ptr<Chip8::Chip8> chip8(new Chip8::Chip8(&input, &video, &audio));
+            sink += chip8->frame();
+        }
+        return seconds_since(start) * 1e9 / machines;
+    }
+
+    // ns per reset() with a new program, after running the last one a bit
+    double measure_reset(const std::vector<uint8_t>& rom, uint64_t resets) {
+        Chip8::HeadlessInput input;
+        Chip8::HeadlessVideo video;
+        Chip8::HeadlessAudio audio;
+        Chip8::Chip8 chip8(&input, &video, &audio);
+        chip8.set_speed(kFastSpeed);
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < resets; i++) {
+            chip8.reset(rom.data(), rom.size());
+            chip8.run_cycles(100);
+        }
+        double elapsed = seconds_since(start);
+
+        sink = chip8.graphics().hash();
+        return elapsed * 1e9 / resets;
+    }
+
+    // ns per save() and restore() of a whole machine
+    double measure_copy(const std::vector<uint8_t>& rom, uint64_t copies) {
+        Chip8::HeadlessInput input;
+        Chip8::HeadlessVideo video;
+        Chip8::HeadlessAudio audio;
+        Chip8::Chip8 from(&input, &video, &audio);
+        Chip8::Chip8 to(&input, &video, &audio);
+        std::unique_ptr<Chip8::MachineState> state(new Chip8::MachineState);
+        from.load_program(rom.data(), rom.size());
+        from.run_cycles(1000);
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < copies; i++) {
+            from.save(*state);
+            to.restore(*state);
+        }
+        double elapsed = seconds_since(start);
+
+        sink = to.graphics().hash();
+        return elapsed * 1e9 / copies;
+    }
+
+    // ns per compact machine powered on in place, across a large arena
+    double measure_compact_create(size_t machines, int rounds) {
+        Chip8::CompactArena arena(machines);
+
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < rounds; i++)
+            Chip8::compact_create(&arena[0], machines);
+        double elapsed = seconds_since(start);
+
+        sink = arena[machines - 1].program_counter;
+        return elapsed * 1e9 / (double(machines) * rounds);
+    }
+
+    double measure_compact_reset(const std::vector<uint8_t>& rom, uint64_t resets) {
+        Chip8::CompactArena arena(1);
+        Chip8::CompactMachine& m = arena[0];
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < resets; i++) {
+            Chip8::compact_reset(m, rom.data(), rom.size());
+            Chip8::compact_run(m, 100);
+        }
+        double elapsed = seconds_since(start);
+
+        sink = Chip8::compact_hash(m);
+        return elapsed * 1e9 / resets;
+    }
+
+    // ns per machine copied, each to the next one along an arena
+    double measure_compact_copy(const std::vector<uint8_t>& rom, size_t machines, int rounds) {
+        Chip8::CompactArena arena(machines);
+        Chip8::compact_reset(arena[0], rom.data(), rom.size());
+        Chip8::compact_run(arena[0], 1000);
+
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < rounds; i++) {
+            for (size_t j = 1; j < machines; j++)
+                arena[j] = arena[j - 1];
+        }
+        double elapsed = seconds_since(start);
+
+        sink = arena[machines - 1].registers[0];
+        return elapsed * 1e9 / (double(machines - 1) * rounds);
+    }
+
+    double measure_draw_sprite(uint64_t draws) {
+        Chip8::Graphics graphics;
+        const uint8_t sprite[15] = {
+            0xF0, 0x90, 0x90, 0x90, 0xF0, 0x20, 0x60, 0x20,
+            0x20, 0x70, 0xF0, 0x10, 0xF0, 0x80, 0xF0,
+        };
+        uint64_t collisions = 0;
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < draws; i++)
+            collisions += graphics.draw_sprite(int(i * 7) & 63, int(i * 3) & 31, sprite, 15, false);
+        double elapsed = seconds_since(start);
+
+        sink = collisions;
+        return elapsed * 1e9 / draws;
+    }
+
+    double measure_draw_sprite16(uint64_t draws) {
+        Chip8::Graphics graphics;
+        uint8_t sprite[32];
+        for (int i = 0; i < 32; i++)
+            sprite[i] = uint8_t(i * 37);
+        uint64_t collisions = 0;
+
+        graphics.set_hires(true);
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < draws; i++)
+            collisions += graphics.draw_sprite16(int(i * 7) & 127, int(i * 3) & 63, sprite, false);
+        double elapsed = seconds_since(start);
+
+        sink = collisions;
+        return elapsed * 1e9 / draws;
+    }
+
+    // One 00C1, 00FB and 00FC on the 128x64 screen with both planes selected
+    double measure_scroll(uint64_t scrolls) {
+        Chip8::Graphics graphics;
+        const uint8_t sprite[16] = { 0xFF, 0x81, 0x81, 0xFF, 0xFF, 0x81, 0x81, 0xFF };
+
+        graphics.set_hires(true);
+        graphics.select_planes(3);
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < scrolls; i++) {
+            if ((i & 63) == 0)
+                graphics.draw_sprite(int(i >> 6) & 127, 0, sprite, 8, false);
+            graphics.scroll_down(1);
+            graphics.scroll_right(4);
+            graphics.scroll_left(4);
+        }
+        double elapsed = seconds_since(start);
+
+        sink = graphics.hash();
+        return elapsed * 1e9 / scrolls;
+    }
+
+    double measure_get_byte(uint64_t reads) {
+        Chip8::Memory memory;
+        uint64_t sum = 0;
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < reads; i++)
+            sum += memory.getByte(int(i * 37));
+        double elapsed = seconds_since(start);
+
+        sink = sum;
+        return elapsed * 1e9 / reads;
+    }
+
+    // With a CPU attached every store also invalidates its decode cache
+    double measure_put_byte(uint64_t writes, bool listening) {
+        Chip8::Graphics graphics;
+        Chip8::Memory memory;
+        std::unique_ptr<Chip8::CPU> cpu;
+        if (listening)
+            cpu.reset(new Chip8::CPU(&graphics, &memory));
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < writes; i++)
+            memory.putByte(0x200 + int(i & 0xDFF), uint8_t(i));
+        double elapsed = seconds_since(start);
+
+        sink = memory.getByte(0x200);
+        return elapsed * 1e9 / writes;
+    }
+
+    // Moves a few sprites along each frame, drawing them at their new
+    // place and XORing them off their old one, so every frame changes and
+    // some pixels blink like a CHIP-8 game's
+    void animate(Chip8::Graphics& graphics, uint64_t frame) {
+        const uint8_t sprite[8] = { 0x3C, 0x7E, 0xDB, 0xFF, 0xFF, 0xDB, 0x66, 0x3C };
+        for (int i = 0; i < 6; i++) {
+            int x = int(frame * (i + 1) + i * 11);
+            int y = int(frame * 3 + i * 5);
+            graphics.draw_sprite(x, y, sprite, 8, false);
+            if (frame > 0)
+                graphics.draw_sprite(x - (i + 1), y - 3, sprite, 8, false);
+        }
+    }
+
+    // Frames per second through an Upscaler, at 1280x640 with scale 20
+    double measure_upscale(Chip8::UpscaleKernel kernel, Chip8::ScaleFilter filter,
+                           int persistence, bool hires, uint64_t frames) {
+        Chip8::UpscaleConfig config;
+        config.scale = 20;
+        config.filter = filter;
+        config.persistence = persistence;
+        Chip8::Upscaler upscaler(config, kernel);
+        Chip8::Graphics graphics;
+        graphics.set_hires(hires);
+        uint64_t rendered = 0;
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < frames; i++) {
+            animate(graphics, i);
+            rendered += upscaler.render(graphics);
+        }
+        double elapsed = seconds_since(start);
+
+        sink = rendered + upscaler.pixels()[rendered % upscaler.width()];
+        return frames / elapsed;
+    }
+
+    // Every vector kernel the host runs has to give the scalar one's
+    // output to the bit, through every filter, with and without fading,
+    // and across a change of resolution
+    bool check_upscale_kernels() {
+        const Chip8::ScaleFilter filters[] = { Chip8::kScaleNearest, Chip8::kScale2x, Chip8::kScale3x };
+        const Chip8::UpscaleKernel kernels[] = { Chip8::kKernelSSE2, Chip8::kKernelAVX2 };
+
+        for (Chip8::UpscaleKernel kernel : kernels) {
+            if (!Chip8::kernel_supported(kernel))
+                continue;
+
+            for (Chip8::ScaleFilter filter : filters) {
+                for (int persistence : { 0, 200 }) {
+                    Chip8::UpscaleConfig config;
+                    config.scale = 12;
+                    config.filter = filter;
+                    config.persistence = persistence;
+                    config.palette = { { 0xFF102030, 0xFFF0E0D0, 0xFF80FF00, 0xFF0080FF } };
+
+                    Chip8::Upscaler scalar(config, Chip8::kKernelScalar);
+                    Chip8::Upscaler vector(config, kernel);
+                    Chip8::Graphics graphics;
+                    size_t bytes = size_t(scalar.width()) * scalar.height() * sizeof(uint32_t);
+
+                    for (uint64_t frame = 0; frame < 80; frame++) {
+                        if (frame == 40)
+                            graphics.set_hires(true);
+                        // Leave the screen alone now and then to let fades run
+                        if (frame % 8 < 5)
+                            animate(graphics, frame);
+
+                        bool expected = scalar.render(graphics);
+                        if (vector.render(graphics) != expected ||
+                            std::memcmp(vector.pixels(), scalar.pixels(), bytes) != 0) {
+                            std::cerr << "[bench] upscale kernel " << Chip8::kernel_name(kernel)
+                                << " differs from scalar (filter " << filter << ", persistence "
+                                << persistence << ", frame " << frame << ")" << std::endl;
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+#ifdef CHIP8_HAVE_SDL
+    // Frames per second through SDLVideo, a row changing every frame
+    double measure_present(Chip8::SDLVideo& video, uint64_t frames) {
+        Chip8::Graphics graphics;
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t i = 0; i < frames; i++) {
+            graphics.set(int(i) & 63, int(i >> 6) & 31, (i >> 11) & 1);
+            video.present(graphics);
+        }
+        return frames / seconds_since(start);
+    }
+#endif
+
+    std::vector<Benchmark> benchmarks(double scale) {
+        std::vector<Benchmark> list;
+        uint64_t n = uint64_t(20000000 * scale);
+
+        std::vector<Rom> roms = corpus();
+        const std::vector<uint8_t>& alu = roms[0].data;
+
+        list.push_back({ "dispatch/interp", "ns/instr",
+            [=] { return measure_dispatch(alu, false, n); } });
+        list.push_back({ "dispatch/jit", "ns/instr",
+            [=] { return measure_dispatch(alu, true, n * 5); } });
+        list.push_back({ "draw_sprite/8x15", "ns/draw",
+            [=] { return measure_draw_sprite(n / 4); } });
+        list.push_back({ "draw_sprite/16x16", "ns/draw",
+            [=] { return measure_draw_sprite16(n / 4); } });
+        list.push_back({ "scroll/hires", "ns/scroll",
+            [=] { return measure_scroll(n / 40); } });
+        list.push_back({ "memory/getByte", "ns/read",
+            [=] { return measure_get_byte(n * 2); } });
+        list.push_back({ "memory/putByte", "ns/write",
+            [=] { return measure_put_byte(n, false); } });
+        list.push_back({ "memory/putByte+cpu", "ns/write",
+            [=] { return measure_put_byte(n, true); } });
+        list.push_back({ "machine/create", "ns/machine",
+            [=] { return measure_create(n / 2000); } });
+        list.push_back({ "machine/reset", "ns/reset",
+            [=] { return measure_reset(roms[1].data, n / 2000); } });
+        list.push_back({ "machine/copy", "ns/copy",
+            [=] { return measure_copy(roms[1].data, n / 2000); } });
+        list.push_back({ "compact/create", "ns/machine",
+            [=] { return measure_compact_create(100000, std::max(int(n / 2000000), 1)); } });
+        list.push_back({ "compact/reset", "ns/reset",
+            [=] { return measure_compact_reset(roms[1].data, n / 200); } });
+        list.push_back({ "compact/copy", "ns/copy",
+            [=] { return measure_compact_copy(roms[1].data, 100000, std::max(int(n / 2000000), 1)); } });
+
+        const Chip8::UpscaleKernel kernels[] = { Chip8::kKernelScalar, Chip8::kKernelSSE2, Chip8::kKernelAVX2 };
+        for (Chip8::UpscaleKernel kernel : kernels) {
+            if (!Chip8::kernel_supported(kernel))
+                continue;
+
+            uint64_t frames = std::max(n / 20000, uint64_t(1));
+            std::string name = std::string("upscale/") + Chip8::kernel_name(kernel);
+            list.push_back({ name + "/nearest", "frames/s",
+                [=] { return measure_upscale(kernel, Chip8::kScaleNearest, 0, false, frames); } });
+            list.push_back({ name + "/hires", "frames/s",
+                [=] { return measure_upscale(kernel, Chip8::kScaleNearest, 0, true, frames); } });
+            list.push_back({ name + "/scale2x", "frames/s",
+                [=] { return measure_upscale(kernel, Chip8::kScale2x, 0, false, frames); } });
+            list.push_back({ name + "/scale3x", "frames/s",
+                [=] { return measure_upscale(kernel, Chip8::kScale3x, 0, true, frames); } });
+            list.push_back({ name + "/phosphor", "frames/s",
+                [=] { return measure_upscale(kernel, Chip8::kScaleNearest, 192, false, frames); } });
+        }
+
+        for (const Rom& rom : roms) {
+            std::vector<uint8_t> data = rom.data;
+            std::string name = std::string("rom/") + rom.name;
+
+            list.push_back({ name + "/interp", "ns/instr",
+                [=] { return measure_rom(data, false, kFastSpeed, n / 2); } });
+            list.push_back({ name + "/jit", "ns/instr",
+                [=] { return measure_rom(data, true, kFastSpeed, n / 2); } });
+            // The compact machine only runs lo-res programs
+            if (std::strcmp(rom.name, "hires") != 0)
+                list.push_back({ name + "/compact", "ns/instr",
+                    [=] { return measure_compact_rom(data, n / 2); } });
+            list.push_back({ name + "/frames", "frames/s", [=] {
+                double frames_per_second;
+                measure_rom(data, false, kGameSpeed, n / 20, &frames_per_second);
+                return frames_per_second;
+            } });
+        }
+
+        return list;
+    }
+
+    void usage(const char* name) {
+        std::cout << "usage: " << name
+            << " [--repeat N] [--scale X] [--filter SUBSTRING] [--results FILE]\n" << std::endl;
+        std::exit(2);
+    }
+
+    Options parse_options(int argc, char *argv[]) {
+        Options options;
+
+        for (int i = 1; i < argc; i++) {
+            if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+                options.repeat = std::max(std::atoi(argv[++i]), 1);
+            } else if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+                options.scale = std::max(std::atof(argv[++i]), 0.001);
+            } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+                options.filter = argv[++i];
+            } else if (std::strcmp(argv[i], "--results") == 0 && i + 1 < argc) {
+                options.results_file = argv[++i];
+            } else {
+                usage(argv[0]);
+            }
+        }
+
+        return options;
+    }
+
+    Summary run(const Benchmark& benchmark, int repeat) {
+        benchmark.measure();
+
+        std::vector<double> samples;
+        for (int i = 0; i < repeat; i++)
+            samples.push_back(benchmark.measure());
+
+        return summarize(benchmark, samples);
+    }
+
+    void print(const Summary& summary) {
+        std::cout << std::left << std::setw(24) << summary.name << std::right
+            << std::setw(10) << summary.unit << std::fixed << std::setprecision(3)
+            << std::setw(14) << summary.min << std::setw(14) << summary.median
+            << std::setw(14) << summary.mean << std::setw(12) << summary.stddev
+            << std::endl;
+    }
+
+    void write_results(const char* filename, const std::vector<Summary>& summaries) {
+        std::ofstream out(filename);
+
+        out << "name,unit,samples,min,median,mean,stddev,max\n";
+        for (const Summary& summary : summaries) {
+            out << summary.name << "," << summary.unit << "," << summary.samples << ","
+                << summary.min << "," << summary.median << "," << summary.mean << ","
+                << summary.stddev << "," << summary.max << "\n";
+        }
+
+        if (!out)
+            std::cerr << "[bench] couldn't write results to " << filename << std::endl;
+    }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options options = parse_options(argc, argv);
+    std::vector<Benchmark> list = benchmarks(options.scale);
+
+#ifdef CHIP8_HAVE_SDL
+    // Presentation cost without a display, unless a driver was asked for
+    setenv("SDL_VIDEODRIVER", "dummy", 0);
+    SDL_Init(0);
+    Chip8::VideoConfig config;
+    config.vsync = false;
+    std::unique_ptr<Chip8::SDLVideo> video(new Chip8::SDLVideo(config));
+
+    // The same through the Upscaler at 1280x640
+    config.software = true;
+    config.display.scale = 20;
+    std::unique_ptr<Chip8::SDLVideo> scaled(new Chip8::SDLVideo(config));
+    uint64_t frames = uint64_t(20000 * options.scale);
+
+    list.push_back({ "sdl/present", "frames/s",
+        [&] { return measure_present(*video, frames); } });
+    list.push_back({ "sdl/present/upscaled", "frames/s",
+        [&] { return measure_present(*scaled, frames / 10); } });
+#endif
+
+    // Kernel timings only mean something if the kernels agree
+    bool upscaling = false;
+    for (const Benchmark& benchmark : list) {
+        if (benchmark.name.compare(0, 8, "upscale/") == 0 &&
+            (options.filter == nullptr || benchmark.name.find(options.filter) != std::string::npos))
+            upscaling = true;
+    }
+    if (upscaling && !check_upscale_kernels())
+        return 1;
+
+    std::cout << std::left << std::setw(24) << "benchmark" << std::right << std::setw(10)
+        << "unit" << std::setw(14) << "min" << std::setw(14) << "median" << std::setw(14)
+        << "mean" << std::setw(12) << "stddev" << std::endl;
+
+    std::vector<Summary> summaries;
+    for (const Benchmark& benchmark : list) {
+        if (options.filter != nullptr && benchmark.name.find(options.filter) == std::string::npos)
+            continue;
+
+        summaries.push_back(run(benchmark, options.repeat));
+        print(summaries.back());
+    }
+
+    if (options.results_file != nullptr)
+        write_results(options.results_file, summaries);
+
+#ifdef CHIP8_HAVE_SDL
+    scaled.reset();
+    video.reset();
+    SDL_Quit();
+#endif
+    return 0;
+}
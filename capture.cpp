@@ -0,0 +1,349 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "capture.h"
+
+/**
+ * Raw stream format, host byte order:
+ *
+ *   char     magic[4]      "C8RV"
+ *   uint16_t version       1
+ *   uint16_t reserved
+ *   then for every captured frame:
+ *     uint64_t frame       Emulated frame number
+ *     uint16_t width       64 or 128
+ *     uint16_t height      32 or 64
+ *     uint8_t  planes      2 when XO-CHIP's second plane has anything on it
+ *     uint8_t  reserved[3]
+ *     uint8_t  bits[planes][height][width / 8]
+ *
+ * Rows run top to bottom with the leftmost pixel in the most significant
+ * bit. Frames that didn't change aren't repeated, so readers should go by
+ * the frame numbers.
+ */
+
+namespace Chip8 {
+
+    const char kRawMagic[4] = { 'C', '8', 'R', 'V' };
+    const uint16_t kRawVersion = 1;
+
+    // How long the writer sleeps when there's nothing queued
+    const std::chrono::milliseconds kWriterIdle(2);
+
+    // Same colours as the SDL window: off, plane 0, plane 1, both
+    const uint8_t kCapturePalette[4][3] = {
+        { 0x00, 0x00, 0x00 },
+        { 0xFF, 0xFF, 0xFF },
+        { 0xAA, 0xAA, 0xAA },
+        { 0x55, 0x55, 0x55 },
+    };
+
+    namespace {
+
+        template <typename T>
+        void put(std::ostream& out, T value) {
+            out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void put_be32(std::string& out, uint32_t value) {
+            for (int shift = 24; shift >= 0; shift -= 8)
+                out.push_back(char(value >> shift));
+        }
+
+        std::array<uint32_t, 256> crc_table() {
+            std::array<uint32_t, 256> table;
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+            return table;
+        }
+
+        uint32_t crc32(const char* data, size_t size, uint32_t crc = 0) {
+            static const std::array<uint32_t, 256> table = crc_table();
+
+            crc = ~crc;
+            for (size_t i = 0; i < size; i++)
+                crc = table[(crc ^ uint8_t(data[i])) & 0xFF] ^ (crc >> 8);
+            return ~crc;
+        }
+
+        void put_chunk(std::string& png, const char* type, const std::string& data) {
+            put_be32(png, uint32_t(data.size()));
+            size_t start = png.size();
+            png.append(type, 4);
+            png += data;
+            put_be32(png, crc32(&png[start], png.size() - start));
+        }
+
+        // Palette PNG, compressed with stored deflate blocks only: a frame
+        // is at most 8 KiB of pixels, so it's not worth pulling in zlib
+        std::string encode_png(const Graphics& graphics) {
+            int width = graphics.width();
+            int height = graphics.height();
+
+            std::string pixels;
+            uint8_t colors[kMaxGraphicsWidth];
+            for (int y = 0; y < height; y++) {
+                graphics.compose(y, colors);
+                pixels.push_back(0);                            // No filter
+                pixels.append(reinterpret_cast<const char*>(colors), width);
+            }
+
+            std::string deflate;
+            deflate.push_back(0x78);                            // zlib header
+            deflate.push_back(0x01);
+            size_t at = 0;
+            do {
+                size_t length = std::min(pixels.size() - at, size_t(0xFFFF));
+                bool last = at + length == pixels.size();
+                deflate.push_back(last ? 1 : 0);                // Stored block
+                deflate.push_back(char(length));
+                deflate.push_back(char(length >> 8));
+                deflate.push_back(char(~length));
+                deflate.push_back(char(~length >> 8));
+                deflate.append(pixels, at, length);
+                at += length;
+            } while (at < pixels.size());
+
+            uint32_t a = 1, b = 0;
+            for (char c : pixels) {
+                a = (a + uint8_t(c)) % 65521;
+                b = (b + a) % 65521;
+            }
+            put_be32(deflate, b << 16 | a);
+
+            std::string header;
+            put_be32(header, width);
+            put_be32(header, height);
+            header += std::string("\x08\x03\x00\x00\x00", 5);  // 8-bit palette
+
+            std::string palette(reinterpret_cast<const char*>(kCapturePalette), sizeof(kCapturePalette));
+
+            std::string png("\x89PNG\r\n\x1a\n", 8);
+            put_chunk(png, "IHDR", header);
+            put_chunk(png, "PLTE", palette);
+            put_chunk(png, "IDAT", deflate);
+            put_chunk(png, "IEND", std::string());
+            return png;
+        }
+
+        std::string encode_ppm(const Graphics& graphics) {
+            int width = graphics.width();
+            int height = graphics.height();
+
+            std::string ppm = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+            uint8_t colors[kMaxGraphicsWidth];
+            for (int y = 0; y < height; y++) {
+                graphics.compose(y, colors);
+                for (int x = 0; x < width; x++)
+                    ppm.append(reinterpret_cast<const char*>(kCapturePalette[colors[x]]), 3);
+            }
+            return ppm;
+        }
+
+        bool plane_used(const Graphics& graphics, int plane) {
+            for (int y = 0; y < graphics.height(); y++) {
+                const uint64_t* row = graphics.row(plane, y);
+                for (int word = 0; word < kRowWords; word++) {
+                    if (row[word] != 0)
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        void write_raw(std::ostream& out, uint64_t number, const Graphics& graphics) {
+            int width = graphics.width();
+            int height = graphics.height();
+            uint8_t planes = plane_used(graphics, 1) ? 2 : 1;
+
+            put<uint64_t>(out, number);
+            put<uint16_t>(out, width);
+            put<uint16_t>(out, height);
+            put<uint8_t>(out, planes);
+            const uint8_t reserved[3] = { 0, 0, 0 };
+            out.write(reinterpret_cast<const char*>(reserved), sizeof(reserved));
+
+            char bytes[kMaxGraphicsWidth / 8];
+            for (int plane = 0; plane < planes; plane++) {
+                for (int y = 0; y < height; y++) {
+                    const uint64_t* row = graphics.row(plane, y);
+                    for (int i = 0; i < width / 8; i++)
+                        bytes[i] = char(row[i / 8] >> (56 - 8 * (i % 8)));
+                    out.write(bytes, width / 8);
+                }
+            }
+        }
+
+    } // namespace
+
+    bool parse_capture_format(const char* name, CaptureFormat& format) {
+        if (std::strcmp(name, "ppm") == 0)
+            format = kCapturePPM;
+        else if (std::strcmp(name, "png") == 0)
+            format = kCapturePNG;
+        else if (std::strcmp(name, "raw") == 0)
+            format = kCaptureRaw;
+        else
+            return false;
+        return true;
+    }
+
+    FrameCapture::Ring::Ring(size_t capacity) : _read(0), _written(0) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+
+        _indices.resize(size);
+        _mask = size - 1;
+    }
+
+    bool FrameCapture::Ring::push(uint32_t index) {
+        size_t written = _written.load(std::memory_order_relaxed);
+        if (written - _read.load(std::memory_order_acquire) == _indices.size())
+            return false;
+
+        _indices[written & _mask] = index;
+        _written.store(written + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool FrameCapture::Ring::pop(uint32_t& index) {
+        size_t read = _read.load(std::memory_order_relaxed);
+        if (read == _written.load(std::memory_order_acquire))
+            return false;
+
+        index = _indices[read & _mask];
+        _read.store(read + 1, std::memory_order_release);
+        return true;
+    }
+
+    FrameCapture::FrameCapture(const CaptureConfig& config)
+        : _config(config), _slots(std::max(config.queue, size_t(1))),
+          _queued(_slots.size()), _free(_slots.size()),
+          _last_hash(0), _captured(false), _duplicates(0), _dropped(0),
+          _written(0), _errors(0), _stop(false) {
+        _config.every = std::max(config.every, uint64_t(1));
+
+        for (size_t i = 0; i < _slots.size(); i++)
+            _free.push(uint32_t(i));
+
+        if (_config.format == kCaptureRaw) {
+            _raw.open(_config.path, std::ofstream::binary);
+            _raw.write(kRawMagic, sizeof(kRawMagic));
+            put<uint16_t>(_raw, kRawVersion);
+            put<uint16_t>(_raw, 0);
+            if (!_raw)
+                std::cout << "[capture] couldn't create '" << _config.path << "'" << std::endl;
+        }
+
+        _writer = std::thread(&FrameCapture::write_loop, this);
+    }
+
+    FrameCapture::~FrameCapture() {
+        finish();
+    }
+
+    bool FrameCapture::ok() const {
+        return _config.format != kCaptureRaw || bool(_raw);
+    }
+
+    void FrameCapture::frame(uint64_t number, const Graphics& graphics) {
+        if (number % _config.every != 0)
+            return;
+
+        uint64_t hash = graphics.hash();
+        if (_captured && hash == _last_hash) {
+            _duplicates++;
+            return;
+        }
+
+        uint32_t index;
+        if (!_free.pop(index)) {
+            _dropped++;
+            return;
+        }
+
+        Slot& slot = _slots[index];
+        slot.number = number;
+        graphics.save(slot.graphics);
+        _queued.push(index);
+
+        _last_hash = hash;
+        _captured = true;
+    }
+
+    void FrameCapture::finish() {
+        if (!_writer.joinable())
+            return;
+
+        _stop.store(true);
+        _writer.join();
+        _raw.close();
+    }
+
+    void FrameCapture::write_loop() {
+        for (;;) {
+            // Checked before looking at the queue, so everything queued
+            // before finish() is still written
+            bool stopping = _stop.load();
+
+            uint32_t index;
+            if (!_queued.pop(index)) {
+                if (stopping)
+                    return;
+                std::this_thread::sleep_for(kWriterIdle);
+                continue;
+            }
+
+            if (write(_slots[index]))
+                _written++;
+            else if (_errors++ == 0)
+                std::cout << "[capture] couldn't write frame " << _slots[index].number << std::endl;
+            _free.push(index);
+        }
+    }
+
+    bool FrameCapture::write(const Slot& slot) {
+        Graphics graphics;
+        graphics.restore(slot.graphics);
+
+        if (_config.format == kCaptureRaw) {
+            write_raw(_raw, slot.number, graphics);
+            return bool(_raw);
+        }
+
+        const char* extension = _config.format == kCapturePNG ? "png" : "ppm";
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), "-%08llu.%s", (unsigned long long)slot.number, extension);
+
+        std::ofstream out(_config.path + suffix, std::ofstream::binary);
+        std::string data = _config.format == kCapturePNG ? encode_png(graphics) : encode_ppm(graphics);
+        out.write(data.data(), data.size());
+        return bool(out);
+    }
+
+    uint64_t FrameCapture::written() const {
+        return _written.load();
+    }
+
+    uint64_t FrameCapture::duplicates() const {
+        return _duplicates;
+    }
+
+    uint64_t FrameCapture::dropped() const {
+        return _dropped;
+    }
+
+    uint64_t FrameCapture::errors() const {
+        return _errors.load();
+    }
+
+} // namespace Chip8
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graphics.h"
+
+namespace Chip8 {
+
+    enum CaptureFormat {
+        kCapturePPM,        // One binary PPM per frame
+        kCapturePNG,        // One PNG per frame
+        kCaptureRaw,        // All frames appended to one 1bpp stream
+    };
+
+    // "ppm", "png" or "raw"
+    bool parse_capture_format(const char* name, CaptureFormat& format);
+
+    struct CaptureConfig {
+        CaptureFormat format = kCapturePNG;
+
+        // Images go to <path>-<frame>.<ext>, a raw stream to path itself
+        std::string path;
+
+        // Only frames whose number is a multiple of this are considered
+        uint64_t every = 1;
+
+        // Frames that can wait for the writer before new ones are dropped
+        size_t queue = 64;
+    };
+
+    /**
+     * Writes emulated frames to disk in the background. frame() copies the
+     * screen into a buffer from a fixed pool and queues it; a writer thread
+     * encodes and writes it, then returns the buffer. The pool and queue are
+     * lock-free single-producer single-consumer rings, so the emulation
+     * thread never waits for the writer: when every buffer is queued the
+     * frame is dropped and counted instead. A frame that hashes the same as
+     * the last one queued is skipped.
+     */
+    class FrameCapture {
+    public:
+        explicit FrameCapture(const CaptureConfig& config);
+        ~FrameCapture();
+
+        // False if the raw stream couldn't be created
+        bool ok() const;
+
+        // Called at the end of each emulated frame
+        void frame(uint64_t number, const Graphics& graphics);
+
+        // Writes out everything queued and stops the writer. Called by the
+        // destructor if need be.
+        void finish();
+
+        uint64_t written() const;
+        uint64_t duplicates() const;
+        uint64_t dropped() const;
+        uint64_t errors() const;
+
+    private:
+        struct Slot {
+            uint64_t number;
+            GraphicsState graphics;
+        };
+
+        // Slot indices passed one way between the two threads
+        class Ring {
+        public:
+            explicit Ring(size_t capacity);
+            bool push(uint32_t index);
+            bool pop(uint32_t& index);
+
+        private:
+            std::vector<uint32_t> _indices;
+            size_t _mask;
+            std::atomic<size_t> _read;
+            std::atomic<size_t> _written;
+        };
+
+        void write_loop();
+        bool write(const Slot& slot);
+
+        CaptureConfig _config;
+        std::vector<Slot> _slots;
+        Ring _queued;
+        Ring _free;
+        std::ofstream _raw;
+
+        uint64_t _last_hash;
+        bool _captured;
+        uint64_t _duplicates;
+        uint64_t _dropped;
+        std::atomic<uint64_t> _written;
+        std::atomic<uint64_t> _errors;
+
+        std::atomic<bool> _stop;
+        std::thread _writer;
+    };
+
+} // namespace Chip8
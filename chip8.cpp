@@ -1,60 +1,608 @@
-#include "unistd.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <thread>
+
 #include "chip8.h"
+#include "handoff.h"
+#include "pacing.h"
 
 /**
  * 0x000-0x1FF Chip 8 interpreter
- * 0x050-0x0A0 4x5 pixel font set
- * 0x200-0xFFF Program ROM and work RAM
+ * 0x050-0x09F 4x5 pixel font set
+ * 0x0A0-0x13F 8x10 pixel font set
+ * 0x200-0xFFFF Program ROM and work RAM
  */
 
 namespace Chip8 {
 
-    Chip8::Chip8() {
-        SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+    const uint32_t kTimerHz = 60;
+
+    // Frames the interactive loop will run back to back to catch up before
+    // it gives up and drops the backlog
+    const int kMaxCatchUpFrames = 5;
+
+    typedef std::chrono::steady_clock Clock;
+
+    const Clock::duration kFrameDuration =
+        std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / kTimerHz;
+
+    // How often the presenting thread polls for input and new frames when
+    // presenting doesn't block on vsync
+    const Clock::duration kPollInterval = std::chrono::milliseconds(1);
+
+    // Unthrottled runs only time one frame in this many plus one, as
+    // reading the clock every frame would cost more than a short frame
+    // does. Counts are always exact.
+    const uint64_t kUnthrottledTimingMask = 15;
+
+    // _frame_carry of a frame resumed from a save state, which isn't
+    // planned again
+    const uint64_t kResumedFrame = ~uint64_t(0);
+
+    // Intervals this much over a frame count as late
+    const Clock::duration kLateFrame = kFrameDuration * 3 / 2;
+
+    struct Chip8::Session {
+        Session() : input(0), rewind(false), stop(false),
+                    steps(0), saves(0), loads(0), profiles(0), emulated(kLateFrame) {
+        }
+
+        FrameHandoff frames;
+
+        // Keypad bits in the low 16 bits, a sequence number bumped on every
+        // change above them
+        std::atomic<uint32_t> input;
+        std::atomic<bool> rewind;
+        std::atomic<bool> stop;
+
+        // Requests forwarded from the input backend
+        std::atomic<int> steps;
+        std::atomic<int> saves;
+        std::atomic<int> loads;
+        std::atomic<int> profiles;
+
+        // Written by the emulation thread, read once it has finished
+        TimingStats emulated;
+    };
+
+    namespace {
+
+        // Consumes one forwarded request, if there is one. Only the
+        // emulation thread takes, so the count can't drop below zero.
+        bool take(std::atomic<int>& requests) {
+            if (requests.load() == 0)
+                return false;
+
+            requests--;
+            return true;
+        }
+
+    } // namespace
+
+    Chip8::Chip8(Input* input, Video* video, Audio* audio)
+        : _input(input), _video(video), _audio(audio), _rewind(nullptr), _recorder(nullptr),
+          _capture(nullptr), _debugger(nullptr), _metrics(nullptr), _profiler(nullptr),
+          _frames(0), _frame(0), _in_frame(false), _timing_mask(kUnthrottledTimingMask),
+          _speed(kDefaultSpeed), _frame_left(0), _frame_error(0), _frame_carry(0) {
         _graphics.reset((new Graphics));
         _memory.reset((new Memory));
         _cpu.reset((new CPU(_graphics.get(), _memory.get())));
+        start_frame();
     }
 
-    Chip8::~Chip8() {
-        SDL_Quit();
+    bool Chip8::load_program(const uint8_t* program, size_t size) {
+        if (size > max_program_size(_cpu->quirks()))
+            return false;
+
+        return _memory->load(kProgramStart, program, size);
     }
 
-    void Chip8::load_program(std::ifstream& program) {
-        program.seekg(0, std::ios::end);
-        int size = program.tellg();
+    bool Chip8::reset(const uint8_t* program, size_t size) {
+        if (size > max_program_size(_cpu->quirks()))
+            return false;
+
+        _memory->reset();
+        _cpu->power_on();
+        _graphics->reset();
 
-        program.seekg(0, std::ios::beg);
-        for (int i=0; i<size; i++) {
-            _memory->putByte(0x200 + i, program.get());
+        _frame = 0;
+        _in_frame = false;
+        _frame_error = 0;
+        start_frame();
+
+        return load_program(program, size);
+    }
+
+    void Chip8::set_trace(Trace* trace) {
+        _cpu->set_trace(trace);
+    }
+
+    void Chip8::seed(uint64_t seed) {
+        _cpu->seed(seed);
+    }
+
+    bool Chip8::set_jit(bool enabled) {
+        return _cpu->set_jit(enabled);
+    }
+
+    void Chip8::set_quirks(QuirkProfile profile) {
+        _cpu->set_quirks(profile);
+    }
+
+    QuirkProfile Chip8::quirks() const {
+        return _cpu->quirks();
+    }
+
+    void Chip8::set_skip_idle(bool enabled) {
+        _cpu->set_skip_idle(enabled);
+    }
+
+    uint64_t Chip8::idle_skipped() const {
+        return _cpu->idle_skipped();
+    }
+
+    void Chip8::set_speed(uint32_t instructions_per_second) {
+        _speed = std::max(instructions_per_second, uint32_t(1));
+
+        // Otherwise the first frame after reset() would run at whatever
+        // speed was set before it
+        if (!_in_frame && _frame_carry != kResumedFrame) {
+            _frame_error = _frame_carry;
+            start_frame();
+        }
+    }
+
+    uint64_t Chip8::frame() const {
+        return _frame;
+    }
+
+    uint64_t Chip8::frames_presented() const {
+        return _frames;
+    }
+
+    const Graphics& Chip8::graphics() const {
+        return *_graphics;
+    }
+
+    const Memory& Chip8::memory() const {
+        return *_memory;
+    }
+
+    CPUState Chip8::cpu_state() const {
+        return _cpu->state();
+    }
+
+    void Chip8::save(MachineState& state) const {
+        state.cpu = _cpu->state();
+        std::copy(_memory->data(), _memory->data() + kMemorySize, state.memory);
+        _graphics->save(state.graphics);
+        state.frame_left = _frame_left;
+        state.frame_error = _frame_error;
+    }
+
+    void Chip8::restore(const MachineState& state) {
+        _cpu->restore(state.cpu);
+        _memory->restore(state.memory);
+        _graphics->restore(state.graphics);
+        _frame_left = state.frame_left;
+        _frame_error = state.frame_error;
+        _frame_carry = kResumedFrame;
+        _in_frame = false;
+    }
+
+    void Chip8::set_rewind(Rewind* rewind) {
+        _rewind = rewind;
+    }
+
+    void Chip8::set_state_file(const std::string& filename) {
+        _state_file = filename;
+    }
+
+    void Chip8::set_recorder(Movie* movie) {
+        _recorder = movie;
+    }
+
+    void Chip8::set_capture(FrameCapture* capture) {
+        _capture = capture;
+    }
+
+    void Chip8::set_debugger(Debugger* debugger) {
+        _debugger = debugger;
+        _cpu->set_debugger(debugger);
+        if (debugger != nullptr)
+            debugger->attach(_cpu.get(), _memory.get());
+        else
+            _memory->set_watcher(nullptr, nullptr);
+    }
+
+    void Chip8::set_metrics(Metrics* metrics) {
+        _metrics = metrics;
+    }
+
+    void Chip8::set_profiler(Profiler* profiler, const std::string& report_file,
+                             const std::string& folded_file) {
+        _profiler = profiler;
+        _report_file = report_file;
+        _folded_file = folded_file;
+        _cpu->set_profiler(profiler);
+    }
+
+    bool Chip8::write_profile() {
+        if (_profiler == nullptr)
+            return false;
+
+        bool ok = true;
+
+        if (!_report_file.empty()) {
+            std::ofstream out(_report_file);
+            _profiler->write_report(out);
+            if (!out) {
+                std::cout << "[chip8] couldn't write profile to '" << _report_file << "'" << std::endl;
+                ok = false;
+            }
+        }
+
+        if (!_folded_file.empty()) {
+            std::ofstream out(_folded_file);
+            _profiler->write_folded(out);
+            if (!out) {
+                std::cout << "[chip8] couldn't write folded stacks to '" << _folded_file << "'" << std::endl;
+                ok = false;
+            }
+        }
+
+        if (ok)
+            std::cout << "[chip8] Wrote profile of " << _profiler->instructions() << " instructions" << std::endl;
+        return ok;
+    }
+
+    void Chip8::save_file() {
+        MachineState state;
+        save(state);
+
+        std::ofstream out(_state_file, std::ofstream::binary);
+        if (_state_file.empty() || !write_state(out, state))
+            std::cout << "[chip8] couldn't save state to '" << _state_file << "'" << std::endl;
+        else
+            std::cout << "[chip8] Saved state to " << _state_file << std::endl;
+    }
+
+    void Chip8::load_file() {
+        // Like rewinding, this would desynchronise a recording from its
+        // keypad log
+        if (_recorder != nullptr) {
+            std::cout << "[chip8] can't load state while recording" << std::endl;
+            return;
+        }
+
+        MachineState state;
+
+        std::ifstream in(_state_file, std::ifstream::binary);
+        if (_state_file.empty() || !read_state(in, state)) {
+            std::cout << "[chip8] couldn't load state from '" << _state_file << "'" << std::endl;
+            return;
+        }
+
+        restore(state);
+        if (_rewind != nullptr)
+            _rewind->clear();
+        std::cout << "[chip8] Loaded state from " << _state_file << std::endl;
+    }
+
+    void Chip8::present() {
+        show(*_graphics);
+        _graphics->mark_clean();
+        _frames++;
+    }
+
+    bool Chip8::timing() const {
+        return _timing_mask == 0 || (_frame & _timing_mask) == 0;
+    }
+
+    void Chip8::show(const Graphics& graphics) {
+        if (_metrics == nullptr || !timing()) {
+            _video->present(graphics);
+            if (_metrics != nullptr)
+                _metrics->host.frames.add();
+            return;
+        }
+
+        Clock::time_point start = Clock::now();
+        _video->present(graphics);
+        Clock::time_point end = Clock::now();
+
+        _metrics->host.present.add(end - start);
+        if (_timing_mask == 0)
+            _metrics->host.frame.mark(end);
+        _metrics->host.frames.add();
+    }
+
+    void Chip8::poll_input() {
+        if (_metrics == nullptr || !timing()) {
+            _input->poll();
+            if (_metrics != nullptr)
+                _metrics->host.polls.add();
+            return;
+        }
+
+        Clock::time_point start = Clock::now();
+        _input->poll();
+        _metrics->host.poll.add(Clock::now() - start);
+        _metrics->host.polls.add();
+    }
+
+    void Chip8::run_cpu(uint64_t cycles) {
+        if (_metrics == nullptr || !timing()) {
+            _cpu->run(cycles);
+            if (_metrics != nullptr)
+                _metrics->emulation.instructions.add(cycles);
+            return;
+        }
+
+        Clock::time_point start = Clock::now();
+        _cpu->run(cycles);
+        _metrics->emulation.step.add(Clock::now() - start);
+        _metrics->emulation.instructions.add(cycles);
+    }
+
+    void Chip8::start_frame() {
+        // Spread speed / 60 over the frames without drifting, e.g. 700
+        // instructions per second alternates between 11 and 12 per frame
+        _frame_carry = _frame_error;
+        uint64_t total = _speed + _frame_error;
+        _frame_left = total / kTimerHz;
+        _frame_error = total % kTimerHz;
+    }
+
+    void Chip8::begin_frame(uint16_t keys) {
+        // The keypad is latched once, as the frame starts
+        if (_recorder != nullptr)
+            _recorder->record_keys(_frame, keys);
+
+        _cpu->set_keys(keys);
+        _in_frame = true;
+
+        if (_debugger != nullptr)
+            _debugger->poll();
+    }
+
+    void Chip8::end_frame() {
+        _audio->frame(_cpu->sound_on());
+        _cpu->tick_timers();
+        start_frame();
+
+        _frame++;
+        _in_frame = false;
+        if (_metrics != nullptr)
+            _metrics->emulation.frames.add();
+        if (_recorder != nullptr)
+            _recorder->record_hash(_frame, _graphics->hash());
+        if (_capture != nullptr)
+            _capture->frame(_frame, *_graphics);
+    }
+
+    void Chip8::finish_frame(uint16_t keys, bool rewinding) {
+        // Stepping back replaces emulation, one snapshot per frame
+        if (_rewind != nullptr && rewinding) {
+            MachineState state;
+            if (_rewind->pop(state))
+                restore(state);
+            _audio->frame(false);
+            return;
+        }
+
+        if (!_in_frame)
+            begin_frame(keys);
+        run_cpu(_frame_left);
+        end_frame();
+
+        if (_rewind != nullptr) {
+            MachineState state;
+            save(state);
+            _rewind->push(state);
+        }
+    }
+
+    void Chip8::publish(Session& session, uint32_t input) {
+        Frame& frame = session.frames.back();
+        _graphics->save(frame.graphics);
+        frame.number = _frame;
+        frame.input = input;
+        frame.finished = Clock::now();
+
+        _graphics->mark_clean();
+        session.frames.publish();
+        session.emulated.mark(frame.finished);
+    }
+
+    void Chip8::emulate(Session& session) {
+        Clock::time_point next_frame = Clock::now();
+
+        while (!session.stop.load()) {
+            uint32_t input = session.input.load();
+
+            while (take(session.saves))
+                save_file();
+            while (take(session.loads))
+                load_file();
+            while (take(session.profiles))
+                write_profile();
+
+            while (take(session.steps)) {
+                // An instruction outside any frame isn't in the recording
+                // either, so it wouldn't replay
+                if (_recorder != nullptr) {
+                    std::cout << "[chip8] can't step while recording" << std::endl;
+                    continue;
+                }
+                _cpu->run_cycle();
+                _cpu->dump();
+                publish(session, input >> 16);
+            }
+
+            // Run every 60hz frame that's due, then hand over the last one
+            Clock::time_point now = Clock::now();
+            int frames = 0;
+
+            while (now >= next_frame && frames < kMaxCatchUpFrames) {
+                input = session.input.load();
+                finish_frame(uint16_t(input), session.rewind.load());
+                next_frame += kFrameDuration;
+                frames++;
+            }
+
+            if (now >= next_frame)
+                next_frame = now + kFrameDuration;
+
+            if (frames > 0)
+                publish(session, input >> 16);
+            std::this_thread::sleep_until(next_frame);
         }
     }
 
     void Chip8::run() {
-        bool quit = false;
-        SDL_Event event;
+        // Paced frames are few enough to time every one of them
+        _timing_mask = 0;
 
-        while (!quit) {
-            _cpu->run_cycle();
+        Session session;
+        std::thread emulation(&Chip8::emulate, this, std::ref(session));
 
-            if (_graphics->dirty())
-                _graphics->refresh();
-
-            while (SDL_PollEvent(&event)) {
-                if (event.type == SDL_QUIT)
-                    quit = true;
-                if (event.type == SDL_KEYDOWN) {
-                    if (event.key.keysym.sym == SDLK_s) {
-                        _cpu->run_cycle();
-                        _graphics->refresh();
-                    }
-                    if (event.key.keysym.sym == SDLK_q) {
-                        quit = true;
-                    }
+        // What's on screen, and the first keypad change no frame on screen
+        // has been emulated with yet
+        Graphics screen;
+        Frame shown = Frame();
+        uint16_t keys = 0;
+        uint32_t sequence = 0;
+        uint32_t pending = 0;
+        Clock::time_point pending_since;
+        Clock::time_point last_present;
+        uint64_t last_number = ~uint64_t(0);
+        uint64_t last_overwritten = 0;
+
+        TimingStats presented(kLateFrame);
+        TimingStats latency;
+
+        while (!_input->quit_requested()) {
+            poll_input();
+
+            Clock::time_point now = Clock::now();
+            if (_input->keys() != keys) {
+                keys = _input->keys();
+                sequence = sequence % 0xFFFF + 1;
+                if (pending == 0) {
+                    pending = sequence;
+                    pending_since = now;
+                }
+                session.input.store(sequence << 16 | keys);
+            }
+            session.rewind.store(_input->rewind_held());
+
+            while (_input->save_requested())
+                session.saves++;
+            while (_input->load_requested())
+                session.loads++;
+            while (_input->profile_requested())
+                session.profiles++;
+            while (_input->step_requested())
+                session.steps++;
+
+            if (!session.frames.acquire()) {
+                std::this_thread::sleep_for(kPollInterval);
+                continue;
+            }
+
+            // Unchanged frames are only presented to time a keypad change, or
+            // while the video still has a fade or an overlay to update
+            const Frame& frame = session.frames.front();
+            bool responds = pending != 0 && uint16_t(frame.input - pending) < 0x8000;
+            bool changed = std::memcmp(&frame.graphics, &shown.graphics, sizeof(frame.graphics)) != 0;
+            shown = frame;
+
+            if (changed || responds || _video->animating()) {
+                screen.restore(frame.graphics);
+                show(screen);
+                _frames++;
+
+                // Pacing only counts intervals where every frame in between
+                // was meant to be shown, not ones where the screen sat still
+                now = Clock::now();
+                uint64_t overwritten = session.frames.overwritten();
+                if (frame.number - last_number == overwritten - last_overwritten + 1)
+                    presented.add(now - last_present);
+                last_present = now;
+                last_number = frame.number;
+                last_overwritten = overwritten;
+            }
+
+            if (responds) {
+                latency.add(now - pending_since);
+                pending = 0;
+            }
+        }
+
+        session.stop.store(true);
+        if (_debugger != nullptr)
+            _debugger->close();
+        emulation.join();
+        _timing_mask = kUnthrottledTimingMask;
+
+        std::cout << "[chip8] Emulated frames: ";
+        session.emulated.write(std::cout);
+        std::cout << std::endl << "[chip8] Presented frames: ";
+        presented.write(std::cout);
+        std::cout << ", " << session.frames.overwritten() << " never shown" << std::endl
+            << "[chip8] Input to photon: ";
+        latency.write(std::cout);
+        std::cout << std::endl;
+    }
+
+    uint64_t Chip8::run_cycles(uint64_t cycles) {
+        uint64_t executed = 0;
+
+        // Emulated time only: the timers tick every speed / 60 instructions,
+        // and input is polled once per emulated frame
+        while (executed < cycles) {
+            uint64_t n = std::min(_frame_left, cycles - executed);
+
+            if (!_in_frame)
+                begin_frame(_input->keys());
+            run_cpu(n);
+            executed += n;
+            _frame_left -= n;
+
+            if (_frame_left == 0) {
+                end_frame();
+                poll_input();
+
+                if (_graphics->dirty()) {
+                    present();
                 }
             }
         }
+
+        return executed;
     }
 
-} // namespace Chip8
+    uint64_t Chip8::run_frames(uint64_t frames) {
+        uint64_t executed = 0;
+        uint64_t last = _frame + frames;
+
+        while (_frame < last) {
+            if (!_in_frame)
+                begin_frame(_input->keys());
+            run_cpu(_frame_left);
+            executed += _frame_left;
+            end_frame();
+            poll_input();
+
+            if (_graphics->dirty())
+                present();
+        }
 
+        return executed;
+    }
+
+} // namespace Chip8
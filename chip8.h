@@ -4,29 +4,156 @@
 #include <cstdint>
 #include <fstream>
 #include <memory>
-
-#include "SDL2/SDL.h"
+#include <string>
 
 #include "cpu.h"
 #include "memory.h"
 #include "graphics.h"
-#include "audio.h"
+#include "backend.h"
+#include "capture.h"
+#include "debugger.h"
+#include "metrics.h"
+#include "trace.h"
+#include "savestate.h"
+#include "rewind.h"
+#include "movie.h"
+#include "profile.h"
+#include "rom.h"
 
 namespace Chip8 {
 
+    const uint32_t kDefaultSpeed = 700;
+
     class Chip8 {
     public:
-        Chip8();
-        ~Chip8();
+        // Backends are borrowed and must outlive the machine
+        Chip8(Input* input, Video* video, Audio* audio);
+
+        // Copies a ROM image to 0x200. Returns false if it doesn't fit.
+        bool load_program(const uint8_t* program, size_t size);
+
+        // Power cycles the machine with a new program, keeping the backends,
+        // settings and decoded code for bytes that don't change. Costs about
+        // the program size plus whatever memory the last one wrote to.
+        bool reset(const uint8_t* program, size_t size);
+
+        void set_trace(Trace* trace);
+        void seed(uint64_t seed);
+        bool set_jit(bool enabled);
+
+        // Interpreter behaviour the program expects, see quirks.h
+        void set_quirks(QuirkProfile profile);
+        QuirkProfile quirks() const;
+
+        // Skipping through busy-wait loops, see CPU::set_skip_idle()
+        void set_skip_idle(bool enabled);
+        uint64_t idle_skipped() const;
 
-        void load_program(std::ifstream& program);
+        // Instructions per second. The timers always run at 60hz; the CPU
+        // runs speed / 60 instructions per timer tick. A frame that hasn't
+        // started yet is planned again at the new speed.
+        void set_speed(uint32_t instructions_per_second);
+
+        // Interactive loop, runs until the input backend requests to quit.
+        // Emulation runs on its own thread, paced off a monotonic clock in
+        // 60hz frames, and hands finished frames to the calling thread
+        // through a triple buffer. The calling thread polls input and
+        // presents, so a present blocked on vsync never holds up emulation.
+        // Frame pacing and input-to-photon latency are reported at the end.
         void run();
 
+        // Execute the given number of instructions as fast as possible,
+        // presenting at the end of each emulated frame without any pacing
+        uint64_t run_cycles(uint64_t cycles);
+
+        // Same, but runs to the end of the given number of frames. Returns
+        // the number of instructions executed.
+        uint64_t run_frames(uint64_t frames);
+
+        // Emulated 60hz frames completed so far
+        uint64_t frame() const;
+        uint64_t frames_presented() const;
+
+        const Graphics& graphics() const;
+        const Memory& memory() const;
+        CPUState cpu_state() const;
+
+        void save(MachineState& state) const;
+        void restore(const MachineState& state);
+
+        // While set, run() snapshots every frame into it and steps back
+        // through it while the input backend holds rewind
+        void set_rewind(Rewind* rewind);
+
+        // Where run() saves and loads state when the input backend asks
+        void set_state_file(const std::string& filename);
+
+        // Records the keypad and screen hashes into movie while set
+        void set_recorder(Movie* movie);
+
+        // Hands every finished frame to capture while set
+        void set_capture(FrameCapture* capture);
+
+        // Lets debugger stop and inspect the machine while set. run() closes
+        // it on the way out, so a stopped machine doesn't hold up quitting.
+        void set_debugger(Debugger* debugger);
+
+        // Counts instructions, frames and host-side timings into metrics
+        // while set. run() times every frame, the unthrottled runs only a
+        // sample of them.
+        void set_metrics(Metrics* metrics);
+
+        // Profiles the guest while set. write_profile() writes the report
+        // and folded stacks to the given files (either may be empty), and
+        // run() calls it whenever the input backend asks.
+        void set_profiler(Profiler* profiler, const std::string& report_file,
+                          const std::string& folded_file);
+        bool write_profile();
+
     private:
+        // State shared between run() and the emulation thread
+        struct Session;
+
+        void emulate(Session& session);
+        void publish(Session& session, uint32_t input);
+        void present();
+        bool timing() const;
+        void show(const Graphics& graphics);
+        void poll_input();
+        void run_cpu(uint64_t cycles);
+        void start_frame();
+        void begin_frame(uint16_t keys);
+        void end_frame();
+        void finish_frame(uint16_t keys, bool rewinding);
+        void save_file();
+        void load_file();
+
         std::unique_ptr<Graphics> _graphics;
         std::unique_ptr<Memory> _memory;
         std::unique_ptr<CPU> _cpu;
-        std::unique_ptr<Audio> _audio;
+
+        Input* _input;
+        Video* _video;
+        Audio* _audio;
+        Rewind* _rewind;
+        Movie* _recorder;
+        FrameCapture* _capture;
+        Debugger* _debugger;
+        Metrics* _metrics;
+        Profiler* _profiler;
+        std::string _state_file;
+        std::string _report_file;
+        std::string _folded_file;
+
+        uint64_t _frames;
+        uint64_t _frame;
+        bool _in_frame;
+        uint64_t _timing_mask;          // Metrics time frames whose number & mask is 0
+
+        uint32_t _speed;
+        uint64_t _frame_left;
+        uint64_t _frame_error;
+        uint64_t _frame_carry;          // _frame_error going into this frame's plan
     };
 
 } // namespace Chip8
@@ -0,0 +1,352 @@
+#include <cstddef>
+#include <cstring>
+#include <new>
+
+#include "compact.h"
+#include "memory.h"
+
+namespace Chip8 {
+
+    const uint16_t kCompactMask = kCompactMemorySize - 1;
+    const int kCompactAlignment = 64;
+
+    namespace {
+
+        struct PowerOnImage {
+            uint8_t bytes[kCompactMemorySize];
+
+            PowerOnImage() {
+                for (int i = 0; i < kCompactMemorySize; i++)
+                    bytes[i] = Memory::power_on_byte(i);
+            }
+        };
+
+        const PowerOnImage& power_on_image() {
+            static const PowerOnImage image;
+            return image;
+        }
+
+        // Same generator as CPU::next_random()
+        uint8_t next_random(CompactMachine& m) {
+            uint64_t z = (m.random += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return uint8_t((z ^ (z >> 31)) >> 56);
+        }
+
+        void power_on(CompactMachine& m) {
+            std::memset(m.registers, 0, sizeof(m.registers));
+            std::memset(m.stack, 0, sizeof(m.stack));
+            m.index_register = 0;
+            m.program_counter = 0x200;
+            m.keys = 0;
+            m.stack_pointer = 0;
+            m.delay_timer = 0;
+            m.sound_timer = 0;
+            m.waiting = 0;
+            m.wait_register = 0;
+            m.frame = 0;
+            std::memset(m.screen, 0, sizeof(m.screen));
+            std::memcpy(m.memory, power_on_image().bytes, sizeof(m.memory));
+        }
+
+        inline uint8_t byte_at(const CompactMachine& m, int location) {
+            return m.memory[location & kCompactMask];
+        }
+
+        inline uint16_t skip_length(const CompactMachine& m, const Quirks& quirks) {
+            if (quirks.long_skip && byte_at(m, m.program_counter + 2) == 0xF0 &&
+                byte_at(m, m.program_counter + 3) == 0x00)
+                return 4;
+            return 2;
+        }
+
+        inline void advance_index(CompactMachine& m, const Quirks& quirks, int x) {
+            if (quirks.index == kIndexPlusX)
+                m.index_register += x;
+            else if (quirks.index == kIndexPlusX1)
+                m.index_register += x + 1;
+        }
+
+        bool draw(CompactMachine& m, int x, int y, int rows, bool wrap) {
+            x %= kGraphicsWidth;
+            y %= kGraphicsHeight;
+
+            uint64_t collision = 0;
+            for (int i = 0; i < rows; i++) {
+                int row = y + i;
+                if (row >= kGraphicsHeight) {
+                    if (!wrap)
+                        break;
+                    row -= kGraphicsHeight;
+                }
+
+                // Whatever goes past column 63 is lost, or comes back
+                // around at column 0
+                uint64_t top = uint64_t(byte_at(m, m.index_register + i)) << 56;
+                uint64_t bits = top >> x;
+                if (wrap && x > 0)
+                    bits |= top << (64 - x);
+
+                collision |= m.screen[row] & bits;
+                m.screen[row] ^= bits;
+            }
+            return collision != 0;
+        }
+
+    } // namespace
+
+    CompactMachine* compact_create(void* arena, size_t count, QuirkProfile quirks) {
+        CompactMachine* machines = static_cast<CompactMachine*>(arena);
+        for (size_t i = 0; i < count; i++) {
+            CompactMachine& m = machines[i];
+            std::memset(&m, 0, offsetof(CompactMachine, screen));
+            m.quirks = quirks;
+            power_on(m);
+        }
+        return machines;
+    }
+
+    bool compact_reset(CompactMachine& m, const uint8_t* program, size_t size) {
+        if (size > size_t(kCompactMemorySize - 0x200))
+            return false;
+
+        power_on(m);
+        std::memcpy(m.memory + 0x200, program, size);
+        return true;
+    }
+
+    void compact_set_keys(CompactMachine& m, uint16_t keys) {
+        uint16_t pressed = keys & ~m.keys;
+        m.keys = keys;
+
+        if (m.waiting && pressed != 0) {
+            uint8_t key = 0;
+            while (!((pressed >> key) & 1))
+                key++;
+
+            m.registers[m.wait_register] = key;
+            m.program_counter += 2;
+            m.waiting = 0;
+        }
+    }
+
+    void compact_run(CompactMachine& m, uint64_t cycles) {
+        // The same handlers as the CPU's, inlined into one switch. Anything
+        // the CPU wouldn't move past (unknown opcodes, and here SUPER-CHIP
+        // and XO-CHIP too) ends the run early, as the rest of the budget
+        // would only execute it again.
+        const Quirks& quirks = kProfileQuirks[m.quirks];
+        uint8_t* v = m.registers;
+
+        for (uint64_t i = 0; i < cycles && !m.waiting; i++) {
+            uint16_t pc = m.program_counter;
+            uint16_t op = byte_at(m, pc) << 8 | byte_at(m, pc + 1);
+            uint8_t x = (op >> 8) & 0xF;
+            uint8_t y = (op >> 4) & 0xF;
+            uint8_t kk = op & 0xFF;
+            uint16_t nnn = op & 0xFFF;
+
+            switch (op >> 12) {
+                case 0x0:
+                    if (op == 0x00E0) {
+                        std::memset(m.screen, 0, sizeof(m.screen));
+                    } else if (op == 0x00EE) {
+                        m.stack_pointer--;
+                        m.program_counter = m.stack[m.stack_pointer & 0xF];
+                        continue;
+                    } else if ((op & 0xFFE0) == 0x00C0 || (op >= 0x00FB && op <= 0x00FF)) {
+                        return;
+                    }
+                    break;
+
+                case 0x1:
+                    m.program_counter = nnn;
+                    continue;
+
+                case 0x2:
+                    m.stack[m.stack_pointer & 0xF] = pc + 2;
+                    m.stack_pointer++;
+                    m.program_counter = nnn;
+                    continue;
+
+                case 0x3:
+                    if (v[x] == kk)
+                        m.program_counter += skip_length(m, quirks);
+                    break;
+
+                case 0x4:
+                    if (v[x] != kk)
+                        m.program_counter += skip_length(m, quirks);
+                    break;
+
+                case 0x5:
+                    if ((op & 0xF) == 0x2 || (op & 0xF) == 0x3)
+                        return;
+                    if (v[x] == v[y])
+                        m.program_counter += skip_length(m, quirks);
+                    break;
+
+                case 0x6: v[x] = kk; break;
+                case 0x7: v[x] += kk; break;
+
+                case 0x8:
+                    switch (op & 0xF) {
+                        case 0x0: v[x] = v[y]; break;
+                        case 0x1: v[x] |= v[y]; if (quirks.reset_vf) v[0xF] = 0; break;
+                        case 0x2: v[x] &= v[y]; if (quirks.reset_vf) v[0xF] = 0; break;
+                        case 0x3: v[x] ^= v[y]; if (quirks.reset_vf) v[0xF] = 0; break;
+                        case 0x4: {
+                            uint16_t sum = v[x] + v[y];
+                            v[0xF] = (sum > 0xFF) ? 1 : 0;
+                            v[x] = sum & 0xFF;
+                            break;
+                        }
+                        case 0x5:
+                            v[0xF] = v[y] > v[x] ? 0 : 1;
+                            v[x] -= v[y];
+                            break;
+                        case 0x6: {
+                            uint8_t source = quirks.shift_vx ? x : y;
+                            v[0xF] = v[source] & 0x01;
+                            v[x] = v[source] >> 1;
+                            break;
+                        }
+                        case 0x7:
+                            v[0xF] = v[x] > v[y] ? 0 : 1;
+                            v[x] = v[y] - v[x];
+                            break;
+                        case 0xE: {
+                            uint8_t source = quirks.shift_vx ? x : y;
+                            v[0xF] = v[source] >> 7;
+                            v[x] = v[source] << 1;
+                            break;
+                        }
+                    }
+                    break;
+
+                case 0x9:
+                    if (v[x] != v[y])
+                        m.program_counter += skip_length(m, quirks);
+                    break;
+
+                case 0xA: m.index_register = nnn; break;
+
+                case 0xB:
+                    m.program_counter = nnn + v[quirks.jump_vx ? x : 0];
+                    continue;
+
+                case 0xC: v[x] = next_random(m) & kk; break;
+
+                case 0xD:
+                    // DXY0 is SUPER-CHIP's 16x16 sprite
+                    if ((op & 0xF) == 0 && quirks.big_sprite)
+                        return;
+                    v[0xF] = draw(m, v[x], v[y], op & 0xF, quirks.wrap);
+                    break;
+
+                case 0xE:
+                    if (kk == 0x9E && ((m.keys >> (v[x] & 0xF)) & 1))
+                        m.program_counter += skip_length(m, quirks);
+                    else if (kk == 0xA1 && !((m.keys >> (v[x] & 0xF)) & 1))
+                        m.program_counter += skip_length(m, quirks);
+                    break;
+
+                case 0xF:
+                    switch (kk) {
+                        case 0x00:
+                            if (op == 0xF000)
+                                return;
+                            break;
+                        case 0x01: case 0x30: case 0x75: case 0x85:
+                            return;
+                        case 0x07: v[x] = m.delay_timer; break;
+                        case 0x0A:
+                            m.waiting = 1;
+                            m.wait_register = x;
+                            continue;
+                        case 0x15: m.delay_timer = v[x]; break;
+                        case 0x18: m.sound_timer = v[x]; break;
+                        case 0x1E: m.index_register += v[x]; break;
+                        case 0x29: m.index_register = Memory::getFontLocation() + v[x]; break;
+                        case 0x33: {
+                            int mod = 100;
+                            for (int d = 0; d < 3; d++) {
+                                m.memory[(m.index_register + d) & kCompactMask] = v[x] % mod;
+                                mod /= 10;
+                            }
+                            break;
+                        }
+                        case 0x55: {
+                            uint16_t index = m.index_register;
+                            advance_index(m, quirks, x);
+                            for (int r = 0; r <= x; r++)
+                                m.memory[(index + r) & kCompactMask] = v[r];
+                            break;
+                        }
+                        case 0x65:
+                            for (int r = 0; r <= x; r++)
+                                v[r] = byte_at(m, m.index_register + r);
+                            advance_index(m, quirks, x);
+                            break;
+                    }
+                    break;
+            }
+
+            m.program_counter += 2;
+        }
+    }
+
+    void compact_tick_timers(CompactMachine& m) {
+        if (m.delay_timer > 0)
+            m.delay_timer--;
+        if (m.sound_timer > 0)
+            m.sound_timer--;
+    }
+
+    void compact_run_frame(CompactMachine& m, uint16_t keys, uint64_t cycles) {
+        compact_set_keys(m, keys);
+        compact_run(m, cycles);
+        compact_tick_timers(m);
+        m.frame++;
+    }
+
+    uint64_t compact_hash(const CompactMachine& m) {
+        // Graphics::hash() of a lo-res screen: the resolution byte, the
+        // first plane's rows and then an empty second plane
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        hash *= 0x100000001b3ULL;
+
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            for (int y = 0; y < kGraphicsHeight; y++) {
+                uint64_t row = plane == 0 ? m.screen[y] : 0;
+                for (int shift = 56; shift >= 0; shift -= 8) {
+                    hash ^= (row >> shift) & 0xFF;
+                    hash *= 0x100000001b3ULL;
+                }
+            }
+        }
+
+        return hash;
+    }
+
+    CompactArena::CompactArena(size_t count, QuirkProfile quirks) : _count(count) {
+        _block = ::operator new(count * sizeof(CompactMachine) + kCompactAlignment);
+        uintptr_t address = reinterpret_cast<uintptr_t>(_block);
+        address = (address + kCompactAlignment - 1) & ~uintptr_t(kCompactAlignment - 1);
+        _machines = compact_create(reinterpret_cast<void*>(address), count, quirks);
+    }
+
+    CompactArena::~CompactArena() {
+        ::operator delete(_block);
+    }
+
+    CompactMachine& CompactArena::operator[](size_t i) {
+        return _machines[i];
+    }
+
+    size_t CompactArena::size() const {
+        return _count;
+    }
+
+} // namespace Chip8
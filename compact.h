@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "graphics.h"
+#include "quirks.h"
+
+namespace Chip8 {
+
+    const int kCompactMemorySize = 4096;
+
+    /**
+     * A whole lo-res CHIP-8 machine in one flat struct, for holding very
+     * many instances densely, e.g. for search or fuzzing. No pointers, no
+     * backends and no decode cache: it's trivially copyable, so copying a
+     * machine is a memcpy, and it's 4480 bytes, a whole number of cache
+     * lines with the registers and stack on the first one.
+     *
+     * Runs the original CHIP-8 instruction set with the quirks of the given
+     * profile, giving the same results as the CPU for programs that stay
+     * within 4 KiB and low resolution. SUPER-CHIP and XO-CHIP instructions
+     * stop it where they are, like unknown opcodes do on the CPU.
+     */
+    struct CompactMachine {
+        uint8_t registers[16];
+        uint16_t stack[16];
+        uint16_t index_register;
+        uint16_t program_counter;
+        uint16_t keys;
+        uint8_t stack_pointer;
+        uint8_t delay_timer;
+        uint8_t sound_timer;
+        uint8_t waiting;            // Parked on FX0A
+        uint8_t wait_register;
+        uint8_t quirks;             // QuirkProfile
+        uint8_t reserved[4];
+        uint64_t random;            // CXNN generator state
+        uint64_t frame;             // Emulated frames completed
+        uint8_t padding[48];
+
+        // One word per row, leftmost pixel in the most significant bit, as
+        // in Graphics' first plane
+        uint64_t screen[kGraphicsHeight];
+        uint8_t memory[kCompactMemorySize];
+    };
+
+    static_assert(sizeof(CompactMachine) % 64 == 0, "machines should fill whole cache lines");
+    static_assert(sizeof(CompactMachine) < 5 * 1024, "machines should stay under 5 KiB");
+
+    // Powers on count machines placed back to back in caller-provided
+    // memory of at least count * sizeof(CompactMachine) bytes, suitably
+    // aligned (64 bytes keeps each machine on its own cache lines)
+    CompactMachine* compact_create(void* arena, size_t count, QuirkProfile quirks = kDefaultQuirks);
+
+    // Back to power-on with a new program at 0x200, keeping the quirks and
+    // generator. False if the program doesn't fit.
+    bool compact_reset(CompactMachine& m, const uint8_t* program, size_t size);
+
+    // Keypad as of this frame, bit N set while key N is held. Wakes the
+    // machine from FX0A if a key went down since the last call.
+    void compact_set_keys(CompactMachine& m, uint16_t keys);
+
+    // Executes up to cycles instructions, fewer if it parks on FX0A
+    void compact_run(CompactMachine& m, uint64_t cycles);
+
+    void compact_tick_timers(CompactMachine& m);
+
+    // One 60hz frame: latch keys, run, tick the timers
+    void compact_run_frame(CompactMachine& m, uint16_t keys, uint64_t cycles);
+
+    // Same value as Graphics::hash() for the same screen
+    uint64_t compact_hash(const CompactMachine& m);
+
+    /**
+     * One 64-byte aligned allocation holding count machines, for callers
+     * that don't have memory of their own to place them in.
+     */
+    class CompactArena {
+    public:
+        explicit CompactArena(size_t count, QuirkProfile quirks = kDefaultQuirks);
+        ~CompactArena();
+
+        CompactArena(const CompactArena&) = delete;
+        CompactArena& operator=(const CompactArena&) = delete;
+
+        CompactMachine& operator[](size_t i);
+        size_t size() const;
+
+    private:
+        void* _block;
+        CompactMachine* _machines;
+        size_t _count;
+    };
+
+} // namespace Chip8
@@ -1,11 +1,18 @@
 #include <iostream>
-#include <iomanip>
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
-#include <ctime>
+#include <cstring>
+#include <sys/mman.h>
 
 #include "cpu.h"
+#include "debugger.h"
 #include "graphics.h"
+#include "idle.h"
 #include "memory.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
 
 namespace Chip8 {
 
@@ -16,282 +23,917 @@ namespace Chip8 {
     const uint16_t kImmediateMask = 0x00FF;
     const uint16_t kLastNibble    = 0x000F;
 
-    const SDL_Keycode kKeyCodeMap[16] = {
-        SDLK_0, SDLK_1, SDLK_2, SDLK_3,
-        SDLK_4, SDLK_5, SDLK_6, SDLK_7,
-        SDLK_8, SDLK_9, SDLK_a, SDLK_b,
-        SDLK_c, SDLK_d, SDLK_e, SDLK_f,
-    };
+    const size_t kCacheBytes = kMemorySize * sizeof(Instruction);
 
-    CPU::CPU(Graphics* g, Memory* m) : _g(g), _m(m) {
-        std::srand(std::time(0));
+    CPU::CPU(Graphics* g, Memory* m) : _random(0), _keys(0), _g(g), _m(m), _trace(nullptr), _profiler(nullptr), _debugger(nullptr),
+          _skip_idle(true), _idle_length(0), _idle_skipped(0), _quirks(kDefaultQuirks),
+          _address_mask(kProfileQuirks[kDefaultQuirks].address_mask), _decode(&CPU::decode<kDefaultQuirks>) {
+        // Anonymous pages read as zero, i.e. nothing decoded, until written
+        void* cache = mmap(nullptr, kCacheBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cache == MAP_FAILED) {
+            std::cerr << "[cpu] couldn't map the decode cache" << std::endl;
+            std::abort();
+        }
+        _cache = static_cast<Instruction*>(cache);
+
+        _m->set_listener(this);
+        _m->set_address_mask(_address_mask);
         reset();
     }
 
+    CPU::~CPU() {
+        munmap(_cache, kCacheBytes);
+    }
+
     void CPU::reset() {
+        power_on();
+        invalidate_all();
+
+        if (_jit)
+            _jit->flush();
+    }
+
+    void CPU::power_on() {
         _program_counter = 0x200;
         _delay_timer = 0;
         _sound_timer = 0;
+        _keys = 0;
+        _waiting = false;
+        _wait_register = 0;
         _stack_pointer = 0;
         _index_register = 0;
 
         std::fill_n(_registers, sizeof(_registers), 0);
+        std::fill_n(_flags, sizeof(_flags), 0);
+        std::fill_n(_stack, kStackSize, 0);
+    }
+
+    void CPU::set_trace(Trace* trace) {
+        _trace = trace;
+    }
+
+    void CPU::set_quirks(QuirkProfile profile) {
+        // One decoder per profile, each picking that profile's handlers
+        static Instruction (* const decoders[kQuirkProfiles])(OpCode) = {
+            &CPU::decode<kQuirksVip>,
+            &CPU::decode<kQuirksChip48>,
+            &CPU::decode<kQuirksSuperChip>,
+            &CPU::decode<kQuirksModern>,
+        };
+
+        if (profile == _quirks)
+            return;
+
+        _quirks = profile;
+        _address_mask = kProfileQuirks[profile].address_mask;
+        _decode = decoders[profile];
+        _m->set_address_mask(_address_mask);
+        invalidate_all();
+
+        if (_jit)
+            _jit->set_quirks(kProfileQuirks[profile]);
+    }
+
+    void CPU::set_skip_idle(bool enabled) {
+        if (enabled == _skip_idle)
+            return;
+
+        _skip_idle = enabled;
+        invalidate_all();
+
+        if (_jit)
+            _jit->set_skip_idle(enabled);
+    }
+
+    uint64_t CPU::idle_skipped() const {
+        return _idle_skipped;
+    }
+
+    QuirkProfile CPU::quirks() const {
+        return _quirks;
+    }
+
+    void CPU::set_profiler(Profiler* profiler) {
+        _profiler = profiler;
+    }
+
+    void CPU::set_debugger(Debugger* debugger) {
+        _debugger = debugger;
+    }
+
+    bool CPU::set_jit(bool enabled) {
+        if (!enabled) {
+            _jit.reset();
+            return true;
+        }
+
+        if (_jit)
+            return true;
+
+        _jit.reset(new Jit);
+        if (!_jit->ready()) {
+            _jit.reset();
+            return false;
+        }
+        _jit->set_quirks(kProfileQuirks[_quirks]);
+        _jit->set_skip_idle(_skip_idle);
+        return true;
+    }
+
+    void CPU::on_write(int location) {
+        // An instruction starting at the byte before also covers this one.
+        // Entries that were never decoded are left alone, so writing data
+        // doesn't commit cache pages for it.
+        for (int i = location - 1; i <= location; i++) {
+            Instruction& in = _cache[i & _address_mask];
+            if (in.handler != nullptr)
+                in.handler = nullptr;
+        }
+
+        if (_jit)
+            _jit->on_write(location);
+    }
+
+    void CPU::invalidate_all() {
+#if defined(__linux__)
+        // Hands the pages back; they read as zero again when next touched
+        if (madvise(_cache, kCacheBytes, MADV_DONTNEED) == 0)
+            return;
+#endif
+        std::memset(_cache, 0, kCacheBytes);
+    }
+
+    bool CPU::tracing() const {
+#ifdef CHIP8_TRACE
+        return _trace != nullptr && _trace->level() != kTraceOff;
+#else
+        return false;
+#endif
     }
 
     void CPU::run_cycle() {
-        // Decode instruction
-        OpCode op = _m->getByte(_program_counter) << 8 | _m->getByte(_program_counter + 1);
+#ifdef CHIP8_TRACE
+        if (tracing()) {
+            traced_step();
+            return;
+        }
+#endif
+        step();
+    }
+
+#ifdef CHIP8_TRACE
+    void CPU::traced_step() {
+        TraceRecord record;
+        uint8_t before[16];
+
+        record.pc = _program_counter;
+        record.op = _m->peek(_program_counter) << 8 | _m->peek(_program_counter + 1);
+        record.level = _trace->level();
+        record.padding = 0;
+        std::copy(_registers, _registers + 16, before);
+
+        step();
+
+        record.next_pc = _program_counter;
+        record.index_register = _index_register;
+        record.stack_pointer = _stack_pointer;
+        record.delay_timer = _delay_timer;
+        record.sound_timer = _sound_timer;
+        record.changed = 0;
+
+        if (record.level >= kTraceRegisters) {
+            for (int i = 0; i < 16; i++) {
+                if (_registers[i] != before[i])
+                    record.changed |= 1 << i;
+            }
+            std::copy(_registers, _registers + 16, record.registers);
+        } else {
+            std::fill_n(record.registers, 16, 0);
+        }
+
+        _trace->record(record);
+    }
+#endif
+
+    void CPU::profiled_step() {
+        uint16_t pc = _program_counter & _address_mask;
+        uint16_t op = _m->peek(pc) << 8 | _m->peek(pc + 1);
 
-        std::cout << "Operation at 0x"
-            << std::hex << _program_counter << " -> " << std::setw(4) << int(op)
-            << std::endl;
+        _profiler->instruction(pc, op);
 
-        Address a = op & kAddressMask;
-        uint8_t rx = (op & kRegisterXMask) >> 8;
-        uint8_t ry = (op & kRegisterYMask) >> 4;
-        uint8_t last_byte = op & 0x0FF;
+        if ((op & 0xF000) == 0xD000) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            step();
+            _profiler->draw(std::chrono::steady_clock::now() - start);
+            return;
+        }
+
+        step();
+
+        if ((op & 0xF000) == 0x2000)
+            _profiler->call(pc, op & kAddressMask);
+        else if (op == 0x00EE)
+            _profiler->ret();
+    }
+
+    void CPU::tick_timers() {
+        // Called at 60hz by the scheduler, independent of the instruction rate
+        if (_delay_timer > 0) {
+            _delay_timer--;
+        }
+
+        if (_sound_timer > 0) {
+            _sound_timer--;
+        }
+    }
+
+    void CPU::seed(uint64_t seed) {
+        _random = seed;
+    }
+
+    uint8_t CPU::next_random() {
+        // SplitMix64, any state (including 0) is fine
+        uint64_t z = (_random += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return uint8_t((z ^ (z >> 31)) >> 56);
+    }
+
+    void CPU::set_keys(uint16_t keys) {
+        uint16_t pressed = keys & ~_keys;
+        _keys = keys;
+
+        if (_waiting && pressed != 0) {
+            uint8_t key = 0;
+            while (!((pressed >> key) & 1))
+                key++;
+
+            _registers[_wait_register] = key;
+            _program_counter += 2;
+            _waiting = false;
+        }
+    }
+
+    bool CPU::sound_on() const {
+        return _sound_timer > 0;
+    }
+
+    void CPU::run(uint64_t cycles) {
+        // Parked on FX0A, the rest of the budget passes idle
+        if (_waiting)
+            return;
+
+        // Timers and keys may have changed since the last run
+        _idle_length = 0;
+
+        // Likewise the debugger, unless it has something armed
+        if (_debugger != nullptr && _debugger->armed()) {
+            debugged_run(cycles);
+            return;
+        }
+
+        // The profiler is checked here rather than per instruction, so an
+        // unprofiled run pays nothing for it
+        if (_profiler != nullptr) {
+            for (uint64_t i = 0; i < cycles && !_waiting; i++)
+                profiled_step();
+            return;
+        }
+
+#ifdef CHIP8_TRACE
+        // Same for tracing, which always interprets since traces are per
+        // instruction. Idle loops are run rather than skipped, so every
+        // iteration is in the trace too.
+        if (tracing()) {
+            for (uint64_t i = 0; i < cycles && !_waiting; i++) {
+                traced_step();
+                _idle_length = 0;
+            }
+            return;
+        }
+#endif
+
+        if (!_jit) {
+            for (uint64_t i = 0; i < cycles && !_waiting; i++) {
+                step();
+                if (_idle_length != 0)
+                    i += fast_forward(cycles - i - 1);
+            }
+            return;
+        }
+
+        uint64_t executed = 0;
+        while (executed < cycles && !_waiting) {
+            uint64_t n = 0;
+
+            if (_jit->prepare(_program_counter, *_m))
+                n = run_native(cycles - executed);
+
+            // Instructions the recompiler doesn't handle, and the tail of the
+            // budget that's too short for a whole block, are interpreted
+            if (n == 0) {
+                step();
+                n = 1;
+                if (_idle_length != 0)
+                    n += fast_forward(cycles - executed - 1);
+            }
+            executed += n;
+        }
+    }
+
+    void CPU::debugged_run(uint64_t cycles) {
+        // Breakpoints and watchpoints need every instruction interpreted,
+        // including loops that would otherwise be skipped
+        for (uint64_t i = 0; i < cycles && !_waiting; i++) {
+            _debugger->check(_program_counter);
+            run_cycle();
+            _idle_length = 0;
+        }
+    }
+
+    uint64_t CPU::run_native(uint64_t budget) {
+        JitState& state = _jit->state();
+
+        std::copy(_registers, _registers + 16, state.registers);
+        std::copy(_stack, _stack + kStackSize, state.stack);
+        state.index_register = _index_register;
+        state.program_counter = _program_counter & _address_mask;
+        state.stack_pointer = _stack_pointer;
+
+        uint64_t executed = _jit->execute(budget);
+
+        std::copy(state.registers, state.registers + 16, _registers);
+        std::copy(state.stack, state.stack + kStackSize, _stack);
+        _index_register = state.index_register;
+        _program_counter = state.program_counter;
+        _stack_pointer = state.stack_pointer;
+
+        return executed;
+    }
+
+    uint64_t CPU::fast_forward(uint64_t remaining) {
+        // Whole iterations only, so the loop ends up exactly where running
+        // it would have left it
+        uint64_t skipped = remaining - remaining % uint64_t(_idle_length);
+        _idle_skipped += skipped;
+        _idle_length = 0;
+        return skipped;
+    }
+
+    inline void CPU::step() {
+        const Instruction& in = _cache[_program_counter & _address_mask];
+        Handler handler = in.handler != nullptr ? in.handler : &CPU::op_decode;
+        handler(*this, in);
+    }
+
+    template <QuirkProfile P>
+    Instruction CPU::decode(OpCode op) {
+        Instruction in;
+        in.op = op;
+        in.nnn = op & kAddressMask;
+        in.x = (op & kRegisterXMask) >> 8;
+        in.y = (op & kRegisterYMask) >> 4;
+        in.kk = op & kImmediateMask;
+        in.n = op & kLastNibble;
+        in.handler = &CPU::op_unknown;
 
-        // Run instruction
         switch (op & kOpCodeMask) {
             case 0x0000:
                 if (op == 0x00E0)
-                    // Clear the screen
-                    _g->clear();
+                    in.handler = &CPU::op_cls;
                 else if (op == 0x00EE)
-                    // Return from subroutine
-                    _program_counter = _stack_pointer;
+                    in.handler = &CPU::op_ret;
+                else if ((op & 0xFFF0) == 0x00C0)
+                    in.handler = &CPU::op_scroll_down;
+                else if ((op & 0xFFF0) == 0x00D0)
+                    in.handler = &CPU::op_scroll_up;
+                else if (op == 0x00FB)
+                    in.handler = &CPU::op_scroll_right;
+                else if (op == 0x00FC)
+                    in.handler = &CPU::op_scroll_left;
+                else if (op == 0x00FD)
+                    in.handler = &CPU::op_exit;
+                else if (op == 0x00FE)
+                    in.handler = &CPU::op_lores;
+                else if (op == 0x00FF)
+                    in.handler = &CPU::op_hires;
                 else
-                    _m->dump();
+                    in.handler = &CPU::op_sys;
                 break;
 
-            case 0x1000:
-                _program_counter = a;
+            case 0x1000: in.handler = &CPU::op_jp; break;
+            case 0x2000: in.handler = &CPU::op_call; break;
+            case 0x3000: in.handler = &CPU::op_se_imm<P>; break;
+            case 0x4000: in.handler = &CPU::op_sne_imm<P>; break;
+            case 0x5000:
+                if (in.n == 0x2)
+                    in.handler = &CPU::op_save_range;
+                else if (in.n == 0x3)
+                    in.handler = &CPU::op_load_range;
+                else
+                    in.handler = &CPU::op_se_reg<P>;
                 break;
 
-            case 0x2000:
-                _stack_pointer = _program_counter + 2;
-                _program_counter = op & 0x0FFF;
-                break;
+            case 0x6000: in.handler = &CPU::op_ld_imm; break;
+            case 0x7000: in.handler = &CPU::op_add_imm; break;
 
-            case 0x3000:
-                if (_registers[rx] == (op & kImmediateMask))
-                    _program_counter += 4;
-                else
-                    _program_counter += 2;
+            case 0x8000:
+                switch (op & kLastNibble) {
+                    case 0x0: in.handler = &CPU::op_ld_reg; break;
+                    case 0x1: in.handler = &CPU::op_or<P>; break;
+                    case 0x2: in.handler = &CPU::op_and<P>; break;
+                    case 0x3: in.handler = &CPU::op_xor<P>; break;
+                    case 0x4: in.handler = &CPU::op_add_reg; break;
+                    case 0x5: in.handler = &CPU::op_sub; break;
+                    case 0x6: in.handler = &CPU::op_shr<P>; break;
+                    case 0x7: in.handler = &CPU::op_subn; break;
+                    case 0xE: in.handler = &CPU::op_shl<P>; break;
+                    default:  in.handler = &CPU::op_nop; break;
+                }
                 break;
 
-            case 0x4000:
-                if (_registers[rx] != (op & kImmediateMask))
-                    _program_counter += 4;
-                else
-                    _program_counter += 2;
-                break;
+            case 0x9000: in.handler = &CPU::op_sne_reg<P>; break;
+            case 0xA000: in.handler = &CPU::op_ld_i; break;
+            case 0xB000: in.handler = &CPU::op_jp_v0<P>; break;
+            case 0xC000: in.handler = &CPU::op_rnd; break;
+            case 0xD000: in.handler = &CPU::op_drw<P>; break;
 
-            case 0x5000:
-                if (_registers[rx] == _registers[ry])
-                    _program_counter += 4;
+            case 0xE000:
+                if (in.kk == 0x9E)
+                    in.handler = &CPU::op_skp<P>;
+                else if (in.kk == 0xA1)
+                    in.handler = &CPU::op_sknp<P>;
                 else
-                    _program_counter += 2;
+                    in.handler = &CPU::op_nop;
                 break;
 
-            case 0x6000:
-                _registers[rx] = (op & kImmediateMask);
-                _program_counter += 2;
+            case 0xF000:
+                switch (in.kk) {
+                    case 0x00: in.handler = op == 0xF000 ? &CPU::op_ld_i_long : &CPU::op_nop; break;
+                    case 0x01: in.handler = &CPU::op_planes; break;
+                    case 0x07: in.handler = &CPU::op_ld_dt; break;
+                    case 0x0A: in.handler = &CPU::op_wait_key; break;
+                    case 0x15: in.handler = &CPU::op_set_dt; break;
+                    case 0x18: in.handler = &CPU::op_set_st; break;
+                    case 0x1E: in.handler = &CPU::op_add_i; break;
+                    case 0x29: in.handler = &CPU::op_ld_font; break;
+                    case 0x30: in.handler = &CPU::op_ld_big_font; break;
+                    case 0x33: in.handler = &CPU::op_bcd; break;
+                    case 0x55: in.handler = &CPU::op_store_regs<P>; break;
+                    case 0x65: in.handler = &CPU::op_load_regs<P>; break;
+                    case 0x75: in.handler = &CPU::op_store_flags; break;
+                    case 0x85: in.handler = &CPU::op_load_flags; break;
+                    default:   in.handler = &CPU::op_nop; break;
+                }
                 break;
+        }
 
-            case 0x7000:
-                _registers[rx] += (op & kImmediateMask);
-                _program_counter += 2;
-                break;
+        return in;
+    }
 
-            case 0x8000:
-                switch (op & kLastNibble) {
-                    case 0x0:
-                        // Sets VX to the value of VY
-                        _registers[rx] = _registers[ry];
-                        break;
-                    case 0x1:
-                        // Sets VX to VX OR VY
-                        _registers[rx] |= _registers[ry];
-                        break;
-                    case 0x2:
-                        // Sets VX to VX AND VY
-                        _registers[rx] &= _registers[ry];
-                        break;
-                    case 0x3:
-                        // Sets VX to VX XOR VY
-                        _registers[rx] ^= _registers[ry];
-                        break;
-                    case 0x4: {
-                        // Adds VY to VX, VF is set to carry
-                        uint16_t sum = _registers[rx] + _registers[ry];
-                        _registers[0xF] = (sum > 0xFF) ? 1 : 0;
-                        _registers[rx] = sum % 0xFF;
-                        break;
-                    }
-                    case 0x5:
-                        // VY is subtracted from VX, VF is set to zero when there is a borrow
-                        _registers[0xF] = (_registers[ry] > _registers[rx] ? 0 : 1);
-                        _registers[rx] -= _registers[ry];
-                        break;
-                    case 0x6:
-                        // Shifts VY right by one and stores the result in VX, VF set to least
-                        // significant bit before shift
-                        _registers[0xF] = _registers[ry] & 0x0001;
-                        _registers[rx] = _registers[ry] >> 1;
-                        break;
-                    case 0x7:
-                        // Sets VX to VY minus VX, VF is set to zero when there is a borrow
-                        _registers[0xF] = (_registers[rx] > _registers[ry] ? 0 : 1);
-                        _registers[rx] = _registers[ry] - _registers[rx];
-                        break;
-                    case 0xE:
-                        // Shifts VY left by one and stores result in VX, VF set to most
-                        // significant bit before shift
-                        _registers[0xF] = (_registers[ry] & 0x8000) >> 8;
-                        _registers[rx] = _registers[ry] << 1;
-                        break;
-                }
-                _program_counter += 2;
-                break;
+    void CPU::op_decode(CPU& cpu, const Instruction&) {
+        uint16_t pc = cpu._program_counter & cpu._address_mask;
+        OpCode op = cpu._m->peek(pc) << 8 | cpu._m->peek((pc + 1) & cpu._address_mask);
 
-            case 0xA000:
-                _index_register = (op & kAddressMask);
-                _program_counter += 2;
-                break;
+        Instruction& in = cpu._cache[pc];
+        in = cpu._decode(op);
+        if (in.handler == &CPU::op_jp && cpu._skip_idle && is_idle_loop(*cpu._m, pc))
+            in.handler = &CPU::op_jp_idle;
+        in.handler(cpu, in);
+    }
 
-            case 0xC000:
-                _registers[rx] = std::rand() & (op & kImmediateMask);
-                _program_counter += 2;
-                break;
+    void CPU::op_unknown(CPU&, const Instruction&) {
+        // Unimplemented opcode, the program counter stays where it is
+    }
 
-            case 0xD000: {
-                int x = _registers[rx];
-                int y = _registers[ry];
-                int n = (op & kLastNibble);
+    void CPU::op_nop(CPU& cpu, const Instruction&) {
+        cpu._program_counter += 2;
+    }
 
-                uint16_t sprite_pointer = _index_register;
-                bool xored = false;
+    void CPU::op_sys(CPU& cpu, const Instruction&) {
+        // Machine code routines of the original interpreter are ignored
+        cpu._program_counter += 2;
+    }
 
-                // Height is determined by the last nibble
-                for (int i=0; i < n; i++) {
+    void CPU::op_cls(CPU& cpu, const Instruction&) {
+        // Clear the screen
+        cpu._g->clear();
+        cpu._program_counter += 2;
+    }
 
-                    // Chip8 sprites are ALWAYS 8 pixels wide
-                    uint8_t sprite_mask = 0x80;
-                    uint8_t sprite_row = _m->getByte(sprite_pointer + i);
+    void CPU::op_scroll_down(CPU& cpu, const Instruction& in) {
+        // 00CN, scroll the screen down N pixels
+        cpu._g->scroll_down(in.n);
+        cpu._program_counter += 2;
+    }
 
-                    //std::cout << "[cpu] Current sprite pointer: " << (int)sprite_pointer + i << std::endl;
-                    //std::cout << "[cpu] Current sprite row: " << (int)sprite_row << std::endl;
+    void CPU::op_scroll_up(CPU& cpu, const Instruction& in) {
+        // 00DN, XO-CHIP's scroll up N pixels
+        cpu._g->scroll_up(in.n);
+        cpu._program_counter += 2;
+    }
 
-                    for (int j=0; j<8; j++) {
-                        if (sprite_row & sprite_mask) {
-                            bool on = _g->get(x + j, y + i);
-                            if (on) xored = true;
-                            _g->set(x + j, y + i, !on);
-                        }
-                        sprite_mask >>= 1;
-                    }
-                }
+    void CPU::op_scroll_right(CPU& cpu, const Instruction&) {
+        cpu._g->scroll_right(4);
+        cpu._program_counter += 2;
+    }
 
-                _registers[0x0F] = xored;
-                _program_counter += 2;
-                break;
-            }
+    void CPU::op_scroll_left(CPU& cpu, const Instruction&) {
+        cpu._g->scroll_left(4);
+        cpu._program_counter += 2;
+    }
 
-            case 0xE000:
-                switch (last_byte) {
-                    case 0xA1: {
-                        // Skip the following instruction if the key corresponding to the hex value
-                        // currently stored in register VX is not pressed.
-                        uint8_t key = _registers[rx];
-                        SDL_Event event;
-                        while (SDL_PollEvent(&event)) {
-                            if (event.type == SDL_KEYDOWN) {
-                                if(event.key.keysym.sym == kKeyCodeMap[key]) {
-                                    std::cout << "skipping" << std::endl;
-                                    _program_counter += 2;
-                                }
-                            }
-                        }
-                    }
-                }
-                _program_counter += 2;
-                break;
+    void CPU::op_exit(CPU&, const Instruction&) {
+        // 00FD exits the interpreter, here the program just stops where it is
+    }
 
-            case 0xF000:
-                int mod = 100;
-                switch (last_byte) {
-                    case 0x07:
-                        // Store the current value of the delay timer in register VX
-                        _registers[rx] = _delay_timer;
-                        break;
-
-                    case 0x15:
-                        // Set the delay timer to the value of register VX
-                        _delay_timer = _registers[rx];
-                        break;
-
-                    case 0x29:
-                        // Set index register to location of font for hex digit in VX
-                        _index_register = _m->getFontLocation() + _registers[rx];
-                        break;
-
-                    case 0x33:
-                        // Store the binary-coded decimal equivalent of the value stored in
-                        // register VX into subsequent memory addresses starting at the address
-                        // currently in the index register.
-                        for (int i=0; i<3; i++) {
-                            _m->putByte(_index_register + i, _registers[rx] % mod);
-                            mod /= 10;
-                        }
-                        break;
-
-                    case 0x65:
-                        // Fill registers V0 to VX inclusive with the values stored in memory
-                        // starting at the address currently in the index register.
-                        for (int i=0; i<=rx; i++)
-                            _registers[i] = _m->getByte(_index_register + i);
-                        break;
-                        // TODO: set index register to index register + x + 1 after this?
-                }
-                _program_counter += 2;
-        }
+    void CPU::op_lores(CPU& cpu, const Instruction&) {
+        cpu._g->set_hires(false);
+        cpu._program_counter += 2;
+    }
 
-        // Lets check out what is going on inside the registers of the CPU
-        dump();
+    void CPU::op_hires(CPU& cpu, const Instruction&) {
+        cpu._g->set_hires(true);
+        cpu._program_counter += 2;
+    }
 
-        // Decrement the timers -- because the timers run at the same clock rate as the CPU
-        // itself (60hz) this is totally fine.
-        // TODO: skip decrement on cycle when timers are set
-        if (_delay_timer > 0) {
-            _delay_timer--;
-        }
+    void CPU::op_ret(CPU& cpu, const Instruction&) {
+        // Return from subroutine
+        cpu._stack_pointer--;
+        cpu._program_counter = cpu._stack[cpu._stack_pointer & kStackMask];
+    }
 
-        if (_sound_timer > 0) {
-            _sound_timer--;
+    void CPU::op_jp(CPU& cpu, const Instruction& in) {
+        cpu._program_counter = in.nnn;
+    }
+
+    void CPU::op_jp_idle(CPU& cpu, const Instruction& in) {
+        // A jump closing a busy-wait loop. Once an iteration from here is
+        // known to come back around unchanged, run() skips ahead.
+        uint16_t pc = cpu._program_counter & cpu._address_mask;
+        cpu._program_counter = in.nnn;
+
+        IdleState state;
+        std::copy(cpu._registers, cpu._registers + 16, state.registers);
+        state.index_register = cpu._index_register;
+        state.delay_timer = cpu._delay_timer;
+        state.keys = cpu._keys;
+        cpu._idle_length = idle_iteration(*cpu._m, pc, state);
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_jp_v0(CPU& cpu, const Instruction& in) {
+        // Jump to NNN plus V0, or on CHIP-48 and SUPER-CHIP to XNN plus VX
+        cpu._program_counter = in.nnn + cpu._registers[kProfileQuirks[P].jump_vx ? in.x : 0];
+    }
+
+    void CPU::op_call(CPU& cpu, const Instruction& in) {
+        cpu._stack[cpu._stack_pointer & kStackMask] = cpu._program_counter + 2;
+        cpu._stack_pointer++;
+        cpu._program_counter = in.nnn;
+    }
+
+    template <QuirkProfile P>
+    inline uint16_t CPU::skip_length() {
+        // XO-CHIP skips the whole of a four byte F000 NNNN
+        if (kProfileQuirks[P].long_skip && _m->peek(_program_counter + 2) == 0xF0 &&
+            _m->peek(_program_counter + 3) == 0x00)
+            return 4;
+        return 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_se_imm(CPU& cpu, const Instruction& in) {
+        cpu._program_counter += (cpu._registers[in.x] == in.kk) ? 2 + cpu.skip_length<P>() : 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_sne_imm(CPU& cpu, const Instruction& in) {
+        cpu._program_counter += (cpu._registers[in.x] != in.kk) ? 2 + cpu.skip_length<P>() : 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_se_reg(CPU& cpu, const Instruction& in) {
+        cpu._program_counter += (cpu._registers[in.x] == cpu._registers[in.y]) ? 2 + cpu.skip_length<P>() : 2;
+    }
+
+    void CPU::op_save_range(CPU& cpu, const Instruction& in) {
+        // 5XY2, store VX to VY (in either order) at I, leaving I alone
+        int step = in.x <= in.y ? 1 : -1;
+        int count = std::abs(in.y - in.x) + 1;
+        cpu._program_counter += 2;
+        for (int i = 0; i < count; i++)
+            cpu._m->putByte(cpu._index_register + i, cpu._registers[in.x + i * step]);
+    }
+
+    void CPU::op_load_range(CPU& cpu, const Instruction& in) {
+        // 5XY3, load VX to VY (in either order) from I
+        int step = in.x <= in.y ? 1 : -1;
+        int count = std::abs(in.y - in.x) + 1;
+        for (int i = 0; i < count; i++)
+            cpu._registers[in.x + i * step] = cpu._m->getByte(cpu._index_register + i);
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_sne_reg(CPU& cpu, const Instruction& in) {
+        cpu._program_counter += (cpu._registers[in.x] != cpu._registers[in.y]) ? 2 + cpu.skip_length<P>() : 2;
+    }
+
+    void CPU::op_ld_imm(CPU& cpu, const Instruction& in) {
+        cpu._registers[in.x] = in.kk;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_add_imm(CPU& cpu, const Instruction& in) {
+        cpu._registers[in.x] += in.kk;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_ld_reg(CPU& cpu, const Instruction& in) {
+        // Sets VX to the value of VY
+        cpu._registers[in.x] = cpu._registers[in.y];
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_or(CPU& cpu, const Instruction& in) {
+        // Sets VX to VX OR VY
+        cpu._registers[in.x] |= cpu._registers[in.y];
+        if (kProfileQuirks[P].reset_vf)
+            cpu._registers[0xF] = 0;
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_and(CPU& cpu, const Instruction& in) {
+        // Sets VX to VX AND VY
+        cpu._registers[in.x] &= cpu._registers[in.y];
+        if (kProfileQuirks[P].reset_vf)
+            cpu._registers[0xF] = 0;
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_xor(CPU& cpu, const Instruction& in) {
+        // Sets VX to VX XOR VY
+        cpu._registers[in.x] ^= cpu._registers[in.y];
+        if (kProfileQuirks[P].reset_vf)
+            cpu._registers[0xF] = 0;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_add_reg(CPU& cpu, const Instruction& in) {
+        // Adds VY to VX, VF is set to carry
+        uint16_t sum = cpu._registers[in.x] + cpu._registers[in.y];
+        cpu._registers[0xF] = (sum > 0xFF) ? 1 : 0;
+        cpu._registers[in.x] = sum & 0xFF;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_sub(CPU& cpu, const Instruction& in) {
+        // VY is subtracted from VX, VF is set to zero when there is a borrow
+        cpu._registers[0xF] = (cpu._registers[in.y] > cpu._registers[in.x] ? 0 : 1);
+        cpu._registers[in.x] -= cpu._registers[in.y];
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_shr(CPU& cpu, const Instruction& in) {
+        // Shifts VY (VX on CHIP-48 and SUPER-CHIP) right by one and stores
+        // the result in VX, VF set to least significant bit before shift
+        uint8_t y = kProfileQuirks[P].shift_vx ? in.x : in.y;
+        cpu._registers[0xF] = cpu._registers[y] & 0x0001;
+        cpu._registers[in.x] = cpu._registers[y] >> 1;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_subn(CPU& cpu, const Instruction& in) {
+        // Sets VX to VY minus VX, VF is set to zero when there is a borrow
+        cpu._registers[0xF] = (cpu._registers[in.x] > cpu._registers[in.y] ? 0 : 1);
+        cpu._registers[in.x] = cpu._registers[in.y] - cpu._registers[in.x];
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_shl(CPU& cpu, const Instruction& in) {
+        // Shifts VY (VX on CHIP-48 and SUPER-CHIP) left by one and stores
+        // result in VX, VF set to most significant bit before shift
+        uint8_t y = kProfileQuirks[P].shift_vx ? in.x : in.y;
+        cpu._registers[0xF] = cpu._registers[y] >> 7;
+        cpu._registers[in.x] = cpu._registers[y] << 1;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_ld_i(CPU& cpu, const Instruction& in) {
+        cpu._index_register = in.nnn;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_ld_i_long(CPU& cpu, const Instruction&) {
+        // F000 NNNN, XO-CHIP's 16-bit load of I from the following word. It's
+        // read on every execution since that word isn't part of the decoded
+        // instruction.
+        cpu._index_register = cpu._m->peek(cpu._program_counter + 2) << 8 |
+                              cpu._m->peek(cpu._program_counter + 3);
+        cpu._program_counter += 4;
+    }
+
+    void CPU::op_rnd(CPU& cpu, const Instruction& in) {
+        cpu._registers[in.x] = cpu.next_random() & in.kk;
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_drw(CPU& cpu, const Instruction& in) {
+        // Height is determined by the last nibble, Chip8 sprites are ALWAYS
+        // 8 pixels wide
+        // DXY0 is a 16x16 sprite on SUPER-CHIP and later, and draws no rows
+        // before. Every selected plane has its own rows, one after the other.
+        uint8_t planes = cpu._g->selected_planes();
+        int count = (planes & 1) + (planes >> 1);
+        uint8_t sprite[32 * kGraphicsPlanes];
+        bool xored;
+
+        if (in.n == 0 && kProfileQuirks[P].big_sprite) {
+            cpu._m->getBytes(cpu._index_register, sprite, 32 * count);
+            xored = cpu._g->draw_sprite16(cpu._registers[in.x], cpu._registers[in.y], sprite,
+                                          kProfileQuirks[P].wrap);
+        } else {
+            cpu._m->getBytes(cpu._index_register, sprite, in.n * count);
+            xored = cpu._g->draw_sprite(cpu._registers[in.x], cpu._registers[in.y],
+                                        sprite, in.n, kProfileQuirks[P].wrap);
         }
+
+        cpu._registers[0x0F] = xored;
+        cpu._program_counter += 2;
     }
 
-    void CPU::dump() {
-        std::cout << "-------- CPU Registers --------" << std::endl;
-        for (int i=0; i<4; i++) {
-            std::cout << std::hex << std::setfill('0') <<
-                std::setw(1) << i + 0  << ": 0x" << std::setw(2) << int(_registers[i+0])  << " " <<
-                std::setw(1) << i + 4  << ": 0x" << std::setw(2) << int(_registers[i+4])  << " " <<
-                std::setw(1) << i + 8  << ": 0x" << std::setw(2) << int(_registers[i+8])  << " " <<
-                std::setw(1) << i + 12 << ": 0x" << std::setw(2) << int(_registers[i+12]) << " " <<
-                std::endl;
+    template <QuirkProfile P>
+    void CPU::op_skp(CPU& cpu, const Instruction& in) {
+        // Skip the following instruction if the key corresponding to the hex value
+        // currently stored in register VX is pressed.
+        uint8_t key = cpu._registers[in.x] & 0xF;
+        if ((cpu._keys >> key) & 1)
+            cpu._program_counter += cpu.skip_length<P>();
+        cpu._program_counter += 2;
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_sknp(CPU& cpu, const Instruction& in) {
+        // Skip the following instruction if the key corresponding to the hex value
+        // currently stored in register VX is not pressed.
+        uint8_t key = cpu._registers[in.x] & 0xF;
+        if (!((cpu._keys >> key) & 1))
+            cpu._program_counter += cpu.skip_length<P>();
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_wait_key(CPU& cpu, const Instruction& in) {
+        // Wait for a key press and store its value in register VX. The CPU
+        // parks here until set_keys() sees a key go down, which stores it and
+        // moves on.
+        cpu._waiting = true;
+        cpu._wait_register = in.x;
+    }
+
+    void CPU::op_ld_dt(CPU& cpu, const Instruction& in) {
+        // Store the current value of the delay timer in register VX
+        cpu._registers[in.x] = cpu._delay_timer;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_set_dt(CPU& cpu, const Instruction& in) {
+        // Set the delay timer to the value of register VX
+        cpu._delay_timer = cpu._registers[in.x];
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_set_st(CPU& cpu, const Instruction& in) {
+        // Set the sound timer to the value of register VX
+        cpu._sound_timer = cpu._registers[in.x];
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_add_i(CPU& cpu, const Instruction& in) {
+        // Add VX to the index register
+        cpu._index_register += cpu._registers[in.x];
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_ld_font(CPU& cpu, const Instruction& in) {
+        // Set index register to location of font for hex digit in VX
+        cpu._index_register = cpu._m->getFontLocation() + cpu._registers[in.x];
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_ld_big_font(CPU& cpu, const Instruction& in) {
+        // FX30, point I at the 8x10 digit for the low nibble of VX
+        cpu._index_register = cpu._m->getBigFontLocation() + (cpu._registers[in.x] & 0xF) * 10;
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_planes(CPU& cpu, const Instruction& in) {
+        // FN01, XO-CHIP's choice of bitplanes to draw, clear and scroll
+        cpu._g->select_planes(in.x);
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_bcd(CPU& cpu, const Instruction& in) {
+        // Store the binary-coded decimal equivalent of the value stored in
+        // register VX into subsequent memory addresses starting at the address
+        // currently in the index register. The write may land on this very
+        // instruction, so operands are copied out first.
+        uint8_t value = cpu._registers[in.x];
+        int mod = 100;
+        cpu._program_counter += 2;
+        for (int i=0; i<3; i++) {
+            cpu._m->putByte(cpu._index_register + i, value % mod);
+            mod /= 10;
         }
-        std::cout << std::endl;
+    }
 
-        std::cout << "pc: 0x" << std::setw(3) << int(_program_counter) << std::endl
-                  << "ix: 0x" << std::setw(3) << int(_index_register) << std::endl
-                  << "sp: 0x" << std::setw(3) << int(_stack_pointer) << std::endl
-                  << "dt: 0x" << std::setw(2) << int(_delay_timer) << std::endl
-                  << "st: 0x" << std::setw(2) << int(_sound_timer) << std::endl;
+    template <QuirkProfile P>
+    void CPU::op_store_regs(CPU& cpu, const Instruction& in) {
+        // Store registers V0 to VX inclusive in memory starting at the address
+        // currently in the index register.
+        int last = in.x;
+        uint16_t index = cpu._index_register;
+        cpu._program_counter += 2;
+        cpu.advance_index<P>(last);
+        for (int i=0; i<=last; i++)
+            cpu._m->putByte(index + i, cpu._registers[i]);
+    }
+
+    template <QuirkProfile P>
+    void CPU::op_load_regs(CPU& cpu, const Instruction& in) {
+        // Fill registers V0 to VX inclusive with the values stored in memory
+        // starting at the address currently in the index register.
+        for (int i=0; i<=in.x; i++)
+            cpu._registers[i] = cpu._m->getByte(cpu._index_register + i);
+        cpu.advance_index<P>(in.x);
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_store_flags(CPU& cpu, const Instruction& in) {
+        // FX75, save V0 to VX in the flag registers (the HP-48's RPL flags)
+        std::copy(cpu._registers, cpu._registers + in.x + 1, cpu._flags);
+        cpu._program_counter += 2;
+    }
+
+    void CPU::op_load_flags(CPU& cpu, const Instruction& in) {
+        // FX85, restore V0 to VX from the flag registers
+        std::copy(cpu._flags, cpu._flags + in.x + 1, cpu._registers);
+        cpu._program_counter += 2;
+    }
 
-        std::cout << "-------------------------------" << std::endl;
-        std::cout << std::endl;
+    template <QuirkProfile P>
+    inline void CPU::advance_index(int x) {
+        // What FX55 / FX65 leave in I varies between interpreters
+        if (kProfileQuirks[P].index == kIndexPlusX)
+            _index_register += x;
+        else if (kProfileQuirks[P].index == kIndexPlusX1)
+            _index_register += x + 1;
+    }
+
+    CPUState CPU::state() const {
+        CPUState state;
+
+        std::copy(_registers, _registers + 16, state.registers);
+        std::copy(_stack, _stack + kStackSize, state.stack);
+        state.index_register = _index_register;
+        state.program_counter = _program_counter;
+        state.stack_pointer = _stack_pointer;
+        state.delay_timer = _delay_timer;
+        state.sound_timer = _sound_timer;
+        state.keys = _keys;
+        state.waiting = _waiting;
+        state.wait_register = _wait_register;
+        std::fill_n(state.reserved, sizeof(state.reserved), 0);
+        std::copy(_flags, _flags + 16, state.flags);
+        state.random = _random;
+
+        return state;
+    }
+
+    void CPU::restore(const CPUState& state) {
+        std::copy(state.registers, state.registers + 16, _registers);
+        std::copy(state.stack, state.stack + kStackSize, _stack);
+        _index_register = state.index_register;
+        _program_counter = state.program_counter;
+        _stack_pointer = state.stack_pointer & kStackMask;
+        _delay_timer = state.delay_timer;
+        _sound_timer = state.sound_timer;
+        _keys = state.keys;
+        _waiting = state.waiting != 0;
+        _wait_register = state.wait_register & 0xF;
+        std::copy(state.flags, state.flags + 16, _flags);
+        _random = state.random;
+    }
+
+    void CPU::dump() {
+        print_registers(std::cout, _registers, _program_counter, _index_register,
+                        _stack_pointer, _delay_timer, _sound_timer);
     }
 
 } // namespace Chip8
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
+
+#include "memory.h"
+#include "quirks.h"
 
 namespace Chip8 {
 
@@ -9,28 +13,225 @@ namespace Chip8 {
     typedef uint8_t Constant;
     typedef uint8_t Register;
 
+    const int kStackSize = 16;
+    const int kStackMask = kStackSize - 1;
+
+    class Debugger;
     class Graphics;
-    class Memory;
+    class Jit;
+    class Profiler;
+    class Trace;
+    class CPU;
+    struct Instruction;
+
+    typedef void (*Handler)(CPU& cpu, const Instruction& in);
+
+    /**
+     * Pre-decoded instruction. Operands are extracted once when the address is
+     * first executed, after that dispatch is a single indirect call.
+     */
+    struct Instruction {
+        Handler handler;
+        OpCode op;
+        Address nnn;
+        uint8_t x;
+        uint8_t y;
+        uint8_t kk;
+        uint8_t n;
+    };
+
+    // Architectural registers, as reported by CPU::state()
+    struct CPUState {
+        uint8_t registers[16];
+        uint16_t index_register;
+        uint16_t program_counter;
+        uint16_t stack_pointer;
+        uint16_t stack[kStackSize];
+        uint8_t delay_timer;
+        uint8_t sound_timer;
+        uint16_t keys;
+        uint8_t waiting;          // Parked on FX0A
+        uint8_t wait_register;
+        uint8_t reserved[4];
+        uint8_t flags[16];        // SUPER-CHIP FX75 / FX85 storage
+        uint64_t random;          // CXNN generator state
+    };
 
-    class CPU {
+    class CPU : public MemoryListener {
     public:
         CPU(Graphics* g, Memory* m);
+        ~CPU();
+        CPU(const CPU&) = delete;
+        CPU& operator=(const CPU&) = delete;
 
         void run_cycle();
+        void run(uint64_t cycles);
+        void tick_timers();
+
+        // CXNN draws from a per-machine generator, so runs with the same
+        // seed and input are identical
+        void seed(uint64_t seed);
+
+        // Keypad as of this frame, bit N set while key N is held. Wakes the
+        // CPU from FX0A if a key went down since the last call.
+        void set_keys(uint16_t keys);
+
+        // The buzzer sounds while the sound timer is non-zero
+        bool sound_on() const;
+
+        // Records every executed instruction while set and its level isn't
+        // kTraceOff. No-op unless built with CHIP8_TRACE.
+        void set_trace(Trace* trace);
+
+        // Counts every executed instruction, call and draw while set. The
+        // CPU interprets while a profiler is attached.
+        void set_profiler(Profiler* profiler);
+
+        // Lets the debugger stop the CPU while set. run() asks it once
+        // whether anything is armed and, if so, interprets and checks each
+        // instruction with it; otherwise it costs nothing.
+        void set_debugger(Debugger* debugger);
+
+        // Switches between the interpreter and the basic-block recompiler.
+        // Returns false if the recompiler isn't available on this host.
+        bool set_jit(bool enabled);
+
+        // Skips whole iterations of busy-wait loops (see idle.h) up to the
+        // end of each run() instead of executing them. On by default; the
+        // machine ends up in the same state either way. Changing it drops
+        // all decoded and translated code.
+        void set_skip_idle(bool enabled);
+
+        // Instructions skipped that way so far
+        uint64_t idle_skipped() const;
+
+        // Selects the handlers instantiated for profile. Changing it drops all
+        // decoded and translated code, so it's meant to be set once a program
+        // is chosen.
+        void set_quirks(QuirkProfile profile);
+        QuirkProfile quirks() const;
+
+        CPUState state() const;
+        void restore(const CPUState& state);
         void dump();
+
+        // Registers and timers back to power-on. Decoded and translated code
+        // is kept; the memory listener drops whatever changes.
+        void power_on();
+
+        // power_on(), also throwing away all decoded and translated code
         void reset();
 
+        // Drops decoded instructions overlapping a written byte
+        void on_write(int location) override;
+
     private:
+        bool tracing() const;
+        void step();
+        void traced_step();
+        void profiled_step();
+        void debugged_run(uint64_t cycles);
+        uint64_t run_native(uint64_t budget);
+        uint64_t fast_forward(uint64_t remaining);
+        void invalidate_all();
+
+        template <QuirkProfile P>
+        static Instruction decode(OpCode op);
+        uint8_t next_random();
+        template <QuirkProfile P> void advance_index(int x);
+        template <QuirkProfile P> uint16_t skip_length();
+
+        static void op_decode(CPU& cpu, const Instruction& in);
+        static void op_unknown(CPU& cpu, const Instruction& in);
+        static void op_nop(CPU& cpu, const Instruction& in);
+        static void op_sys(CPU& cpu, const Instruction& in);
+        static void op_cls(CPU& cpu, const Instruction& in);
+        static void op_scroll_down(CPU& cpu, const Instruction& in);
+        static void op_scroll_up(CPU& cpu, const Instruction& in);
+        static void op_scroll_right(CPU& cpu, const Instruction& in);
+        static void op_scroll_left(CPU& cpu, const Instruction& in);
+        static void op_exit(CPU& cpu, const Instruction& in);
+        static void op_lores(CPU& cpu, const Instruction& in);
+        static void op_hires(CPU& cpu, const Instruction& in);
+        static void op_ret(CPU& cpu, const Instruction& in);
+        static void op_jp(CPU& cpu, const Instruction& in);
+        static void op_jp_idle(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_jp_v0(CPU& cpu, const Instruction& in);
+        static void op_call(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_se_imm(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_sne_imm(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_se_reg(CPU& cpu, const Instruction& in);
+        static void op_save_range(CPU& cpu, const Instruction& in);
+        static void op_load_range(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_sne_reg(CPU& cpu, const Instruction& in);
+        static void op_ld_imm(CPU& cpu, const Instruction& in);
+        static void op_add_imm(CPU& cpu, const Instruction& in);
+        static void op_ld_reg(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_or(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_and(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_xor(CPU& cpu, const Instruction& in);
+        static void op_add_reg(CPU& cpu, const Instruction& in);
+        static void op_sub(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_shr(CPU& cpu, const Instruction& in);
+        static void op_subn(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_shl(CPU& cpu, const Instruction& in);
+        static void op_ld_i(CPU& cpu, const Instruction& in);
+        static void op_ld_i_long(CPU& cpu, const Instruction& in);
+        static void op_rnd(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_drw(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_skp(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_sknp(CPU& cpu, const Instruction& in);
+        static void op_wait_key(CPU& cpu, const Instruction& in);
+        static void op_ld_dt(CPU& cpu, const Instruction& in);
+        static void op_set_dt(CPU& cpu, const Instruction& in);
+        static void op_set_st(CPU& cpu, const Instruction& in);
+        static void op_add_i(CPU& cpu, const Instruction& in);
+        static void op_planes(CPU& cpu, const Instruction& in);
+        static void op_ld_font(CPU& cpu, const Instruction& in);
+        static void op_ld_big_font(CPU& cpu, const Instruction& in);
+        static void op_bcd(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_store_regs(CPU& cpu, const Instruction& in);
+        template <QuirkProfile P> static void op_load_regs(CPU& cpu, const Instruction& in);
+        static void op_store_flags(CPU& cpu, const Instruction& in);
+        static void op_load_flags(CPU& cpu, const Instruction& in);
+
         uint8_t _registers[16];
         uint16_t _index_register;
         uint16_t _program_counter;
-        //uint16_t _stack[16];
+        uint16_t _stack[kStackSize];
         uint16_t _stack_pointer;
+        uint8_t _flags[16];
         uint8_t _delay_timer;
         uint8_t _sound_timer;
 
+        uint64_t _random;
+        uint16_t _keys;
+        bool _waiting;
+        uint8_t _wait_register;
+
         Graphics* _g;
         Memory* _m;
+        Trace* _trace;
+        Profiler* _profiler;
+        Debugger* _debugger;
+
+        // Set by op_jp_idle to the length of an idle loop that came back
+        // around unchanged, until run() skips ahead
+        bool _skip_idle;
+        int _idle_length;
+        uint64_t _idle_skipped;
+
+        QuirkProfile _quirks;
+        uint16_t _address_mask;     // Of the profile, see Quirks
+        Instruction (*_decode)(OpCode op);
+
+        // One entry per memory address, filled lazily by op_decode; a null
+        // handler means not decoded yet. Mapped rather than allocated, so
+        // only the pages covering addresses actually run or written take up
+        // memory (usually a few KiB of the 1 MiB).
+        Instruction* _cache;
+
+        std::unique_ptr<Jit> _jit;
     };
 
 } // namespace Chip8
@@ -0,0 +1,585 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "debugger.h"
+
+/**
+ * Line protocol, one command per line. Every command gets one reply line,
+ * "ok ..." or "error ...", and whenever the CPU stops the debugger also
+ * sends "stopped <reason> pc=NNNN". Numbers are hex, 0x optional.
+ *
+ *   break ADDR [if vX OP NN]    OP is one of == != < <= > >=
+ *   delete ADDR
+ *   watch ADDR [COUNT] [r|w|rw] Stops after an instruction reads or writes
+ *                               one of the COUNT bytes from ADDR (rw, 1)
+ *   unwatch ADDR [COUNT]
+ *   list
+ *   pause                       Stops before the next instruction
+ *   continue
+ *   step [N]                    Runs N instructions (1) and stops
+ *   regs
+ *   read ADDR COUNT
+ *   write ADDR BYTE...
+ *   set vX|i|pc|dt|st VALUE
+ *   detach                      Clears everything and continues
+ *
+ * One client at a time; when it goes away, detach is applied for it.
+ */
+
+namespace Chip8 {
+
+    // How long the server waits on the sockets before flushing replies
+    const int kServerPollMs = 5;
+
+    const size_t kMaxReadCount = 256;
+
+    namespace {
+
+        bool parse_number(const std::string& text, uint32_t& value) {
+            if (text.empty())
+                return false;
+
+            char* end;
+            unsigned long number = std::strtoul(text.c_str(), &end, 16);
+            if (*end != '\0' || number > 0xFFFFFFFFul)
+                return false;
+
+            value = uint32_t(number);
+            return true;
+        }
+
+        bool parse_register(const std::string& text, uint8_t& reg) {
+            uint32_t number;
+            if (text.size() != 2 || (text[0] != 'v' && text[0] != 'V') ||
+                !parse_number(text.substr(1), number))
+                return false;
+
+            reg = uint8_t(number);
+            return true;
+        }
+
+        bool parse_comparison(const std::string& text, Comparison& comparison) {
+            static const char* const names[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+            for (int i = 0; i < 6; i++) {
+                if (text == names[i]) {
+                    comparison = Comparison(kEqual + i);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        std::string hex(uint32_t value, int digits) {
+            char text[16];
+            std::snprintf(text, sizeof(text), "%0*x", digits, value);
+            return text;
+        }
+
+        std::vector<std::string> split(const std::string& line) {
+            std::istringstream in(line);
+            std::vector<std::string> words;
+            std::string word;
+            while (in >> word)
+                words.push_back(word);
+            return words;
+        }
+
+        bool test(const uint64_t* bits, int location) {
+            return (bits[location >> 6] >> (location & 63)) & 1;
+        }
+
+        void assign(uint64_t* bits, int location, bool set) {
+            if (set)
+                bits[location >> 6] |= uint64_t(1) << (location & 63);
+            else
+                bits[location >> 6] &= ~(uint64_t(1) << (location & 63));
+        }
+
+    } // namespace
+
+    Debugger::Debugger()
+        : _cpu(nullptr), _memory(nullptr), _watch_count(0),
+          _armed(false), _stopped(false), _pause(false), _steps(-1),
+          _watch_hit(false), _watch_location(0), _watch_write(false),
+          _pending(false), _closed(false), _listener(-1) {
+        std::fill_n(_breakpoints, kMemorySize / 64, 0);
+        std::fill_n(_watches.reads, kMemorySize / 64, 0);
+        std::fill_n(_watches.writes, kMemorySize / 64, 0);
+    }
+
+    Debugger::~Debugger() {
+        close();
+    }
+
+    bool Debugger::listen(const std::string& path) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cout << "[debugger] socket path '" << path << "' is too long" << std::endl;
+            return false;
+        }
+        std::strcpy(address.sun_path, path.c_str());
+
+        _listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (_listener < 0) {
+            std::cout << "[debugger] couldn't create a socket: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        ::unlink(path.c_str());
+        if (::bind(_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(_listener, 1) != 0) {
+            std::cout << "[debugger] couldn't listen on '" << path << "': " << std::strerror(errno) << std::endl;
+            ::close(_listener);
+            _listener = -1;
+            return false;
+        }
+
+        _path = path;
+        _server = std::thread(&Debugger::serve, this);
+        return true;
+    }
+
+    void Debugger::attach(CPU* cpu, Memory* memory) {
+        _cpu = cpu;
+        _memory = memory;
+        update_watcher();
+    }
+
+    void Debugger::close() {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _closed.store(true);
+        }
+        _wake.notify_all();
+
+        if (_server.joinable())
+            _server.join();
+        if (_listener >= 0) {
+            ::close(_listener);
+            ::unlink(_path.c_str());
+            _listener = -1;
+        }
+    }
+
+    void Debugger::serve() {
+        int client = -1;
+        std::string partial;
+
+        while (!_closed.load()) {
+            pollfd fds[2] = { { _listener, POLLIN, 0 }, { client, POLLIN, 0 } };
+            ::poll(fds, client >= 0 ? 2 : 1, kServerPollMs);
+
+            if (fds[0].revents & POLLIN) {
+                int fd = ::accept(_listener, nullptr, nullptr);
+                if (fd >= 0 && client >= 0) {
+                    const char busy[] = "error another client is attached\n";
+                    ::send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+                    ::close(fd);
+                } else if (fd >= 0) {
+                    client = fd;
+                    partial.clear();
+                }
+            }
+
+            std::vector<std::string> lines;
+            if (client >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                char buffer[512];
+                ssize_t n = ::read(client, buffer, sizeof(buffer));
+                if (n <= 0) {
+                    ::close(client);
+                    client = -1;
+                    lines.push_back("detach");
+                } else {
+                    partial.append(buffer, n);
+                    size_t end;
+                    while ((end = partial.find('\n')) != std::string::npos) {
+                        size_t length = end > 0 && partial[end - 1] == '\r' ? end - 1 : end;
+                        lines.push_back(partial.substr(0, length));
+                        partial.erase(0, end + 1);
+                    }
+                }
+            }
+
+            std::string replies;
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+                for (const std::string& line : lines)
+                    _inbox.push_back(line);
+                if (!lines.empty())
+                    _pending.store(true);
+                replies.swap(_outbox);
+            }
+            if (!lines.empty())
+                _wake.notify_all();
+
+            // Replies to a client that has gone are dropped
+            if (client >= 0 && !replies.empty())
+                ::send(client, replies.data(), replies.size(), MSG_NOSIGNAL);
+        }
+
+        if (client >= 0)
+            ::close(client);
+    }
+
+    void Debugger::send(const std::string& line) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _outbox += line;
+        _outbox += '\n';
+    }
+
+    void Debugger::poll() {
+        if (!_pending.load())
+            return;
+
+        std::deque<std::string> lines;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            lines.swap(_inbox);
+            _pending.store(false);
+        }
+
+        for (const std::string& line : lines)
+            send(execute(line));
+    }
+
+    bool Debugger::armed() const {
+        return _armed;
+    }
+
+    void Debugger::update_armed() {
+        _armed = !_conditions.empty() || _watch_count > 0 || _pause || _steps >= 0 || _stopped;
+    }
+
+    void Debugger::update_watcher() {
+        if (_memory != nullptr)
+            _memory->set_watcher(_watch_count > 0 ? this : nullptr, &_watches);
+    }
+
+    void Debugger::on_watch(int location, bool write) {
+        // Reported before the next instruction, once this one has finished
+        if (_watch_hit)
+            return;
+
+        _watch_hit = true;
+        _watch_location = location;
+        _watch_write = write;
+    }
+
+    bool Debugger::stopping_at(uint16_t pc) {
+        if (!test(_breakpoints, pc))
+            return false;
+
+        const Condition& condition = _conditions[pc];
+        if (condition.comparison == kAlways)
+            return true;
+
+        uint8_t value = _cpu->state().registers[condition.reg];
+        switch (condition.comparison) {
+            case kEqual:        return value == condition.value;
+            case kNotEqual:     return value != condition.value;
+            case kLess:         return value < condition.value;
+            case kLessEqual:    return value <= condition.value;
+            case kGreater:      return value > condition.value;
+            case kGreaterEqual: return value >= condition.value;
+            default:            return true;
+        }
+    }
+
+    void Debugger::check(uint16_t pc) {
+        pc &= kMemorySize - 1;
+
+        if (_watch_hit) {
+            _watch_hit = false;
+            stop(std::string(_watch_write ? "write " : "read ") + hex(_watch_location, 4) + " pc=" + hex(pc, 4));
+        } else if (_pause) {
+            stop("pause pc=" + hex(pc, 4));
+        } else if (_steps == 0) {
+            stop("step pc=" + hex(pc, 4));
+        } else if (stopping_at(pc)) {
+            stop("breakpoint pc=" + hex(pc, 4));
+        }
+
+        // stop() returns once told to continue or step, and the
+        // instruction here runs either way
+        if (_steps > 0)
+            _steps--;
+    }
+
+    void Debugger::stop(const std::string& reason) {
+        if (_closed.load())
+            return;
+
+        _stopped = true;
+        _pause = false;
+        _steps = -1;
+        update_armed();
+        send("stopped " + reason);
+
+        // Serve commands here until one lets the CPU go
+        std::unique_lock<std::mutex> lock(_lock);
+        while (_stopped && !_closed.load()) {
+            if (_inbox.empty()) {
+                _wake.wait(lock);
+                continue;
+            }
+
+            std::string line = _inbox.front();
+            _inbox.pop_front();
+            lock.unlock();
+            send(execute(line));
+            lock.lock();
+        }
+
+        _stopped = false;
+        update_armed();
+    }
+
+    std::string Debugger::set_breakpoint(const std::string& args) {
+        std::vector<std::string> words = split(args);
+        uint32_t address;
+        Condition condition = { kAlways, 0, 0 };
+        uint32_t value = 0;
+
+        bool ok = !words.empty() && parse_number(words[0], address) && address < uint32_t(kMemorySize);
+        if (ok && words.size() > 1) {
+            ok = words.size() == 5 && words[1] == "if" && parse_register(words[2], condition.reg) &&
+                 parse_comparison(words[3], condition.comparison) && parse_number(words[4], value) &&
+                 value <= 0xFF;
+            condition.value = uint8_t(value);
+        } else if (ok) {
+            ok = words.size() == 1;
+        }
+        if (!ok)
+            return "error usage: break ADDR [if vX OP NN]";
+
+        _conditions[address] = condition;
+        assign(_breakpoints, address, true);
+        return "ok";
+    }
+
+    std::string Debugger::delete_breakpoint(const std::string& args) {
+        std::vector<std::string> words = split(args);
+        uint32_t address;
+        if (words.size() != 1 || !parse_number(words[0], address) || address >= uint32_t(kMemorySize))
+            return "error usage: delete ADDR";
+        if (_conditions.erase(address) == 0)
+            return "error no breakpoint at " + hex(address, 4);
+
+        assign(_breakpoints, address, false);
+        return "ok";
+    }
+
+    std::string Debugger::set_watchpoint(const std::string& args, bool set) {
+        std::vector<std::string> words = split(args);
+        uint32_t address;
+        uint32_t count = 1;
+        bool reads = true;
+        bool writes = true;
+
+        bool ok = !words.empty() && words.size() <= (set ? 3u : 2u) && parse_number(words[0], address) &&
+                  address < uint32_t(kMemorySize);
+        if (ok && words.size() > 1)
+            ok = parse_number(words[1], count) && count > 0 && count <= uint32_t(kMemorySize) - address;
+        if (ok && words.size() > 2) {
+            reads = words[2] == "r" || words[2] == "rw";
+            writes = words[2] == "w" || words[2] == "rw";
+            ok = reads || writes;
+        }
+        if (!ok)
+            return set ? "error usage: watch ADDR [COUNT] [r|w|rw]" : "error usage: unwatch ADDR [COUNT]";
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (reads)
+                assign(_watches.reads, address + i, set);
+            if (writes)
+                assign(_watches.writes, address + i, set);
+        }
+
+        _watch_count = 0;
+        for (int i = 0; i < kMemorySize / 64; i++)
+            _watch_count += __builtin_popcountll(_watches.reads[i] | _watches.writes[i]);
+        update_watcher();
+        return "ok";
+    }
+
+    std::string Debugger::list() const {
+        std::string reply = "ok";
+
+        for (const auto& entry : _conditions) {
+            static const char* const names[] = { "", "==", "!=", "<", "<=", ">", ">=" };
+            const Condition& condition = entry.second;
+
+            reply += " break=" + hex(entry.first, 4);
+            if (condition.comparison != kAlways)
+                reply += std::string("[v") + "0123456789abcdef"[condition.reg] +
+                         names[condition.comparison] + hex(condition.value, 2) + "]";
+        }
+
+        // Runs of watched bytes with the same kind of watch
+        int start = -1;
+        for (int location = 0; location <= kMemorySize; location++) {
+            int kind = location == kMemorySize ? 0 :
+                test(_watches.reads, location) | test(_watches.writes, location) << 1;
+            int previous = location == 0 ? 0 :
+                test(_watches.reads, location - 1) | test(_watches.writes, location - 1) << 1;
+
+            if (start >= 0 && kind != previous) {
+                static const char* const kinds[] = { "", "r", "w", "rw" };
+                reply += " watch=" + hex(start, 4) + "+" + hex(location - start, 1) + ":" + kinds[previous];
+                start = -1;
+            }
+            if (start < 0 && kind != 0)
+                start = location;
+        }
+
+        return reply;
+    }
+
+    std::string Debugger::registers() const {
+        CPUState state = _cpu->state();
+
+        std::string reply = "ok pc=" + hex(state.program_counter, 4) + " i=" + hex(state.index_register, 4) +
+            " sp=" + hex(state.stack_pointer, 1) + " dt=" + hex(state.delay_timer, 2) +
+            " st=" + hex(state.sound_timer, 2) + " keys=" + hex(state.keys, 4);
+        for (int i = 0; i < 16; i++)
+            reply += std::string(" v") + "0123456789abcdef"[i] + "=" + hex(state.registers[i], 2);
+        return reply;
+    }
+
+    std::string Debugger::read_memory(const std::string& args) const {
+        std::vector<std::string> words = split(args);
+        uint32_t address;
+        uint32_t count;
+        if (words.size() != 2 || !parse_number(words[0], address) || !parse_number(words[1], count) ||
+            count == 0 || count > kMaxReadCount)
+            return "error usage: read ADDR COUNT, at most " + std::to_string(kMaxReadCount) + " bytes";
+
+        std::string reply = "ok";
+        for (uint32_t i = 0; i < count; i++)
+            reply += " " + hex(_memory->peek(address + i), 2);
+        return reply;
+    }
+
+    std::string Debugger::write_memory(const std::string& args) {
+        std::vector<std::string> words = split(args);
+        uint32_t address;
+        std::vector<uint8_t> bytes;
+
+        bool ok = words.size() >= 2 && parse_number(words[0], address) && address < uint32_t(kMemorySize) &&
+                  words.size() - 1 <= kMemorySize - address;
+        for (size_t i = 1; ok && i < words.size(); i++) {
+            uint32_t value = 0;
+            ok = parse_number(words[i], value) && value <= 0xFF;
+            bytes.push_back(uint8_t(value));
+        }
+        if (!ok)
+            return "error usage: write ADDR BYTE...";
+
+        // Not through putByte, so the write doesn't trip a watchpoint
+        _memory->load(address, bytes.data(), bytes.size());
+        return "ok";
+    }
+
+    std::string Debugger::set_register(const std::string& args) {
+        std::vector<std::string> words = split(args);
+        uint32_t value;
+        if (words.size() != 2 || !parse_number(words[1], value))
+            return "error usage: set vX|i|pc|dt|st VALUE";
+
+        CPUState state = _cpu->state();
+        const std::string& name = words[0];
+        uint8_t reg;
+
+        if (parse_register(name, reg) && value <= 0xFF)
+            state.registers[reg] = uint8_t(value);
+        else if (name == "i" && value <= 0xFFFF)
+            state.index_register = uint16_t(value);
+        else if (name == "pc" && value <= 0xFFFF)
+            state.program_counter = uint16_t(value);
+        else if (name == "dt" && value <= 0xFF)
+            state.delay_timer = uint8_t(value);
+        else if (name == "st" && value <= 0xFF)
+            state.sound_timer = uint8_t(value);
+        else
+            return "error usage: set vX|i|pc|dt|st VALUE";
+
+        _cpu->restore(state);
+        return "ok";
+    }
+
+    std::string Debugger::execute(const std::string& line) {
+        std::vector<std::string> words = split(line);
+        if (words.empty())
+            return "error empty command";
+
+        const std::string& command = words[0];
+        std::string args = line.substr(line.find(command) + command.size());
+        std::string reply;
+
+        if (_cpu == nullptr)
+            reply = "error no machine attached";
+        else if (command == "break")
+            reply = set_breakpoint(args);
+        else if (command == "delete")
+            reply = delete_breakpoint(args);
+        else if (command == "watch")
+            reply = set_watchpoint(args, true);
+        else if (command == "unwatch")
+            reply = set_watchpoint(args, false);
+        else if (command == "list")
+            reply = list();
+        else if (command == "pause") {
+            _pause = !_stopped;
+            reply = "ok";
+        } else if (command == "continue") {
+            _stopped = false;
+            reply = "ok";
+        } else if (command == "step") {
+            uint32_t count = 1;
+            if (words.size() > 2 || (words.size() == 2 && !parse_number(words[1], count)) || count == 0)
+                return "error usage: step [N]";
+            _steps = count;
+            _stopped = false;
+            reply = "ok";
+        } else if (command == "regs")
+            reply = registers();
+        else if (command == "read")
+            reply = read_memory(args);
+        else if (command == "write")
+            reply = write_memory(args);
+        else if (command == "set")
+            reply = set_register(args);
+        else if (command == "detach") {
+            _conditions.clear();
+            std::fill_n(_breakpoints, kMemorySize / 64, 0);
+            std::fill_n(_watches.reads, kMemorySize / 64, 0);
+            std::fill_n(_watches.writes, kMemorySize / 64, 0);
+            _watch_count = 0;
+            _watch_hit = false;
+            _pause = false;
+            _steps = -1;
+            _stopped = false;
+            update_watcher();
+            reply = "ok";
+        } else
+            reply = "error unknown command '" + command + "'";
+
+        update_armed();
+        return reply;
+    }
+
+} // namespace Chip8
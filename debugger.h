@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "cpu.h"
+#include "memory.h"
+
+namespace Chip8 {
+
+    // A conditional breakpoint only stops when VX compares true with NN
+    enum Comparison : uint8_t {
+        kAlways,
+        kEqual,
+        kNotEqual,
+        kLess,
+        kLessEqual,
+        kGreater,
+        kGreaterEqual
+    };
+
+    struct Condition {
+        Comparison comparison;
+        uint8_t reg;
+        uint8_t value;
+    };
+
+    /**
+     * PC breakpoints, conditional breakpoints and memory watchpoints, driven
+     * from a line protocol on a local Unix-domain socket (see debugger.cpp).
+     *
+     * Breakpoints are a bitmap over the address space. The CPU only asks
+     * armed() once per run(), so a machine with nothing armed runs as fast
+     * as one without a debugger; while armed it interprets, testing one bit
+     * per instruction. Watchpoints are another pair of bitmaps that Memory
+     * only consults while at least one is set.
+     *
+     * A server thread owns the socket and just queues lines; commands are
+     * carried out on the emulation thread, between frames or while stopped,
+     * so the debugger never touches the machine concurrently with it. When
+     * it stops, the emulation thread blocks in the middle of its frame until
+     * told to continue or step.
+     */
+    class Debugger : public MemoryWatcher {
+    public:
+        Debugger();
+        ~Debugger();
+
+        Debugger(const Debugger&) = delete;
+        Debugger& operator=(const Debugger&) = delete;
+
+        // Starts serving on a socket at path, replacing a stale one. False
+        // if it can't.
+        bool listen(const std::string& path);
+
+        // Called by Chip8::set_debugger
+        void attach(CPU* cpu, Memory* memory);
+
+        // Stops serving and lets a stopped CPU go. It's never stopped
+        // again, so the emulation thread can be joined.
+        void close();
+
+        // Carries out queued commands. Called at the start of every frame.
+        void poll();
+
+        // Whether the CPU has to call check() before every instruction
+        bool armed() const;
+
+        // Called before each instruction while armed; blocks while stopped
+        void check(uint16_t pc);
+
+        void on_watch(int location, bool write) override;
+
+        // Applies one command and returns its reply, without a socket.
+        // Continue and step reply "ok" straight away; the "stopped ..." line
+        // for where the CPU next stops is sent separately.
+        std::string execute(const std::string& line);
+
+    private:
+        void serve();
+        void send(const std::string& line);
+        void stop(const std::string& reason);
+        void update_armed();
+        void update_watcher();
+        bool stopping_at(uint16_t pc);
+
+        std::string set_breakpoint(const std::string& args);
+        std::string delete_breakpoint(const std::string& args);
+        std::string set_watchpoint(const std::string& args, bool set);
+        std::string list() const;
+        std::string registers() const;
+        std::string read_memory(const std::string& args) const;
+        std::string write_memory(const std::string& args);
+        std::string set_register(const std::string& args);
+
+        CPU* _cpu;
+        Memory* _memory;
+
+        // Everything below is only touched by the emulation thread
+        uint64_t _breakpoints[kMemorySize / 64];
+        std::map<uint16_t, Condition> _conditions;
+        WatchMap _watches;
+        int _watch_count;
+
+        bool _armed;
+        bool _stopped;
+        bool _pause;                // Stop before the next instruction
+        int64_t _steps;             // Instructions left to step, -1 when running
+
+        bool _watch_hit;
+        int _watch_location;
+        bool _watch_write;
+
+        // Shared with the server thread
+        std::mutex _lock;
+        std::condition_variable _wake;
+        std::deque<std::string> _inbox;
+        std::string _outbox;
+        std::atomic<bool> _pending;
+        std::atomic<bool> _closed;
+
+        std::string _path;
+        int _listener;
+        std::thread _server;
+    };
+
+} // namespace Chip8
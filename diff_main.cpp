@@ -0,0 +1,169 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "lockstep.h"
+
+/**
+ * chip8-diff: runs one ROM, or every ROM in an archive (--archive), on two
+ * machines in lockstep and reports the first instruction after which they
+ * differ. Each side is ENGINE[:QUIRKS][:noidle], e.g. "interp:vip",
+ * "jit" or "compact:schip"; the defaults compare the interpreter with the
+ * JIT. Exits with 1 if any ROM diverged.
+ *
+ * Both sides share one keypad script from --inputs, one event per line:
+ *
+ *     <frame> <keys>
+ *
+ * where keys is the whole keypad as a hex bitmask (bit N = key N). Lines
+ * starting with '#' are ignored.
+ */
+
+namespace {
+
+    struct Options {
+        Chip8::LockstepConfig config;
+        bool archive = false;
+        const char* filename = nullptr;
+        const char* inputs_file = nullptr;
+    };
+
+    void usage(const char* name) {
+        std::cout << "usage: " << name
+            << " [--a ENGINE[:QUIRKS][:noidle]] [--b ENGINE[:QUIRKS][:noidle]] [--cycles N] [--interval N]"
+            << " [--ips N] [--seed N] [--inputs FILE] [--archive] <filename>\n"
+            << "engines are interp, jit and compact\n" << std::endl;
+        std::exit(2);
+    }
+
+    Options parse_options(int argc, char *argv[]) {
+        Options options;
+        options.config.b.engine = Chip8::kEngineJit;
+
+        for (int i = 1; i < argc; i++) {
+            if (std::strcmp(argv[i], "--a") == 0 && i + 1 < argc) {
+                options.config.a = Chip8::LockstepSide();
+                if (!Chip8::parse_lockstep_side(argv[++i], options.config.a))
+                    usage(argv[0]);
+            } else if (std::strcmp(argv[i], "--b") == 0 && i + 1 < argc) {
+                options.config.b = Chip8::LockstepSide();
+                if (!Chip8::parse_lockstep_side(argv[++i], options.config.b))
+                    usage(argv[0]);
+            } else if (std::strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+                options.config.cycles = std::strtoull(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+                options.config.interval = std::strtoull(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+                options.config.speed = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                options.config.seed = std::strtoull(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+                options.inputs_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--archive") == 0) {
+                options.archive = true;
+            } else if (argv[i][0] == '-' || options.filename != nullptr) {
+                usage(argv[0]);
+            } else {
+                options.filename = argv[i];
+            }
+        }
+
+        if (options.filename == nullptr || options.config.interval == 0 || options.config.speed == 0)
+            usage(argv[0]);
+
+        return options;
+    }
+
+    bool read_inputs(const char* filename, std::vector<Chip8::KeyEvent>& events) {
+        std::ifstream in(filename);
+        if (!in.is_open())
+            return false;
+
+        std::string line;
+        int number = 0;
+        while (std::getline(in, line)) {
+            number++;
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::istringstream fields(line);
+            Chip8::KeyEvent event;
+            unsigned keys;
+
+            if (!(fields >> event.frame >> std::hex >> keys)) {
+                std::cerr << "[diff] " << filename << ":" << number << ": bad event" << std::endl;
+                return false;
+            }
+            event.keys = uint16_t(keys);
+            events.push_back(event);
+        }
+
+        return true;
+    }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options options = parse_options(argc, argv);
+
+    Chip8::MappedFile file;
+    Chip8::RomArchive archive;
+
+    if (options.archive) {
+        if (!archive.open(options.filename)) {
+            std::cerr << "couldn't open archive" << std::endl;
+            exit(1);
+        }
+    } else if (!file.open(options.filename)) {
+        std::cerr << "couldn't open program" << std::endl;
+        exit(1);
+    }
+
+    if (options.inputs_file != nullptr && !read_inputs(options.inputs_file, options.config.inputs)) {
+        std::cerr << "couldn't read inputs from " << options.inputs_file << std::endl;
+        exit(1);
+    }
+
+    size_t count = options.archive ? archive.size() : 1;
+    size_t diverged = 0;
+    size_t skipped = 0;
+    uint64_t executed = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t rom = 0; rom < count; rom++) {
+        const uint8_t* program = options.archive ? archive.data(rom) : file.data();
+        size_t size = options.archive ? archive.entry(rom).size : file.size();
+
+        if (options.archive) {
+            if (!archive.verify(rom)) {
+                std::cerr << "[diff] " << archive.name(rom) << " doesn't match its hash" << std::endl;
+                exit(1);
+            }
+            std::cout << "[diff] " << archive.name(rom) << std::endl;
+        }
+
+        // A side that can't run the program says why and the ROM is skipped
+        Chip8::LockstepResult result;
+        if (!Chip8::run_lockstep(options.config, program, size, result)) {
+            skipped++;
+            continue;
+        }
+
+        Chip8::write_lockstep_report(std::cout, options.config, result);
+        executed += result.instructions;
+        if (result.diverged)
+            diverged++;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "[diff] " << count << " ROMs, " << diverged << " diverged, " << skipped << " skipped, "
+        << executed << " instructions on each side in " << elapsed.count() << "s" << std::endl;
+
+    return diverged > 0 ? 1 : 0;
+}
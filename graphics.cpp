@@ -1,90 +1,295 @@
-#include <iostream>
 #include <algorithm>
+#include <cstring>
 #include "graphics.h"
 
 namespace Chip8 {
 
-    const int kGraphicsWidth = 64;
-    const int kGraphicsHeight = 32;
-    const int kGraphicsScale = 10;
+    const uint64_t kLeftmostPixel = uint64_t(1) << 63;
 
-    Graphics::Graphics() {
-        _window = SDL_CreateWindow(
-            "Chip8",
-            SDL_WINDOWPOS_CENTERED,
-            SDL_WINDOWPOS_CENTERED,
-            kGraphicsWidth * kGraphicsScale,
-            kGraphicsHeight * kGraphicsScale,
-            SDL_WINDOW_SHOWN
-        );
-
-        if (_window == nullptr)
-            std::cout << "error: " << SDL_GetError() << std::endl;
-
-        _renderer = SDL_CreateRenderer(
-            _window,
-            -1,
-            SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC
-        );
-
-        if (_window == nullptr)
-            std::cout << "error: " << SDL_GetError() << std::endl;
+    namespace {
+
+        // Byte b spread out to eight bytes of 0 or 1, leftmost pixel first in
+        // memory, so a row composes eight pixels per lookup
+        struct SpreadTable {
+            uint64_t bytes[256];
+
+            SpreadTable() {
+                for (int b = 0; b < 256; b++) {
+                    uint8_t pixels[8];
+                    for (int i = 0; i < 8; i++)
+                        pixels[i] = (b >> (7 - i)) & 1;
+                    std::memcpy(&bytes[b], pixels, sizeof(pixels));
+                }
+            }
+        };
+
+        const SpreadTable kSpread;
+
+    } // namespace
 
+    Graphics::Graphics() {
+        reset();
         _dirty_buffer = false;
+    }
+
+    int Graphics::width() const {
+        return _hires ? kMaxGraphicsWidth : kGraphicsWidth;
+    }
+
+    int Graphics::height() const {
+        return _hires ? kMaxGraphicsHeight : kGraphicsHeight;
+    }
+
+    bool Graphics::hires() const {
+        return _hires;
+    }
 
-        clear();
+    int Graphics::words() const {
+        return _hires ? kRowWords : 1;
+    }
+
+    void Graphics::set_hires(bool hires) {
+        _hires = hires;
+        std::memset(_planes, 0, sizeof(_planes));
+        _dirty_buffer = true;
     }
 
-    Graphics::~Graphics() {
-        SDL_DestroyRenderer(_renderer);
-        SDL_DestroyWindow(_window);
+    void Graphics::select_planes(uint8_t mask) {
+        _selected = mask & ((1 << kGraphicsPlanes) - 1);
+    }
+
+    uint8_t Graphics::selected_planes() const {
+        return _selected;
     }
 
     void Graphics::set(int x, int y, bool value) {
-        //std::cout << "[graphics] settingx: " << x << " settingy: " << y << std::endl;
-        _gfx[(kGraphicsWidth * y) + x - 1] = value;
+        uint64_t& word = _planes[0][y][x >> 6];
+        uint64_t mask = kLeftmostPixel >> (x & 63);
+
+        if (value)
+            word |= mask;
+        else
+            word &= ~mask;
 
         _dirty_buffer = true;
     }
 
     bool Graphics::get(int x, int y) const {
-        return _gfx[(kGraphicsWidth * y) + x - 1];
+        return (_planes[0][y][x >> 6] & (kLeftmostPixel >> (x & 63))) != 0;
+    }
+
+    int Graphics::pixel(int x, int y) const {
+        int color = 0;
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            if (_planes[plane][y][x >> 6] & (kLeftmostPixel >> (x & 63)))
+                color |= 1 << plane;
+        }
+        return color;
+    }
+
+    const uint64_t* Graphics::row(int plane, int y) const {
+        return _planes[plane][y];
+    }
+
+    void Graphics::compose(int y, uint8_t* colors) const {
+        for (int w = 0; w < words(); w++) {
+            uint64_t low = _planes[0][y][w];
+            uint64_t high = _planes[1][y][w];
+
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                uint64_t eight = kSpread.bytes[(low >> shift) & 0xFF] |
+                                 kSpread.bytes[(high >> shift) & 0xFF] << 1;
+                std::memcpy(colors, &eight, sizeof(eight));
+                colors += sizeof(eight);
+            }
+        }
+    }
+
+    void Graphics::save(GraphicsState& state) const {
+        std::memcpy(state.planes, _planes, sizeof(_planes));
+        state.hires = _hires;
+        state.selected = _selected;
+        std::fill_n(state.reserved, sizeof(state.reserved), 0);
+    }
+
+    void Graphics::restore(const GraphicsState& state) {
+        std::memcpy(_planes, state.planes, sizeof(_planes));
+        _hires = state.hires != 0;
+        select_planes(state.selected);
+        _dirty_buffer = true;
+    }
+
+    uint64_t Graphics::hash() const {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+
+        hash ^= _hires;
+        hash *= 0x100000001b3ULL;
+
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            for (int y = 0; y < height(); y++) {
+                for (int w = 0; w < words(); w++) {
+                    for (int shift = 56; shift >= 0; shift -= 8) {
+                        hash ^= (_planes[plane][y][w] >> shift) & 0xFF;
+                        hash *= 0x100000001b3ULL;
+                    }
+                }
+            }
+        }
+
+        return hash;
     }
 
     bool Graphics::dirty() const {
         return _dirty_buffer;
     }
 
-    void Graphics::refresh() {
-        if (SDL_RenderClear(_renderer) != 0) {
-            std::cout << "[graphics] clear error: " << SDL_GetError() << std::endl;
+    void Graphics::mark_clean() {
+        _dirty_buffer = false;
+    }
+
+    void Graphics::clear() {
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            if (_selected & (1 << plane))
+                std::memset(_planes[plane], 0, sizeof(_planes[plane]));
         }
+        _dirty_buffer = true;
+    }
 
-        for (int pixel = 0; pixel < kGraphicsWidth * kGraphicsHeight; pixel++) {
+    void Graphics::reset() {
+        _hires = false;
+        _selected = 1;
+        std::memset(_planes, 0, sizeof(_planes));
+        _dirty_buffer = true;
+    }
+
+    bool Graphics::draw_sprite(int x, int y, const uint8_t* sprite, int height, bool wrap) {
+        return draw(x, y, sprite, height, 8, wrap);
+    }
+
+    bool Graphics::draw_sprite16(int x, int y, const uint8_t* sprite, bool wrap) {
+        return draw(x, y, sprite, 16, 16, wrap);
+    }
 
-            SDL_Rect scaled_pixel = {
-                (pixel % kGraphicsWidth) * kGraphicsScale,
-                (pixel / kGraphicsWidth) * kGraphicsScale,
-                kGraphicsScale,
-                kGraphicsScale
-            };
+    bool Graphics::draw(int x, int y, const uint8_t* sprite, int rows, int sprite_width, bool wrap) {
+        int n = words();
+        int bytes = sprite_width / 8;
+        int screen_height = height();
+        x %= width();
+        y %= screen_height;
 
-            if (_gfx[pixel]) {
-                SDL_SetRenderDrawColor(_renderer, 255, 255, 255, 255);
-            } else {
-                SDL_SetRenderDrawColor(_renderer, 0, 0, 0, 255);
+        // Which words of a row the sprite lands in, and how far into them
+        int word = x >> 6;
+        int bit = x & 63;
+
+        uint64_t collision = 0;
+
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            if (!(_selected & (1 << plane)))
+                continue;
+
+            for (int i = 0; i < rows; i++) {
+                int row = y + i;
+                if (row >= screen_height) {
+                    if (!wrap)
+                        break;
+                    row -= screen_height;
+                }
+
+                // Sprite row at the top of a word, shifted right to column x
+                // across one more word than the row has. Whatever lands in
+                // that extra word is off the right edge: lost, or rotated
+                // back to column 0.
+                uint64_t bits = sprite[i * bytes];
+                if (bytes == 2)
+                    bits = bits << 8 | sprite[i * bytes + 1];
+                uint64_t top = bits << (64 - sprite_width);
+
+                uint64_t shifted[kRowWords + 1] = {};
+                shifted[word] = top >> bit;
+                if (bit > 0)
+                    shifted[word + 1] = top << (64 - bit);
+                if (wrap)
+                    shifted[0] |= shifted[n];
+
+                uint64_t* words = _planes[plane][row];
+                for (int w = 0; w < n; w++) {
+                    collision |= words[w] & shifted[w];
+                    words[w] ^= shifted[w];
+                }
             }
 
-            SDL_RenderFillRect(_renderer, &scaled_pixel);
+            sprite += rows * bytes;
         }
 
-        _dirty_buffer = false;
+        _dirty_buffer = true;
+        return collision != 0;
+    }
+
+    void Graphics::scroll_down(int n) {
+        int rows = height();
+        n = std::min(std::max(n, 0), rows);
 
-        SDL_RenderPresent(_renderer);
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            if (!(_selected & (1 << plane)))
+                continue;
+
+            uint64_t* words = &_planes[plane][0][0];
+            std::memmove(words + n * kRowWords, words, (rows - n) * kRowWords * sizeof(uint64_t));
+            std::memset(words, 0, n * kRowWords * sizeof(uint64_t));
+        }
+        _dirty_buffer = true;
     }
 
-    void Graphics::clear() {
-        std::fill_n(_gfx, sizeof(_gfx), 0);
+    void Graphics::scroll_up(int n) {
+        int rows = height();
+        n = std::min(std::max(n, 0), rows);
+
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            if (!(_selected & (1 << plane)))
+                continue;
+
+            uint64_t* words = &_planes[plane][0][0];
+            std::memmove(words, words + n * kRowWords, (rows - n) * kRowWords * sizeof(uint64_t));
+            std::memset(words + (rows - n) * kRowWords, 0, n * kRowWords * sizeof(uint64_t));
+        }
+        _dirty_buffer = true;
+    }
+
+    void Graphics::scroll_right(int n) {
+        if (n <= 0 || n >= 64)
+            return;
+
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            if (!(_selected & (1 << plane)))
+                continue;
+
+            for (int y = 0; y < height(); y++) {
+                uint64_t* words = _planes[plane][y];
+                if (_hires)
+                    words[1] = words[1] >> n | words[0] << (64 - n);
+                words[0] >>= n;
+            }
+        }
+        _dirty_buffer = true;
+    }
+
+    void Graphics::scroll_left(int n) {
+        if (n <= 0 || n >= 64)
+            return;
+
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            if (!(_selected & (1 << plane)))
+                continue;
+
+            for (int y = 0; y < height(); y++) {
+                uint64_t* words = _planes[plane][y];
+                words[0] <<= n;
+                if (_hires) {
+                    words[0] |= words[1] >> (64 - n);
+                    words[1] <<= n;
+                }
+            }
+        }
         _dirty_buffer = true;
     }
 
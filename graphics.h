@@ -1,26 +1,108 @@
 #pragma once
 
 #include <cstdint>
-#include "SDL2/SDL.h"
 
 namespace Chip8 {
 
+    // Low resolution, the CHIP-8 screen
+    const int kGraphicsWidth = 64;
+    const int kGraphicsHeight = 32;
+
+    // SUPER-CHIP / XO-CHIP high resolution
+    const int kMaxGraphicsWidth = 128;
+    const int kMaxGraphicsHeight = 64;
+
+    // 64-bit words per row, and XO-CHIP bitplanes
+    const int kRowWords = kMaxGraphicsWidth / 64;
+    const int kGraphicsPlanes = 2;
+
+    // Everything a Graphics holds, e.g. for save states
+    struct GraphicsState {
+        uint64_t planes[kGraphicsPlanes][kMaxGraphicsHeight][kRowWords];
+        uint8_t hires;
+        uint8_t selected;
+        uint8_t reserved[6];
+    };
+
+    /**
+     * Packed framebuffer with up to two bitplanes, one or two 64-bit words
+     * per row with the leftmost pixel in the most significant bit of the
+     * first word. In low resolution only the first 32 rows and first word
+     * are used. Each pixel's colour is its bit in plane 0 plus twice its bit
+     * in plane 1. Presenting it on screen is up to a Video backend, see
+     * backend.h.
+     *
+     * Drawing, clearing and scrolling apply to the selected planes (plane 0
+     * unless an XO-CHIP program picks others), a whole row word at a time.
+     */
     class Graphics {
     public:
         Graphics();
-        ~Graphics();
 
+        int width() const;
+        int height() const;
+        bool hires() const;
+
+        // Switches resolution, clearing every plane
+        void set_hires(bool hires);
+
+        // Bit N set to draw on plane N
+        void select_planes(uint8_t mask);
+        uint8_t selected_planes() const;
+
+        // Plane 0, as on a CHIP-8
         void set(int x, int y, bool value);
         bool get(int x, int y) const;
+
+        // Colour of a pixel, 0-3
+        int pixel(int x, int y) const;
+
+        // The words of one row of a plane, width() / 64 of them
+        const uint64_t* row(int plane, int y) const;
+
+        // Colours of row y, width() bytes, eight pixels per step
+        void compose(int y, uint8_t* colors) const;
+
+        void save(GraphicsState& state) const;
+        void restore(const GraphicsState& state);
+
+        // FNV-1a over the visible rows of both planes, for comparing frames
+        // cheaply
+        uint64_t hash() const;
         bool dirty() const;
+        void mark_clean();
+
+        // Clears the selected planes (00E0)
         void clear();
-        void refresh();
+
+        // Power-on: low resolution, plane 0 selected, everything blank
+        void reset();
+
+        // XORs an 8 pixel wide sprite onto the selected planes at (x, y), one
+        // whole row per operation. With more than one plane selected the
+        // sprite holds height bytes per plane, one plane after the other.
+        // The start position wraps around the screen; pixels running off the
+        // right or bottom edge are clipped, or wrap around if wrap is set.
+        // Returns true if any lit pixel was erased.
+        bool draw_sprite(int x, int y, const uint8_t* sprite, int height, bool wrap);
+
+        // Same for a 16x16 sprite (DXY0), two bytes per row
+        bool draw_sprite16(int x, int y, const uint8_t* sprite, bool wrap);
+
+        // Moves the selected planes by n pixels, filling with blank
+        void scroll_down(int n);
+        void scroll_up(int n);
+        void scroll_right(int n);
+        void scroll_left(int n);
 
     private:
-        bool _gfx[64 * 32];
+        bool draw(int x, int y, const uint8_t* sprite, int rows, int sprite_width, bool wrap);
+        int words() const;
+
+        uint64_t _planes[kGraphicsPlanes][kMaxGraphicsHeight][kRowWords];
+        bool _hires;
+        uint8_t _selected;
         bool _dirty_buffer;
-        SDL_Window* _window;
-        SDL_Renderer* _renderer;
     };
 
 } // namespace Chip8
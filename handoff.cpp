@@ -0,0 +1,37 @@
+#include "handoff.h"
+
+namespace Chip8 {
+
+    FrameHandoff::FrameHandoff() : _slots(), _middle(1), _overwritten(0), _back(0), _front(2) {
+    }
+
+    Frame& FrameHandoff::back() {
+        return _slots[_back];
+    }
+
+    void FrameHandoff::publish() {
+        // Release makes the frame visible to the acquire that swaps it out
+        uint8_t previous = _middle.exchange(_back | kFresh, std::memory_order_acq_rel);
+        if (previous & kFresh)
+            _overwritten.fetch_add(1, std::memory_order_relaxed);
+        _back = previous & ~kFresh;
+    }
+
+    bool FrameHandoff::acquire() {
+        if (!(_middle.load(std::memory_order_relaxed) & kFresh))
+            return false;
+
+        uint8_t previous = _middle.exchange(_front, std::memory_order_acq_rel);
+        _front = previous & ~kFresh;
+        return true;
+    }
+
+    const Frame& FrameHandoff::front() const {
+        return _slots[_front];
+    }
+
+    uint64_t FrameHandoff::overwritten() const {
+        return _overwritten.load(std::memory_order_relaxed);
+    }
+
+} // namespace Chip8
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "graphics.h"
+
+namespace Chip8 {
+
+    // One finished emulated frame, as handed to the presentation thread
+    struct Frame {
+        GraphicsState graphics;
+
+        // Emulated frame number
+        uint64_t number;
+
+        // Sequence number of the keypad state the frame was emulated with
+        uint32_t input;
+
+        std::chrono::steady_clock::time_point finished;
+    };
+
+    /**
+     * Lock-free triple buffer between one producer and one consumer. The
+     * producer fills back() and publishes it; the consumer picks up the
+     * newest published frame, if any, and reads it through front(). Neither
+     * side ever waits: a frame published before the consumer got to the
+     * previous one replaces it.
+     */
+    class FrameHandoff {
+    public:
+        FrameHandoff();
+
+        // Producer side
+        Frame& back();
+        void publish();
+
+        // Consumer side. True if a newer frame is now in front().
+        bool acquire();
+        const Frame& front() const;
+
+        // Frames that were published but replaced before being acquired
+        uint64_t overwritten() const;
+
+    private:
+        static const uint8_t kFresh = 4;
+
+        Frame _slots[3];
+
+        // Slot in the middle, plus kFresh once published and not yet acquired
+        std::atomic<uint8_t> _middle;
+        std::atomic<uint64_t> _overwritten;
+
+        // Only touched by their own side
+        uint8_t _back;
+        uint8_t _front;
+    };
+
+} // namespace Chip8
@@ -0,0 +1,98 @@
+#include "headless.h"
+
+namespace Chip8 {
+
+    void HeadlessInput::poll() {
+    }
+
+    uint16_t HeadlessInput::keys() const {
+        return 0;
+    }
+
+    bool HeadlessInput::quit_requested() const {
+        return false;
+    }
+
+    bool HeadlessInput::step_requested() {
+        return false;
+    }
+
+    bool HeadlessInput::rewind_held() const {
+        return false;
+    }
+
+    bool HeadlessInput::save_requested() {
+        return false;
+    }
+
+    bool HeadlessInput::load_requested() {
+        return false;
+    }
+
+    bool HeadlessInput::profile_requested() {
+        return false;
+    }
+
+    ScriptedInput::ScriptedInput(const std::vector<KeyEvent>& events) {
+        reset(events);
+    }
+
+    void ScriptedInput::reset(const std::vector<KeyEvent>& events) {
+        _events = events;
+        _next = 0;
+        _frame = 0;
+        _keys = 0;
+        poll();
+    }
+
+    void ScriptedInput::poll() {
+        while (_next < _events.size() && _events[_next].frame <= _frame) {
+            _keys = _events[_next].keys;
+            _next++;
+        }
+        _frame++;
+    }
+
+    uint16_t ScriptedInput::keys() const {
+        return _keys;
+    }
+
+    bool ScriptedInput::quit_requested() const {
+        return false;
+    }
+
+    bool ScriptedInput::step_requested() {
+        return false;
+    }
+
+    bool ScriptedInput::rewind_held() const {
+        return false;
+    }
+
+    bool ScriptedInput::save_requested() {
+        return false;
+    }
+
+    bool ScriptedInput::load_requested() {
+        return false;
+    }
+
+    bool ScriptedInput::profile_requested() {
+        return false;
+    }
+
+    HeadlessVideo::HeadlessVideo() : _frames(0) {
+    }
+
+    void HeadlessVideo::present(const Graphics&) {
+        _frames++;
+    }
+
+    uint64_t HeadlessVideo::frames() const {
+        return _frames;
+    }
+
+    void HeadlessAudio::frame(bool) {
+    }
+
+} // namespace Chip8
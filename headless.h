@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "backend.h"
+
+namespace Chip8 {
+
+    /**
+     * Backends for running without a window or sound device, e.g. on build
+     * machines. No keys are ever pressed and frames are only counted.
+     */
+
+    class HeadlessInput : public Input {
+    public:
+        void poll() override;
+        uint16_t keys() const override;
+        bool quit_requested() const override;
+        bool step_requested() override;
+        bool rewind_held() const override;
+        bool save_requested() override;
+        bool load_requested() override;
+        bool profile_requested() override;
+    };
+
+    // The whole keypad as of some frame, bit N set while key N is held
+    struct KeyEvent {
+        uint64_t frame;
+        uint16_t keys;
+    };
+
+    /**
+     * Replays a fixed keypad script. Each poll() is one frame; the keypad
+     * holds the state of the latest event at or before the current frame.
+     * Events must be sorted by frame.
+     */
+    class ScriptedInput : public Input {
+    public:
+        explicit ScriptedInput(const std::vector<KeyEvent>& events);
+
+        // Starts over at frame 0 with a new script
+        void reset(const std::vector<KeyEvent>& events);
+
+        void poll() override;
+        uint16_t keys() const override;
+        bool quit_requested() const override;
+        bool step_requested() override;
+        bool rewind_held() const override;
+        bool save_requested() override;
+        bool load_requested() override;
+        bool profile_requested() override;
+
+    private:
+        std::vector<KeyEvent> _events;
+        size_t _next;
+        uint64_t _frame;
+        uint16_t _keys;
+    };
+
+    class HeadlessVideo : public Video {
+    public:
+        HeadlessVideo();
+
+        void present(const Graphics& graphics) override;
+        uint64_t frames() const;
+
+    private:
+        uint64_t _frames;
+    };
+
+    class HeadlessAudio : public Audio {
+    public:
+        void frame(bool tone) override;
+    };
+
+} // namespace Chip8
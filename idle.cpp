@@ -0,0 +1,97 @@
+#include <algorithm>
+
+#include "idle.h"
+
+namespace Chip8 {
+
+    namespace {
+
+        uint16_t fetch(Memory& m, uint16_t at) {
+            return m.peek(at) << 8 | m.peek((at + 1) & (kMemorySize - 1));
+        }
+
+        // Mirrors the CPU's decoding for the instructions it accepts
+        bool idle_instruction(uint16_t op) {
+            switch (op & 0xF000) {
+                case 0x3000:
+                case 0x4000:
+                case 0x6000:
+                case 0x9000:
+                case 0xA000:
+                    return true;
+                case 0x5000:
+                    return (op & 0xF) != 0x2 && (op & 0xF) != 0x3;
+                case 0x8000:
+                    return (op & 0xF) == 0x0;
+                case 0xE000:
+                    return (op & 0xFF) == 0x9E || (op & 0xFF) == 0xA1;
+                case 0xF000:
+                    return (op & 0xFF) == 0x07;
+            }
+            return false;
+        }
+
+    } // namespace
+
+    bool is_idle_loop(Memory& m, uint16_t pc) {
+        uint16_t op = fetch(m, pc);
+        uint16_t target = op & 0x0FFF;
+
+        if ((op & 0xF000) != 0x1000 || target > pc)
+            return false;
+        if ((pc - target) % 2 != 0 || (pc - target) / 2 >= kMaxIdleLoop)
+            return false;
+
+        for (uint16_t at = target; at < pc; at += 2) {
+            if (!idle_instruction(fetch(m, at)))
+                return false;
+        }
+        return true;
+    }
+
+    int idle_iteration(Memory& m, uint16_t pc, const IdleState& state) {
+        if (!is_idle_loop(m, pc))
+            return 0;
+
+        IdleState next = state;
+        uint16_t at = fetch(m, pc) & 0x0FFF;
+        int count = 1;
+
+        while (at < pc) {
+            uint16_t op = fetch(m, at);
+            int x = (op & 0x0F00) >> 8;
+            int y = (op & 0x00F0) >> 4;
+            uint8_t kk = op & 0x00FF;
+            bool skip = false;
+
+            switch (op & 0xF000) {
+                case 0x3000: skip = next.registers[x] == kk; break;
+                case 0x4000: skip = next.registers[x] != kk; break;
+                case 0x5000: skip = next.registers[x] == next.registers[y]; break;
+                case 0x6000: next.registers[x] = kk; break;
+                case 0x8000: next.registers[x] = next.registers[y]; break;
+                case 0x9000: skip = next.registers[x] != next.registers[y]; break;
+                case 0xA000: next.index_register = op & 0x0FFF; break;
+                case 0xE000: {
+                    bool held = (next.keys >> (next.registers[x] & 0xF)) & 1;
+                    skip = kk == 0x9E ? held : !held;
+                    break;
+                }
+                case 0xF000: next.registers[x] = next.delay_timer; break;
+            }
+
+            at += skip ? 4 : 2;
+            count++;
+        }
+
+        // Skipped over the jump, out of the loop
+        if (at != pc)
+            return 0;
+
+        if (!std::equal(next.registers, next.registers + 16, state.registers) ||
+            next.index_register != state.index_register)
+            return 0;
+        return count;
+    }
+
+} // namespace Chip8
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+#include "memory.h"
+
+namespace Chip8 {
+
+    // Longest loop, jump included, that's checked for idling
+    const int kMaxIdleLoop = 8;
+
+    // What an idle loop can read or write
+    struct IdleState {
+        uint8_t registers[16];
+        uint16_t index_register;
+        uint8_t delay_timer;
+        uint16_t keys;
+    };
+
+    /**
+     * Busy-wait loops, e.g. FX07 / 3XNN / 1NNN polling the delay timer or a
+     * 1NNN jumping to itself. The 1NNN at pc closes one if it jumps back at
+     * most kMaxIdleLoop instructions and everything from the target up to it
+     * only compares registers, keys and the delay timer or loads registers
+     * and I. Skips either stay inside the loop or leave it by skipping the
+     * jump. Timers and keys only change between frames, so such a loop that
+     * comes back around unchanged once will keep doing so until then.
+     */
+    bool is_idle_loop(Memory& m, uint16_t pc);
+
+    // Runs one iteration of the idle loop closed by the jump at pc, from its
+    // target. Returns the instructions it took, jump included, if it came
+    // back around with state unchanged; 0 if it left or changed something.
+    int idle_iteration(Memory& m, uint16_t pc, const IdleState& state);
+
+} // namespace Chip8
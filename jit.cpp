@@ -0,0 +1,488 @@
+#include <algorithm>
+#include <cstring>
+
+#include "idle.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+namespace Chip8 {
+
+    const size_t kCodeBufferSize = 4 * 1024 * 1024;
+    const int kMaxBlockLength = 64;
+
+    // Worst case is a skip (~50 bytes), rounded up generously
+    const size_t kMaxBlockBytes = 64 + kMaxBlockLength * 96;
+
+    // Host registers, numbered as in the ModRM encoding
+    const int kRAX = 0;
+    const int kRCX = 1;
+    const int kRDX = 2;
+
+    const uint8_t kRegistersOffset = offsetof(JitState, registers);
+    const uint8_t kIndexOffset     = offsetof(JitState, index_register);
+    const uint8_t kPCOffset        = offsetof(JitState, program_counter);
+    const uint8_t kSPOffset        = offsetof(JitState, stack_pointer);
+    const uint8_t kStackOffset     = offsetof(JitState, stack);
+    const uint8_t kBudgetOffset    = offsetof(JitState, budget);
+    const uint8_t kExitOffset      = offsetof(JitState, exit);
+    const uint32_t kEntriesOffset  = offsetof(JitState, entries);
+
+    // Short conditional jump opcodes
+    const uint8_t kJE  = 0x74;
+    const uint8_t kJNE = 0x75;
+
+    // ALU opcodes of the "op r/m32, r32" form
+    const uint8_t kAdd = 0x01;
+    const uint8_t kOr  = 0x09;
+    const uint8_t kAnd = 0x21;
+    const uint8_t kSub = 0x29;
+    const uint8_t kXor = 0x31;
+    const uint8_t kCmp = 0x39;
+
+    Jit::Jit() : _tables(nullptr), _quirks(kProfileQuirks[kDefaultQuirks]), _skip_idle(true), _code(nullptr), _code_size(0),
+        _code_used(0), _stubs_end(0), _exit_stub(0), _epilogue(0) {
+#if defined(__x86_64__)
+        // Anonymous pages read as zero: all entries exit, nothing translated
+        void* tables = mmap(nullptr, sizeof(Tables), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tables == MAP_FAILED)
+            return;
+        _tables = static_cast<Tables*>(tables);
+
+        void* code = mmap(nullptr, kCodeBufferSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED)
+            return;
+
+        _code = static_cast<uint8_t*>(code);
+        _code_size = kCodeBufferSize;
+
+        // Entry trampoline: void (*)(JitState* state)
+        emit(0x53);                                     // push rbx
+        emit(0x55);                                     // push rbp
+        emit(0x41); emit(0x54);                         // push r12
+        emit(0x41); emit(0x55);                         // push r13
+        emit(0x41); emit(0x56);                         // push r14
+        emit(0x41); emit(0x57);                         // push r15
+        emit(0x48); emit(0x89); emit(0xFB);             // mov rbx, rdi
+        emit(0x48); emit(0x8B); emit(0x6B); emit(kBudgetOffset); // mov rbp, [rbx+budget]
+        for (int i = 0; i < 8; i++) {
+            // movzx r8d+i, byte [rbx+registers+i]
+            emit(0x44); emit(0x0F); emit(0xB6); emit(0x43 | (i << 3)); emit(kRegistersOffset + i);
+        }
+        emit(0x0F); emit(0xB7); emit(0x43); emit(kPCOffset); // movzx eax, word [rbx+pc]
+        emit_goto_eax();
+
+        // Exit stub, entered with the guest pc to resume at in eax
+        _exit_stub = _code_used;
+        _tables->state.exit = _code + _exit_stub;
+        emit(0x66); emit(0x89); emit(0x43); emit(kPCOffset);  // mov [rbx+pc], ax
+
+        _epilogue = _code_used;
+        emit(0x48); emit(0x89); emit(0x6B); emit(kBudgetOffset); // mov [rbx+budget], rbp
+        for (int i = 0; i < 8; i++) {
+            // mov byte [rbx+registers+i], r8b+i
+            emit(0x44); emit(0x88); emit(0x43 | (i << 3)); emit(kRegistersOffset + i);
+        }
+        emit(0x41); emit(0x5F);                         // pop r15
+        emit(0x41); emit(0x5E);                         // pop r14
+        emit(0x41); emit(0x5D);                         // pop r13
+        emit(0x41); emit(0x5C);                         // pop r12
+        emit(0x5D);                                     // pop rbp
+        emit(0x5B);                                     // pop rbx
+        emit(0xC3);                                     // ret
+
+        _stubs_end = _code_used;
+        flush();
+#endif
+    }
+
+    Jit::~Jit() {
+#if defined(__x86_64__)
+        if (_code != nullptr)
+            munmap(_code, _code_size);
+        if (_tables != nullptr)
+            munmap(_tables, sizeof(Tables));
+#endif
+    }
+
+    bool Jit::ready() const {
+        return _code != nullptr;
+    }
+
+    JitState& Jit::state() {
+        return _tables->state;
+    }
+
+    void Jit::flush() {
+        _code_used = _stubs_end;
+
+        // Everything from the entry table on goes back to zero, handing the
+        // pages back rather than writing them where possible
+        uint8_t* start = reinterpret_cast<uint8_t*>(_tables->state.entries);
+        size_t size = reinterpret_cast<uint8_t*>(_tables + 1) - start;
+#if defined(__x86_64__) && defined(__linux__)
+        if (madvise(start, size, MADV_DONTNEED) == 0)
+            return;
+#endif
+        std::memset(start, 0, size);
+    }
+
+    void Jit::set_quirks(const Quirks& quirks) {
+        _quirks = quirks;
+        if (ready())
+            flush();
+    }
+
+    void Jit::set_skip_idle(bool enabled) {
+        _skip_idle = enabled;
+        if (ready())
+            flush();
+    }
+
+    void Jit::on_write(int location) {
+        location &= _quirks.address_mask;
+        // Only entries that are set, so writing data doesn't touch their pages
+        for (int i = location - 1; i <= location; i++) {
+            bool& interpret_only = _tables->interpret_only[i & _quirks.address_mask];
+            if (interpret_only)
+                interpret_only = false;
+        }
+
+        if (_tables->translated[location])
+            flush();
+    }
+
+    bool Jit::prepare(uint16_t pc, Memory& m) {
+        pc &= _quirks.address_mask;
+
+        if (!ready() || _tables->interpret_only[pc])
+            return false;
+        if (_tables->state.entries[pc] != 0)
+            return true;
+
+        if (_code_size - _code_used < kMaxBlockBytes)
+            flush();
+
+        if (!compile(pc, m)) {
+            _tables->interpret_only[pc] = true;
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t Jit::execute(uint64_t budget) {
+        typedef void (*Entry)(JitState* state);
+
+        if (budget > uint64_t(INT64_MAX))
+            budget = INT64_MAX;
+
+        _tables->state.budget = int64_t(budget);
+        Entry entry = reinterpret_cast<Entry>(_code);
+        entry(&_tables->state);
+
+        return budget - uint64_t(_tables->state.budget);
+    }
+
+    bool Jit::compile(uint16_t pc, Memory& m) {
+        size_t start = _code_used;
+
+        // Block header: bail out to the interpreter unless the whole block
+        // fits in the remaining budget, otherwise charge for it up front.
+        emit(0x48); emit(0x81); emit(0xFD);             // cmp rbp, imm32
+        size_t cmp_length = _code_used;
+        emit32(0);
+        emit(0x7D); emit(0x0A);                         // jge body
+        emit(0xB8); emit32(pc);                         // mov eax, pc
+        emit(0xE9);                                     // jmp exit_stub
+        emit32(uint32_t(_exit_stub - (_code_used + 4)));
+        emit(0x48); emit(0x81); emit(0xED);             // sub rbp, imm32
+        size_t sub_length = _code_used;
+        emit32(0);
+
+        uint16_t address = pc;
+        uint32_t length = 0;
+        bool ends_block = false;
+
+        while (length < uint32_t(kMaxBlockLength)) {
+            uint16_t op = m.peek(address) << 8 | m.peek((address + 1) & _quirks.address_mask);
+            size_t mark = _code_used;
+
+            if (!emit_instruction(op, address, m, ends_block)) {
+                _code_used = mark;
+                break;
+            }
+
+            _tables->translated[address] = true;
+            _tables->translated[(address + 1) & _quirks.address_mask] = true;
+            length++;
+
+            if (ends_block)
+                break;
+            address = (address + 2) & _quirks.address_mask;
+        }
+
+        if (length == 0) {
+            _code_used = start;
+            return false;
+        }
+
+        if (!ends_block)
+            emit_goto(address);
+
+        patch32(cmp_length, length);
+        patch32(sub_length, length);
+        _tables->state.entries[pc] = uint32_t(start - _exit_stub);
+        return true;
+    }
+
+    bool Jit::emit_instruction(uint16_t op, uint16_t pc, Memory& m, bool& ends_block) {
+        uint16_t nnn = op & 0x0FFF;
+        int x = (op & 0x0F00) >> 8;
+        int y = (op & 0x00F0) >> 4;
+        uint8_t kk = op & 0x00FF;
+
+        switch (op & 0xF000) {
+            case 0x0000:
+                if (op != 0x00EE)
+                    return false;
+                // Return from subroutine
+                emit(0x66); emit(0xFF); emit(0x4B); emit(kSPOffset);   // dec word [rbx+sp]
+                emit(0x0F); emit(0xB7); emit(0x43); emit(kSPOffset);   // movzx eax, word [rbx+sp]
+                emit(0x83); emit(0xE0); emit(0x0F);                    // and eax, 15
+                emit(0x0F); emit(0xB7); emit(0x44); emit(0x43); emit(kStackOffset); // movzx eax, [rbx+rax*2+stack]
+                emit_goto_eax();
+                ends_block = true;
+                return true;
+
+            case 0x1000:
+                if (_skip_idle && is_idle_loop(m, pc))
+                    return false;
+                emit_goto(nnn);
+                ends_block = true;
+                return true;
+
+            case 0x2000:
+                emit(0x0F); emit(0xB7); emit(0x43); emit(kSPOffset);   // movzx eax, word [rbx+sp]
+                emit(0x83); emit(0xE0); emit(0x0F);                    // and eax, 15
+                emit(0x66); emit(0xC7); emit(0x44); emit(0x43); emit(kStackOffset); // mov [rbx+rax*2+stack], imm16
+                emit16(pc + 2);
+                emit(0x66); emit(0xFF); emit(0x43); emit(kSPOffset);   // inc word [rbx+sp]
+                emit_goto(nnn);
+                ends_block = true;
+                return true;
+
+            case 0x3000:
+            case 0x4000:
+                emit_load(kRAX, x);
+                emit(0x3D); emit32(kk);                                // cmp eax, kk
+                emit_skip((op & 0xF000) == 0x3000 ? kJE : kJNE, pc, skip_length(pc, m));
+                ends_block = true;
+                return true;
+
+            case 0x5000:
+            case 0x9000:
+                // XO-CHIP's 5XY2 / 5XY3 are interpreted
+                if ((op & 0x000F) != 0)
+                    return false;
+                emit_load(kRAX, x);
+                emit_load(kRCX, y);
+                emit_alu(kCmp, kRAX, kRCX);
+                emit_skip((op & 0xF000) == 0x5000 ? kJE : kJNE, pc, skip_length(pc, m));
+                ends_block = true;
+                return true;
+
+            case 0x6000:
+                emit(0xB8); emit32(kk);                                // mov eax, kk
+                emit_store(x, kRAX);
+                return true;
+
+            case 0x7000:
+                emit_load(kRAX, x);
+                emit(0x05); emit32(kk);                                // add eax, kk
+                emit_store(x, kRAX);
+                return true;
+
+            case 0x8000:
+                // Mirrors the interpreter statement by statement, including
+                // re-reading VX/VY after VF is written in case one of them is VF
+                switch (op & 0x000F) {
+                    case 0x0:
+                        emit_load(kRAX, y);
+                        emit_store(x, kRAX);
+                        return true;
+
+                    case 0x1:
+                    case 0x2:
+                    case 0x3: {
+                        const uint8_t opcodes[4] = { 0, kOr, kAnd, kXor };
+                        emit_load(kRAX, x);
+                        emit_load(kRCX, y);
+                        emit_alu(opcodes[op & 0x000F], kRAX, kRCX);
+                        emit_store(x, kRAX);
+                        if (_quirks.reset_vf) {
+                            emit_alu(kXor, kRAX, kRAX);
+                            emit_store(0xF, kRAX);
+                        }
+                        return true;
+                    }
+
+                    case 0x4:
+                        emit_load(kRAX, x);
+                        emit_load(kRCX, y);
+                        emit_alu(kAdd, kRAX, kRCX);
+                        emit_alu(kXor, kRDX, kRDX);
+                        emit(0x3D); emit32(0xFF);                      // cmp eax, 0xFF
+                        emit(0x0F); emit(0x97); emit(0xC2);            // seta dl
+                        emit_store(0xF, kRDX);
+                        emit_store(x, kRAX);
+                        return true;
+
+                    case 0x5:
+                    case 0x7: {
+                        // 8XY5: VF = VX >= VY, VX = VX - VY
+                        // 8XY7: VF = VY >= VX, VX = VY - VX
+                        int a = ((op & 0x000F) == 0x5) ? x : y;
+                        int b = ((op & 0x000F) == 0x5) ? y : x;
+                        emit_load(kRAX, a);
+                        emit_load(kRCX, b);
+                        emit_alu(kXor, kRDX, kRDX);
+                        emit_alu(kCmp, kRAX, kRCX);
+                        emit(0x0F); emit(0x93); emit(0xC2);            // setae dl
+                        emit_store(0xF, kRDX);
+                        emit_load(kRAX, a);
+                        emit_load(kRCX, b);
+                        emit_alu(kSub, kRAX, kRCX);
+                        emit_store(x, kRAX);
+                        return true;
+                    }
+
+                    case 0x6:
+                        if (_quirks.shift_vx)
+                            y = x;
+                        emit_load(kRAX, y);
+                        emit(0x83); emit(0xE0); emit(0x01);            // and eax, 1
+                        emit_store(0xF, kRAX);
+                        emit_load(kRAX, y);
+                        emit(0xD1); emit(0xE8);                        // shr eax, 1
+                        emit_store(x, kRAX);
+                        return true;
+
+                    case 0xE:
+                        if (_quirks.shift_vx)
+                            y = x;
+                        emit_load(kRAX, y);
+                        emit(0xC1); emit(0xE8); emit(0x07);            // shr eax, 7
+                        emit_store(0xF, kRAX);
+                        emit_load(kRAX, y);
+                        emit(0xD1); emit(0xE0);                        // shl eax, 1
+                        emit_store(x, kRAX);
+                        return true;
+
+                    default:
+                        return true;
+                }
+
+            case 0xA000:
+                emit(0x66); emit(0xC7); emit(0x43); emit(kIndexOffset); // mov word [rbx+index], imm16
+                emit16(nnn);
+                return true;
+
+            case 0xB000:
+                emit_load(kRAX, _quirks.jump_vx ? x : 0);
+                emit(0x05); emit32(nnn);                               // add eax, nnn
+                emit_goto_eax();
+                ends_block = true;
+                return true;
+
+            case 0xF000:
+                if (kk != 0x1E)
+                    return false;
+                emit_load(kRAX, x);
+                emit(0x66); emit(0x01); emit(0x43); emit(kIndexOffset); // add [rbx+index], ax
+                return true;
+        }
+
+        return false;
+    }
+
+    void Jit::emit(uint8_t byte) {
+        _code[_code_used++] = byte;
+    }
+
+    void Jit::emit16(uint16_t value) {
+        emit(value & 0xFF);
+        emit(value >> 8);
+    }
+
+    void Jit::emit32(uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            emit((value >> (i * 8)) & 0xFF);
+    }
+
+    void Jit::patch32(size_t at, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            _code[at + i] = (value >> (i * 8)) & 0xFF;
+    }
+
+    void Jit::emit_load(int scratch, int vx) {
+        // movzx scratch, VX
+        if (vx < 8) {
+            emit(0x41); emit(0x0F); emit(0xB6); emit(0xC0 | (scratch << 3) | vx);
+        } else {
+            emit(0x0F); emit(0xB6); emit(0x43 | (scratch << 3)); emit(kRegistersOffset + vx);
+        }
+    }
+
+    void Jit::emit_store(int vx, int scratch) {
+        // mov VX, low byte of scratch
+        if (vx < 8) {
+            emit(0x41); emit(0x88); emit(0xC0 | (scratch << 3) | vx);
+        } else {
+            emit(0x88); emit(0x43 | (scratch << 3)); emit(kRegistersOffset + vx);
+        }
+    }
+
+    void Jit::emit_alu(uint8_t opcode, int dst, int src) {
+        emit(opcode); emit(0xC0 | (src << 3) | dst);
+    }
+
+    void Jit::emit_goto(uint16_t pc) {
+        pc &= _quirks.address_mask;
+        emit(0xB8); emit32(pc);                                        // mov eax, pc
+        emit(0x8B); emit(0x8B); emit32(kEntriesOffset + pc * 4);       // mov ecx, [rbx+entries+pc*4]
+        emit(0x48); emit(0x03); emit(0x4B); emit(kExitOffset);         // add rcx, [rbx+exit]
+        emit(0xFF); emit(0xE1);                                        // jmp rcx
+    }
+
+    void Jit::emit_goto_eax() {
+        emit(0x25); emit32(_quirks.address_mask);                      // and eax, mask
+        emit(0x8B); emit(0x8C); emit(0x83); emit32(kEntriesOffset);    // mov ecx, [rbx+rax*4+entries]
+        emit(0x48); emit(0x03); emit(0x4B); emit(kExitOffset);         // add rcx, [rbx+exit]
+        emit(0xFF); emit(0xE1);                                        // jmp rcx
+    }
+
+    void Jit::emit_skip(uint8_t jcc, uint16_t pc, uint16_t length) {
+        // jcc over the 17 byte not-taken goto
+        emit(jcc); emit(17);
+        emit_goto(pc + 2);
+        emit_goto(pc + 2 + length);
+    }
+
+    uint16_t Jit::skip_length(uint16_t pc, Memory& m) {
+        if (!_quirks.long_skip)
+            return 2;
+
+        // The skipped instruction is baked in, so writing to it has to drop
+        // this translation like writing to the skip itself
+        uint16_t next = (pc + 2) & _quirks.address_mask;
+        _tables->translated[next] = true;
+        _tables->translated[(next + 1) & _quirks.address_mask] = true;
+
+        bool long_load = m.peek(next) == 0xF0 && m.peek(next + 1) == 0x00;
+        return long_load ? 4 : 2;
+    }
+
+} // namespace Chip8
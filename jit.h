@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "memory.h"
+#include "quirks.h"
+
+namespace Chip8 {
+
+    /**
+     * Machine state as seen by translated code. Generated code addresses it
+     * relative to a base register, so the small fields are kept first where
+     * they fit in an 8-bit displacement.
+     */
+    struct JitState {
+        uint8_t registers[16];
+        uint16_t index_register;
+        uint16_t program_counter;
+        uint16_t stack_pointer;
+        uint16_t stack[16];
+        int64_t budget;
+        const uint8_t* exit;        // The exit stub
+
+        // Native entry point for every guest address, as an offset from the
+        // exit stub so that zero means exit. Page aligned, see Jit::flush().
+        alignas(4096) uint32_t entries[kMemorySize];
+    };
+
+    /**
+     * x86-64 basic-block recompiler. A block runs until a jump, call, return,
+     * skip or an instruction that has to be interpreted (drawing, input,
+     * timers, memory stores, ...). Blocks jump to each other through the entry
+     * table without returning to C++, and V0-V7 stay in r8-r15 the whole time.
+     *
+     * On other hosts, or when executable memory can't be mapped, ready()
+     * returns false and the CPU keeps interpreting.
+     */
+    class Jit {
+    public:
+        Jit();
+        ~Jit();
+
+        bool ready() const;
+        JitState& state();
+
+        // Translates the block at pc unless it already is. Returns false when
+        // the instruction at pc has to be interpreted.
+        bool prepare(uint16_t pc, Memory& m);
+
+        // Runs native code from state().program_counter until it leaves
+        // translated code or less than a block's worth of budget is left.
+        // Returns the number of guest instructions executed.
+        uint64_t execute(uint64_t budget);
+
+        // Translates for the given interpreter behaviour, dropping all code
+        // translated so far
+        void set_quirks(const Quirks& quirks);
+
+        // Leaves jumps closing idle loops (see idle.h) to the interpreter,
+        // which can skip ahead through them
+        void set_skip_idle(bool enabled);
+
+        // Drops all translations if the written byte belongs to one
+        void on_write(int location);
+        void flush();
+
+    private:
+        bool compile(uint16_t pc, Memory& m);
+
+        void emit(uint8_t byte);
+        void emit16(uint16_t value);
+        void emit32(uint32_t value);
+        void patch32(size_t at, uint32_t value);
+        void emit_load(int scratch, int vx);
+        void emit_store(int vx, int scratch);
+        void emit_alu(uint8_t opcode, int dst, int src);
+        void emit_goto(uint16_t pc);
+        void emit_goto_eax();
+        void emit_skip(uint8_t jcc, uint16_t pc, uint16_t length);
+        uint16_t skip_length(uint16_t pc, Memory& m);
+        bool emit_instruction(uint16_t op, uint16_t pc, Memory& m, bool& ends_block);
+
+        // Mapped rather than allocated, so that only the pages covering
+        // addresses actually run or written take up memory
+        struct Tables {
+            JitState state;
+
+            // Guest bytes covered by a translation, and addresses that can't
+            // start one
+            bool translated[kMemorySize];
+            bool interpret_only[kMemorySize];
+        };
+
+        Tables* _tables;
+        Quirks _quirks;
+        bool _skip_idle;
+        uint8_t* _code;
+        size_t _code_size;
+        size_t _code_used;
+        size_t _stubs_end;
+        size_t _exit_stub;
+        size_t _epilogue;
+    };
+
+} // namespace Chip8
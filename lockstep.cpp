@@ -0,0 +1,653 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+
+#include "lockstep.h"
+#include "rom.h"
+
+namespace Chip8 {
+
+    namespace {
+
+        const int kPages = kMemorySize / kPageSize;
+
+        // Memory differences listed before the rest are only counted
+        const int kListedBytes = 4;
+
+        const char* const kEngineNames[] = { "interp", "jit", "compact" };
+
+        inline uint64_t mix(uint64_t hash, uint64_t word) {
+            hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+            return hash ^ (hash >> 29);
+        }
+
+        __extension__ typedef unsigned __int128 uint128;
+
+        // Both halves of the full product, as in wyhash
+        inline uint64_t multiply_fold(uint64_t a, uint64_t b) {
+            uint128 product = uint128(a) * b;
+            return uint64_t(product) ^ uint64_t(product >> 64);
+        }
+
+        // Two words per multiply in four independent lanes, so the
+        // multiplies overlap. count is a multiple of eight.
+        uint64_t hash_words(uint64_t seed, const uint64_t* words, size_t count) {
+            uint64_t lanes[4] = {
+                seed ^ 0xA0761D6478BD642FULL, seed ^ 0xE7037ED1A0B428DBULL,
+                seed ^ 0x8EBC6AF09C88C6E3ULL, seed ^ 0x589965CC75374CC3ULL
+            };
+
+            for (size_t i = 0; i < count; i += 8) {
+                for (int lane = 0; lane < 4; lane++)
+                    lanes[lane] = multiply_fold(words[i + 2 * lane] ^ lanes[lane],
+                                                words[i + 2 * lane + 1] ^ 0x1D8E4E27C47D124FULL);
+            }
+
+            return multiply_fold(lanes[0] ^ lanes[1], lanes[2] ^ lanes[3] ^ count);
+        }
+
+        uint64_t page_hash(int page, const uint8_t* bytes) {
+            uint64_t words[kPageSize / 8];
+            std::memcpy(words, bytes, sizeof(words));
+            return hash_words(uint64_t(page), words, kPageSize / 8);
+        }
+
+        // Visible rows of both planes, like Graphics::hash() but a word at
+        // a time
+        uint64_t screen_hash(const Graphics& graphics) {
+            GraphicsState state;
+            graphics.save(state);
+
+            uint64_t words[kGraphicsPlanes * kMaxGraphicsHeight * kRowWords];
+            int row_words = state.hires ? kRowWords : 1;
+            int height = state.hires ? kMaxGraphicsHeight : kGraphicsHeight;
+            size_t count = 0;
+
+            for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+                for (int y = 0; y < height; y++) {
+                    for (int word = 0; word < row_words; word++)
+                        words[count++] = state.planes[plane][y][word];
+                }
+            }
+
+            return hash_words(state.hires, words, count);
+        }
+
+        uint64_t screen_hash(const CompactMachine& m) {
+            uint64_t words[kGraphicsPlanes * kGraphicsHeight] = {};
+            std::copy(m.screen, m.screen + kGraphicsHeight, words);
+            return hash_words(0, words, kGraphicsPlanes * kGraphicsHeight);
+        }
+
+        struct PowerOnPages {
+            uint64_t hashes[kPages];
+
+            PowerOnPages() {
+                uint8_t bytes[kPageSize];
+                for (int page = 0; page < kPages; page++) {
+                    for (int i = 0; i < kPageSize; i++)
+                        bytes[i] = Memory::power_on_byte(page * kPageSize + i);
+                    hashes[page] = page_hash(page, bytes);
+                }
+            }
+        };
+
+        const PowerOnPages& power_on_pages() {
+            static const PowerOnPages pages;
+            return pages;
+        }
+
+        /**
+         * The hash of each page as last seen, with a copy of its contents.
+         * Comparing a page with its copy is much cheaper than hashing it
+         * again, and between two checks most pages don't change.
+         */
+        class PageHashes {
+        public:
+            PageHashes() : _copies(kMemorySize), _known(0) {
+            }
+
+            uint64_t page(int page, const uint8_t* bytes) {
+                uint8_t* copy = &_copies[page * kPageSize];
+                uint64_t bit = uint64_t(1) << page;
+
+                if (!(_known & bit) || std::memcmp(copy, bytes, kPageSize) != 0) {
+                    std::memcpy(copy, bytes, kPageSize);
+                    _hashes[page] = page_hash(page, bytes);
+                    _known |= bit;
+                }
+                return _hashes[page];
+            }
+
+        private:
+            std::vector<uint8_t> _copies;
+            uint64_t _hashes[kPages];
+            uint64_t _known;
+        };
+
+        // Sum of each dirty page's change from its power-on hash. A page
+        // holding its power-on contents adds nothing, whether or not it's
+        // marked, and pages past the end of a smaller memory are taken to
+        // be at power-on.
+        uint64_t memory_hash(const uint8_t* bytes, size_t size, uint64_t dirty, PageHashes* cache) {
+            const PowerOnPages& power_on = power_on_pages();
+            uint64_t sum = 0;
+
+            while (dirty != 0) {
+                int page = __builtin_ctzll(dirty);
+                dirty &= dirty - 1;
+
+                if (size_t(page + 1) * kPageSize > size)
+                    continue;
+
+                const uint8_t* contents = bytes + page * kPageSize;
+                uint64_t hash = cache != nullptr ? cache->page(page, contents) : page_hash(page, contents);
+                sum += hash - power_on.hashes[page];
+            }
+
+            return sum;
+        }
+
+        // Stack pointers only count modulo the stack size, and nothing
+        // else is left undefined
+        CPUState canonical(CPUState state) {
+            state.stack_pointer &= kStackMask;
+            std::fill_n(state.reserved, sizeof(state.reserved), 0);
+            return state;
+        }
+
+        uint64_t cpu_hash(const CPUState& state) {
+            static_assert(sizeof(CPUState) % 8 == 0, "hashed a word at a time");
+
+            uint64_t hash = 0;
+            for (size_t i = 0; i < sizeof(CPUState); i += 8) {
+                uint64_t word;
+                std::memcpy(&word, reinterpret_cast<const uint8_t*>(&state) + i, sizeof(word));
+                hash = mix(hash, word);
+            }
+            return hash;
+        }
+
+        CPUState compact_state(const CompactMachine& m) {
+            CPUState state = CPUState();
+
+            std::copy(m.registers, m.registers + 16, state.registers);
+            std::copy(m.stack, m.stack + kStackSize, state.stack);
+            state.index_register = m.index_register;
+            state.program_counter = m.program_counter;
+            state.stack_pointer = m.stack_pointer & kStackMask;
+            state.delay_timer = m.delay_timer;
+            state.sound_timer = m.sound_timer;
+            state.keys = m.keys;
+            state.waiting = m.waiting;
+            state.wait_register = m.wait_register;
+            state.random = m.random;
+
+            return state;
+        }
+
+        const uint64_t kCompactPages = (uint64_t(1) << (kCompactMemorySize / kPageSize)) - 1;
+
+        uint64_t machine_hash(const Chip8& chip8, PageHashes* cache) {
+            const Memory& memory = chip8.memory();
+            uint64_t hash = cpu_hash(canonical(chip8.cpu_state()));
+            hash = mix(hash, screen_hash(chip8.graphics()));
+            return mix(hash, memory_hash(memory.data(), kMemorySize, memory.dirty_pages(), cache));
+        }
+
+        uint64_t machine_hash(const CompactMachine& m, PageHashes* cache) {
+            uint64_t hash = cpu_hash(compact_state(m));
+            hash = mix(hash, screen_hash(m));
+            return mix(hash, memory_hash(m.memory, kCompactMemorySize, kCompactPages, cache));
+        }
+
+        /**
+         * One machine under test, run like Chip8::run_cycles() runs: speed
+         * / 60 instructions a frame, the keypad latched as each frame
+         * starts and polled as it ends.
+         */
+        class Side {
+        public:
+            virtual ~Side() {}
+
+            virtual void run(uint64_t cycles) = 0;
+            // state_hash() of the machine, rehashing only pages changed
+            // since the last call
+            virtual uint64_t hash() = 0;
+            virtual uint64_t frame() const = 0;
+            virtual CPUState state() const = 0;
+
+            virtual const uint8_t* memory() const = 0;
+            virtual size_t memory_size() const = 0;
+            virtual uint64_t dirty_pages() const = 0;
+
+            virtual bool hires() const = 0;
+            virtual int pixel(int x, int y) const = 0;
+
+            uint8_t byte(int location) const {
+                location &= kMemorySize - 1;
+                if (size_t(location) < memory_size())
+                    return memory()[location];
+                return Memory::power_on_byte(location);
+            }
+        };
+
+        class MachineSide : public Side {
+        public:
+            explicit MachineSide(const std::vector<KeyEvent>& inputs)
+                : _input(inputs), _chip8(&_input, &_video, &_audio) {
+            }
+
+            bool load(const LockstepSide& side, const LockstepConfig& config,
+                      const uint8_t* program, size_t size) {
+                _chip8.set_speed(config.speed);
+                _chip8.set_quirks(side.quirks);
+                _chip8.set_skip_idle(side.skip_idle);
+
+                if (side.engine == kEngineJit && !_chip8.set_jit(true)) {
+                    std::cerr << "[lockstep] The JIT isn't available on this host" << std::endl;
+                    return false;
+                }
+                if (!_chip8.reset(program, size)) {
+                    std::cerr << "[lockstep] The program doesn't fit in memory" << std::endl;
+                    return false;
+                }
+
+                _chip8.seed(config.seed);
+                return true;
+            }
+
+            void run(uint64_t cycles) override {
+                _chip8.run_cycles(cycles);
+            }
+
+            uint64_t hash() override {
+                return machine_hash(_chip8, &_pages);
+            }
+
+            uint64_t frame() const override {
+                return _chip8.frame();
+            }
+
+            CPUState state() const override {
+                return canonical(_chip8.cpu_state());
+            }
+
+            const uint8_t* memory() const override {
+                return _chip8.memory().data();
+            }
+
+            size_t memory_size() const override {
+                return kMemorySize;
+            }
+
+            uint64_t dirty_pages() const override {
+                return _chip8.memory().dirty_pages();
+            }
+
+            bool hires() const override {
+                return _chip8.graphics().hires();
+            }
+
+            int pixel(int x, int y) const override {
+                return _chip8.graphics().pixel(x, y);
+            }
+
+        private:
+            ScriptedInput _input;
+            HeadlessVideo _video;
+            HeadlessAudio _audio;
+            Chip8 _chip8;
+            PageHashes _pages;
+        };
+
+        class CompactSide : public Side {
+        public:
+            CompactSide(const LockstepSide& side, const std::vector<KeyEvent>& inputs)
+                : _arena(1, side.quirks), _machine(_arena[0]), _input(inputs), _speed(kDefaultSpeed),
+                  _frame_left(0), _frame_error(0), _in_frame(false) {
+            }
+
+            bool load(const LockstepConfig& config, const uint8_t* program, size_t size) {
+                CompactMachine& m = _machine;
+
+                if (!compact_reset(m, program, size)) {
+                    std::cerr << "[lockstep] compact only runs programs up to "
+                        << kCompactMemorySize - kProgramStart << " bytes" << std::endl;
+                    return false;
+                }
+
+                m.random = config.seed;
+                _speed = std::max(config.speed, uint32_t(1));
+                start_frame();
+                return true;
+            }
+
+            void run(uint64_t cycles) override {
+                CompactMachine& m = _machine;
+                uint64_t executed = 0;
+
+                while (executed < cycles) {
+                    uint64_t n = std::min(_frame_left, cycles - executed);
+
+                    if (!_in_frame) {
+                        compact_set_keys(m, _input.keys());
+                        _in_frame = true;
+                    }
+                    compact_run(m, n);
+                    executed += n;
+                    _frame_left -= n;
+
+                    if (_frame_left == 0) {
+                        compact_tick_timers(m);
+                        start_frame();
+                        m.frame++;
+                        _in_frame = false;
+                        _input.poll();
+                    }
+                }
+            }
+
+            uint64_t hash() override {
+                return machine_hash(_machine, &_pages);
+            }
+
+            uint64_t frame() const override {
+                return _machine.frame;
+            }
+
+            CPUState state() const override {
+                return compact_state(_machine);
+            }
+
+            const uint8_t* memory() const override {
+                return _machine.memory;
+            }
+
+            size_t memory_size() const override {
+                return kCompactMemorySize;
+            }
+
+            uint64_t dirty_pages() const override {
+                return kCompactPages;
+            }
+
+            bool hires() const override {
+                return false;
+            }
+
+            int pixel(int x, int y) const override {
+                return (_machine.screen[y] >> (63 - x)) & 1;
+            }
+
+        private:
+            // Same spread of instructions over frames as Chip8
+            void start_frame() {
+                uint64_t total = _speed + _frame_error;
+                _frame_left = total / 60;
+                _frame_error = total % 60;
+            }
+
+            CompactArena _arena;
+            CompactMachine& _machine;
+            ScriptedInput _input;
+            uint32_t _speed;
+            uint64_t _frame_left;
+            uint64_t _frame_error;
+            bool _in_frame;
+            PageHashes _pages;
+        };
+
+        std::unique_ptr<Side> make_side(const LockstepSide& side, const LockstepConfig& config,
+                                        const uint8_t* program, size_t size) {
+            if (side.engine == kEngineCompact) {
+                CompactSide* compact = new CompactSide(side, config.inputs);
+                std::unique_ptr<Side> owned(compact);
+                if (!compact->load(config, program, size))
+                    return nullptr;
+                return owned;
+            }
+
+            MachineSide* machine = new MachineSide(config.inputs);
+            std::unique_ptr<Side> owned(machine);
+            if (!machine->load(side, config, program, size))
+                return nullptr;
+            return owned;
+        }
+
+        std::string hex(unsigned value, int digits) {
+            std::ostringstream out;
+            out << "0x" << std::hex << std::uppercase << std::setw(digits) << std::setfill('0') << value;
+            return out.str();
+        }
+
+        void differ(std::vector<std::string>& out, const std::string& what, unsigned a, unsigned b,
+                    int digits) {
+            if (a != b)
+                out.push_back(what + " " + hex(a, digits) + " vs " + hex(b, digits));
+        }
+
+        // Everything that differs between the two, one line each, or
+        // nothing if they're the same
+        std::vector<std::string> compare(const Side& a, const Side& b) {
+            std::vector<std::string> out;
+            CPUState sa = a.state();
+            CPUState sb = b.state();
+
+            for (int r = 0; r < 16; r++)
+                differ(out, "v" + hex(r, 1).substr(2), sa.registers[r], sb.registers[r], 2);
+            differ(out, "i", sa.index_register, sb.index_register, 4);
+            differ(out, "pc", sa.program_counter, sb.program_counter, 4);
+            differ(out, "sp", sa.stack_pointer, sb.stack_pointer, 1);
+            for (int s = 0; s < kStackSize; s++)
+                differ(out, "stack[" + std::to_string(s) + "]", sa.stack[s], sb.stack[s], 4);
+            differ(out, "dt", sa.delay_timer, sb.delay_timer, 2);
+            differ(out, "st", sa.sound_timer, sb.sound_timer, 2);
+            differ(out, "keys", sa.keys, sb.keys, 4);
+            differ(out, "waiting", sa.waiting, sb.waiting, 1);
+            differ(out, "wait register", sa.wait_register, sb.wait_register, 1);
+            for (int f = 0; f < 16; f++)
+                differ(out, "flags[" + std::to_string(f) + "]", sa.flags[f], sb.flags[f], 2);
+            if (sa.random != sb.random)
+                out.push_back("generator state differs");
+
+            // Only pages either side may have written can differ
+            uint64_t pages = a.dirty_pages() | b.dirty_pages();
+            int bytes = 0;
+            while (pages != 0) {
+                int page = __builtin_ctzll(pages);
+                pages &= pages - 1;
+
+                for (int location = page * kPageSize; location < (page + 1) * kPageSize; location++) {
+                    uint8_t ba = a.byte(location);
+                    uint8_t bb = b.byte(location);
+                    if (ba != bb && bytes++ < kListedBytes)
+                        differ(out, "memory[" + hex(location, 4) + "]", ba, bb, 2);
+                }
+            }
+            if (bytes > kListedBytes)
+                out.push_back("memory: " + std::to_string(bytes - kListedBytes) + " more bytes differ");
+
+            if (a.hires() != b.hires()) {
+                differ(out, "hires", a.hires(), b.hires(), 1);
+            } else {
+                int width = a.hires() ? kMaxGraphicsWidth : kGraphicsWidth;
+                int height = a.hires() ? kMaxGraphicsHeight : kGraphicsHeight;
+                int pixels = 0;
+                int first_x = 0;
+                int first_y = 0;
+
+                for (int y = 0; y < height; y++) {
+                    for (int x = 0; x < width; x++) {
+                        if (a.pixel(x, y) != b.pixel(x, y) && pixels++ == 0) {
+                            first_x = x;
+                            first_y = y;
+                        }
+                    }
+                }
+
+                if (pixels > 0)
+                    out.push_back("screen: " + std::to_string(pixels) + " pixels differ, first at (" +
+                                  std::to_string(first_x) + ", " + std::to_string(first_y) + ")");
+            }
+
+            return out;
+        }
+
+        void advance(Side& a, Side& b, uint64_t cycles) {
+            a.run(cycles);
+            b.run(cycles);
+        }
+
+    } // namespace
+
+    bool parse_engine(const char* name, Engine& engine) {
+        for (int i = 0; i < 3; i++) {
+            if (std::strcmp(name, kEngineNames[i]) == 0) {
+                engine = Engine(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* engine_name(Engine engine) {
+        return kEngineNames[engine];
+    }
+
+    bool parse_lockstep_side(const std::string& spec, LockstepSide& side) {
+        std::istringstream fields(spec);
+        std::string field;
+
+        if (!std::getline(fields, field, ':') || !parse_engine(field.c_str(), side.engine))
+            return false;
+
+        while (std::getline(fields, field, ':')) {
+            if (field == "noidle")
+                side.skip_idle = false;
+            else if (!parse_quirks(field, side.quirks))
+                return false;
+        }
+
+        return true;
+    }
+
+    std::string lockstep_side_name(const LockstepSide& side) {
+        std::string name = std::string(engine_name(side.engine)) + ":" + quirks_name(side.quirks);
+        if (!side.skip_idle && side.engine != kEngineCompact)
+            name += ":noidle";
+        return name;
+    }
+
+    uint64_t state_hash(const Chip8& chip8) {
+        return machine_hash(chip8, nullptr);
+    }
+
+    uint64_t state_hash(const CompactMachine& m) {
+        return machine_hash(m, nullptr);
+    }
+
+    bool run_lockstep(const LockstepConfig& config, const uint8_t* program, size_t size,
+                      LockstepResult& result) {
+        result = LockstepResult();
+
+        std::unique_ptr<Side> a = make_side(config.a, config, program, size);
+        std::unique_ptr<Side> b = make_side(config.b, config, program, size);
+        if (!a || !b)
+            return false;
+
+        uint64_t interval = std::max(config.interval, uint64_t(1));
+        uint64_t agreed = 0;
+        result.hash = a->hash();
+
+        // Power-on already differs, e.g. in the fonts
+        if (result.hash != b->hash()) {
+            result.diverged = true;
+            result.stepped = true;
+            result.pc = kProgramStart;
+            result.opcode = a->byte(kProgramStart) << 8 | a->byte(kProgramStart + 1);
+            result.differences = compare(*a, *b);
+            return true;
+        }
+
+        while (agreed < config.cycles) {
+            uint64_t n = std::min(interval, config.cycles - agreed);
+            advance(*a, *b, n);
+            result.checks++;
+
+            uint64_t hash = a->hash();
+            if (hash == b->hash()) {
+                agreed += n;
+                result.hash = hash;
+                continue;
+            }
+
+            // They came apart somewhere in the last n. Keep what differs at
+            // the end of it, in case stepping doesn't reproduce it.
+            result.diverged = true;
+            result.instructions = agreed + n;
+            result.frame = a->frame();
+            result.differences = compare(*a, *b);
+
+            // Run fresh machines up to the last agreement in the same steps
+            // as before, then one instruction at a time
+            a = make_side(config.a, config, program, size);
+            b = make_side(config.b, config, program, size);
+            for (uint64_t done = 0; done < agreed; done += interval)
+                advance(*a, *b, std::min(interval, agreed - done));
+
+            for (uint64_t i = 0; i < n; i++) {
+                uint16_t pc = a->state().program_counter;
+                advance(*a, *b, 1);
+
+                std::vector<std::string> differences = compare(*a, *b);
+                if (!differences.empty()) {
+                    result.stepped = true;
+                    result.instructions = agreed + i + 1;
+                    result.frame = a->frame();
+                    result.pc = pc;
+                    result.opcode = a->byte(pc) << 8 | a->byte(pc + 1);
+                    result.differences = differences;
+                    break;
+                }
+            }
+
+            return true;
+        }
+
+        result.instructions = agreed;
+        result.frame = a->frame();
+        return true;
+    }
+
+    void write_lockstep_report(std::ostream& out, const LockstepConfig& config,
+                               const LockstepResult& result) {
+        std::string a = lockstep_side_name(config.a);
+        std::string b = lockstep_side_name(config.b);
+
+        if (!result.diverged) {
+            out << "[lockstep] " << a << " and " << b << " agree over " << result.instructions
+                << " instructions (" << result.frame << " frames, " << result.checks
+                << " checks), state " << std::hex << std::setw(16) << std::setfill('0')
+                << result.hash << std::dec << std::setfill(' ') << std::endl;
+            return;
+        }
+
+        out << "[lockstep] " << a << " and " << b;
+        if (result.instructions == 0)
+            out << " differ at power-on";
+        else if (result.stepped)
+            out << " diverged after instruction " << result.instructions << " (frame " << result.frame
+                << "), " << hex(result.opcode, 4).substr(2) << " at " << hex(result.pc, 4);
+        else
+            out << " diverged by instruction " << result.instructions << " (frame " << result.frame
+                << ") running " << std::max(config.interval, uint64_t(1)) << " at a time, but not one at a time";
+        out << std::endl;
+
+        for (const auto& line : result.differences)
+            out << "    " << line << std::endl;
+    }
+
+} // namespace Chip8
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "compact.h"
+#include "headless.h"
+#include "quirks.h"
+
+/**
+ * Differential execution: two machines run the same program on the same
+ * keypad script side by side, each with its own implementation and
+ * quirks, and are compared every so many instructions until they disagree.
+ * Meant for checking an optimization of the CPU against the interpreter.
+ */
+
+namespace Chip8 {
+
+    // Implementations a side can run on
+    enum Engine {
+        kEngineInterpreter,
+        kEngineJit,
+        kEngineCompact,             // CompactMachine, 4 KiB and low resolution only
+    };
+
+    // "interp", "jit" or "compact"
+    bool parse_engine(const char* name, Engine& engine);
+    const char* engine_name(Engine engine);
+
+    struct LockstepSide {
+        Engine engine = kEngineInterpreter;
+        QuirkProfile quirks = kDefaultQuirks;
+        bool skip_idle = true;      // See CPU::set_skip_idle(), not on compact
+    };
+
+    // ENGINE[:QUIRKS][:noidle], e.g. "jit", "interp:vip" or "interp:modern:noidle"
+    bool parse_lockstep_side(const std::string& spec, LockstepSide& side);
+    std::string lockstep_side_name(const LockstepSide& side);
+
+    /**
+     * Hash of everything that decides what a machine does next: the CPU
+     * state, the screen and memory. Memory is hashed page by page against
+     * its power-on contents, so only pages written since power-on cost
+     * anything, and machines with different memory sizes or dirty page
+     * tracking hash alike when their contents match.
+     */
+    uint64_t state_hash(const Chip8& chip8);
+    uint64_t state_hash(const CompactMachine& m);
+
+    struct LockstepConfig {
+        LockstepSide a;
+        LockstepSide b;
+        uint64_t cycles = 1000000;
+
+        // Instructions between comparisons, 1 to compare after every one.
+        // A divergence is pinned down to the instruction either way.
+        uint64_t interval = 1000;
+
+        uint32_t speed = kDefaultSpeed;
+        uint64_t seed = 0;
+        std::vector<KeyEvent> inputs;
+    };
+
+    struct LockstepResult {
+        bool diverged;
+        uint64_t instructions;      // Both agreed up to here
+        uint64_t frame;             // Of side a, when they stopped
+        uint64_t checks;
+        uint64_t hash;              // state_hash() both agreed on last
+
+        // The instruction side a ran as they came apart, and what differs
+        // after it, one line each
+        uint16_t pc;
+        uint16_t opcode;
+        std::vector<std::string> differences;
+        bool stepped;               // False if only a whole interval disagreed
+    };
+
+    /**
+     * Runs config.cycles instructions on both sides, comparing state hashes
+     * every interval. On a mismatch both are run again up to the last
+     * comparison that agreed and stepped one instruction at a time from
+     * there, to report the first one after which they differ. False, with a
+     * message, if a side can't run the program.
+     */
+    bool run_lockstep(const LockstepConfig& config, const uint8_t* program, size_t size,
+                      LockstepResult& result);
+
+    // A few lines saying where the sides came apart and how
+    void write_lockstep_report(std::ostream& out, const LockstepConfig& config,
+                               const LockstepResult& result);
+
+} // namespace Chip8
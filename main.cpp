@@ -1,27 +1,531 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
 #include "chip8.h"
+#include "headless.h"
+#include "trace.h"
+#include "upscale.h"
+#ifdef CHIP8_HAVE_SDL
+#include "sdl_backend.h"
+#endif
 
-int main(int argc, char *argv[]) {
+namespace {
+
+    // Instructions kept by --trace
+    const size_t kTraceCapacity = 1 << 16;
 
-    Chip8::Chip8 chip8;
+    // Snapshots a second when rewinding is on
+    const size_t kRewindFramesPerSecond = 60;
 
-    if (argc != 2) {
-        std::cout << "usage: " << argv[0] << " <filename>\n" << std::endl;
+    struct Options {
+        bool headless = false;
+        bool jit = false;
+        bool vsync = true;
+        bool bounded = false;
+        bool skip_idle = true;
+        uint64_t cycles = 1000000;
+        uint32_t speed = 0;
+        const char* filename = nullptr;
+        const char* trace_file = nullptr;
+        const char* load_state = nullptr;
+        const char* save_state = nullptr;
+        uint32_t rewind_seconds = 60;
+        int audio_buffer = 512;
+        int audio_latency = 40;
+        const char* keymap = nullptr;
+        uint64_t seed = 0;
+        bool seeded = false;
+        bool quirks_set = false;
+        Chip8::QuirkProfile quirks = Chip8::kDefaultQuirks;
+        const char* quirks_db = nullptr;
+        const char* record_file = nullptr;
+        const char* replay_file = nullptr;
+        const char* profile_file = nullptr;
+        const char* folded_file = nullptr;
+        const char* capture_path = nullptr;
+        Chip8::CaptureFormat capture_format = Chip8::kCapturePNG;
+        uint64_t capture_every = 1;
+        size_t capture_queue = 64;
+        const char* debug_socket = nullptr;
+        const char* metrics_file = nullptr;
+        const char* metrics_socket = nullptr;
+        Chip8::MetricsFormat metrics_format = Chip8::kMetricsPrometheus;
+        uint32_t metrics_interval = 1000;
+        bool overlay = false;
+        bool software_scale = false;
+        Chip8::UpscaleConfig display;
+        Chip8::TraceLevel trace_level = Chip8::kTraceRegisters;
+    };
+
+    void usage(const char* name) {
+        std::cout << "usage: " << name
+            << " [--headless] [--cycles N] [--ips N] [--cpu=interp|jit] [--no-vsync]"
+            << " [--trace FILE] [--trace-level ops|regs] [--load-state FILE]"
+            << " [--save-state FILE] [--rewind SECONDS] [--audio-buffer SAMPLES]"
+            << " [--audio-latency MS] [--keymap KEYS] [--seed N] [--record FILE]"
+            << " [--quirks vip|chip48|schip|modern] [--quirks-db FILE]"
+            << " [--replay FILE] [--profile FILE] [--profile-folded FILE] [--no-idle-skip]"
+            << " [--capture PATH] [--capture-format png|ppm|raw] [--capture-every N]"
+            << " [--capture-queue FRAMES] [--debug-socket PATH] [--scale N] [--software-scale]"
+            << " [--filter nearest|scale2x|scale3x] [--palette NAME|RRGGBB,...] [--phosphor PERCENT]"
+            << " [--metrics FILE] [--metrics-socket PATH] [--metrics-format json|prometheus]"
+            << " [--metrics-interval MS] [--overlay]"
+            << " <filename>\n" << std::endl;
         std::exit(2);
     }
 
-    std::ifstream program;
+    Options parse_options(int argc, char *argv[]) {
+        Options options;
+
+        for (int i = 1; i < argc; i++) {
+            if (std::strcmp(argv[i], "--headless") == 0) {
+                options.headless = true;
+            } else if (std::strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+                options.cycles = std::strtoull(argv[++i], nullptr, 10);
+                options.bounded = true;
+            } else if (std::strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+                options.speed = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--no-vsync") == 0) {
+                options.vsync = false;
+            } else if (std::strcmp(argv[i], "--no-idle-skip") == 0) {
+                options.skip_idle = false;
+            } else if (std::strcmp(argv[i], "--cpu=jit") == 0) {
+                options.jit = true;
+            } else if (std::strcmp(argv[i], "--cpu=interp") == 0) {
+                options.jit = false;
+            } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+                options.trace_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+                options.load_state = argv[++i];
+            } else if (std::strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+                options.save_state = argv[++i];
+            } else if (std::strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc) {
+                options.audio_buffer = std::max(std::atoi(argv[++i]), 16);
+            } else if (std::strcmp(argv[i], "--audio-latency") == 0 && i + 1 < argc) {
+                options.audio_latency = std::max(std::atoi(argv[++i]), 0);
+            } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                options.seed = std::strtoull(argv[++i], nullptr, 10);
+                options.seeded = true;
+            } else if (std::strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+                if (!Chip8::parse_quirks(argv[++i], options.quirks))
+                    usage(argv[0]);
+                options.quirks_set = true;
+            } else if (std::strcmp(argv[i], "--quirks-db") == 0 && i + 1 < argc) {
+                options.quirks_db = argv[++i];
+            } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+                options.record_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+                options.replay_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+                options.profile_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--profile-folded") == 0 && i + 1 < argc) {
+                options.folded_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+                options.capture_path = argv[++i];
+            } else if (std::strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc) {
+                if (!Chip8::parse_capture_format(argv[++i], options.capture_format))
+                    usage(argv[0]);
+            } else if (std::strcmp(argv[i], "--capture-every") == 0 && i + 1 < argc) {
+                options.capture_every = std::strtoull(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--capture-queue") == 0 && i + 1 < argc) {
+                options.capture_queue = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--debug-socket") == 0 && i + 1 < argc) {
+                options.debug_socket = argv[++i];
+            } else if (std::strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+                options.metrics_file = argv[++i];
+            } else if (std::strcmp(argv[i], "--metrics-socket") == 0 && i + 1 < argc) {
+                options.metrics_socket = argv[++i];
+            } else if (std::strcmp(argv[i], "--metrics-format") == 0 && i + 1 < argc) {
+                if (!Chip8::parse_metrics_format(argv[++i], options.metrics_format))
+                    usage(argv[0]);
+            } else if (std::strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+                options.metrics_interval = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--overlay") == 0) {
+                options.overlay = true;
+            } else if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+                options.display.scale = std::max(std::atoi(argv[++i]), 1);
+            } else if (std::strcmp(argv[i], "--software-scale") == 0) {
+                options.software_scale = true;
+            } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+                if (!Chip8::parse_scale_filter(argv[++i], options.display.filter))
+                    usage(argv[0]);
+            } else if (std::strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+                if (!Chip8::parse_palette(argv[++i], options.display.palette))
+                    usage(argv[0]);
+            } else if (std::strcmp(argv[i], "--phosphor") == 0 && i + 1 < argc) {
+                int percent = std::min(std::max(std::atoi(argv[++i]), 0), 99);
+                options.display.persistence = percent * 256 / 100;
+            } else if (std::strcmp(argv[i], "--keymap") == 0 && i + 1 < argc) {
+                options.keymap = argv[++i];
+            } else if (std::strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+                options.rewind_seconds = std::strtoul(argv[++i], nullptr, 10);
+            } else if (std::strcmp(argv[i], "--trace-level") == 0 && i + 1 < argc) {
+                std::string level = argv[++i];
+                if (level == "ops")
+                    options.trace_level = Chip8::kTraceInstructions;
+                else if (level == "regs")
+                    options.trace_level = Chip8::kTraceRegisters;
+                else
+                    usage(argv[0]);
+            } else if (argv[i][0] == '-' || options.filename != nullptr) {
+                usage(argv[0]);
+            } else {
+                options.filename = argv[i];
+            }
+        }
+
+        if (options.filename == nullptr)
+            usage(argv[0]);
+
+        // A recording starts from power-on
+        if (options.record_file != nullptr && options.load_state != nullptr) {
+            std::cerr << "--record can't be combined with --load-state" << std::endl;
+            std::exit(2);
+        }
+
+        // Unseeded runs still differ each time, but can be reproduced
+        if (!options.seeded)
+            options.seed = std::chrono::system_clock::now().time_since_epoch().count();
+
+        return options;
+    }
+
+    void configure(Chip8::Chip8& chip8, const Options& options, Chip8::Trace* trace,
+                   Chip8::Profiler* profiler, Chip8::FrameCapture* capture, Chip8::Debugger* debugger,
+                   Chip8::Metrics* metrics) {
+        if (options.speed != 0)
+            chip8.set_speed(options.speed);
+        chip8.seed(options.seed);
+        chip8.set_quirks(options.quirks);
+        chip8.set_skip_idle(options.skip_idle);
+
+        if (options.jit && !chip8.set_jit(true))
+            std::cerr << "[main] JIT not available, interpreting" << std::endl;
+
+        if (trace != nullptr) {
+#ifndef CHIP8_TRACE
+            std::cerr << "[main] built without CHIP8_TRACE, trace will be empty" << std::endl;
+#endif
+            trace->set_level(options.trace_level);
+            chip8.set_trace(trace);
+        }
+
+        // F2 writes the profile so far, and it's always written on exit
+        if (profiler != nullptr) {
+            chip8.set_profiler(profiler, options.profile_file ? options.profile_file : "",
+                               options.folded_file ? options.folded_file : "");
+        }
+
+        chip8.set_capture(capture);
+        chip8.set_debugger(debugger);
+        chip8.set_metrics(metrics);
+    }
+
+    // --quirks wins over a --quirks-db entry for the ROM, which wins over
+    // the default
+    void select_quirks(Options& options, const Chip8::MappedFile& rom) {
+        const char* source = options.quirks_set ? "--quirks" : "default";
+
+        if (!options.quirks_set && options.quirks_db != nullptr) {
+            Chip8::QuirkTable table;
+            if (!table.load(options.quirks_db)) {
+                std::cerr << "couldn't read quirks from " << options.quirks_db << std::endl;
+                exit(1);
+            }
+            if (table.find(Chip8::hash_rom(rom.data(), rom.size()), options.quirks))
+                source = options.quirks_db;
+        }
+
+        std::cout << "[main] Quirks " << Chip8::quirks_name(options.quirks) << " (" << source << ")"
+            << std::endl;
+    }
+
+    void load_program(Chip8::Chip8& chip8, const Chip8::MappedFile& rom) {
+        if (!chip8.load_program(rom.data(), rom.size())) {
+            std::cerr << "program is too large" << std::endl;
+            exit(1);
+        }
+    }
+
+    bool load_state(Chip8::Chip8& chip8, const char* filename) {
+        Chip8::MachineState state;
+
+        std::ifstream in(filename, std::ifstream::binary);
+        if (!Chip8::read_state(in, state)) {
+            std::cerr << "[main] couldn't load state from " << filename << std::endl;
+            return false;
+        }
+
+        chip8.restore(state);
+        return true;
+    }
+
+    void save_state(const Chip8::Chip8& chip8, const char* filename) {
+        Chip8::MachineState state;
+        chip8.save(state);
+
+        std::ofstream out(filename, std::ofstream::binary);
+        if (!Chip8::write_state(out, state))
+            std::cerr << "[main] couldn't save state to " << filename << std::endl;
+        else
+            std::cout << "[main] Saved state to " << filename << std::endl;
+    }
+
+    void write_movie(const Options& options, const Chip8::Chip8& chip8, Chip8::Movie& movie) {
+        if (options.record_file == nullptr)
+            return;
+
+        movie.finish();
+
+        std::ofstream out(options.record_file, std::ofstream::binary);
+        if (!movie.write(out))
+            std::cerr << "[main] couldn't write recording to " << options.record_file << std::endl;
+        else
+            std::cout << "[main] Recorded " << chip8.frame() << " frames, " << movie.events.size()
+                << " keypad changes to " << options.record_file << std::endl;
+    }
+
+    // Re-runs a recording as fast as possible and checks its screen hashes
+    int run_replay(const Options& options, const Chip8::MappedFile& rom) {
+        Chip8::Movie movie;
+
+        std::ifstream in(options.replay_file, std::ifstream::binary);
+        if (!Chip8::Movie::read(in, movie)) {
+            std::cerr << "couldn't read recording " << options.replay_file << std::endl;
+            return 1;
+        }
+
+        if (movie.rom_hash != Chip8::hash_rom(rom.data(), rom.size())) {
+            std::cerr << options.replay_file << " was recorded with a different program" << std::endl;
+            return 1;
+        }
+
+        Chip8::ReplayResult result = Chip8::replay(movie, rom.data(), rom.size(), options.jit);
+
+        std::cout << "[main] Replayed " << result.frames << " frames (" << result.instructions
+            << " instructions) in " << result.seconds << "s, "
+            << uint64_t(result.frames / result.seconds) << " frames/s" << std::endl;
+
+        if (!result.matched) {
+            std::cout << "[main] Screen differs at frame " << result.frames << ": expected "
+                << std::hex << result.expected_hash << ", got " << result.actual_hash
+                << std::dec << std::endl;
+            return 1;
+        }
+
+        std::cout << "[main] All " << movie.hashes.size() << " screen hashes match" << std::endl;
+        return 0;
+    }
+
+    void write_trace(const Options& options, const Chip8::Trace* trace) {
+        if (trace == nullptr)
+            return;
+
+        std::ofstream out(options.trace_file, std::ofstream::binary);
+        if (!trace->write(out))
+            std::cerr << "[main] couldn't write trace to " << options.trace_file << std::endl;
+        else
+            std::cout << "[main] Wrote " << trace->size() << " trace records to "
+                << options.trace_file << std::endl;
+    }
+
+    void write_capture(const Options& options, Chip8::FrameCapture* capture) {
+        if (capture == nullptr)
+            return;
+
+        capture->finish();
+        std::cout << "[main] Captured " << capture->written() << " frames to " << options.capture_path
+            << " (" << capture->duplicates() << " unchanged, " << capture->dropped() << " dropped, "
+            << capture->errors() << " failed)" << std::endl;
+    }
+
+    // Runs a fixed number of instructions without pacing, e.g. headless or
+    // with SDL_VIDEODRIVER=dummy to measure the cost of presenting
+    void run_unthrottled(Chip8::Chip8& chip8, uint64_t cycles) {
+        std::cout << "[main] Running " << cycles << " instructions unthrottled" << std::endl;
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t executed = chip8.run_cycles(cycles);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << "[main] Executed " << std::dec << executed << " instructions in "
+            << elapsed.count() << "s (" << uint64_t(executed / elapsed.count())
+            << " instructions/s, " << chip8.frames_presented() << " frames, "
+            << uint64_t(chip8.frames_presented() / elapsed.count()) << " frames/s)" << std::endl;
+
+        if (chip8.idle_skipped() != 0)
+            std::cout << "[main] Skipped " << chip8.idle_skipped() << " instructions in idle loops"
+                << std::endl;
+    }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options options = parse_options(argc, argv);
+
+#ifndef CHIP8_HAVE_SDL
+    if (!options.headless) {
+        std::cerr << "built without SDL, only --headless is available" << std::endl;
+        std::exit(2);
+    }
+#endif
+
+    Chip8::MappedFile rom;
     std::cout << "[main] Opening program" << std::endl;
-    program.open(argv[1], std::ifstream::binary);
-    if (!program.is_open()) {
+    if (!rom.open(options.filename)) {
         std::cerr << "couldn't open program" << std::endl;
         exit(1);
     }
 
-    std::cout << "[main] Loading program" << std::endl;
-    chip8.load_program(program);
+    if (options.replay_file != nullptr)
+        return run_replay(options, rom);
+
+    std::cout << "[main] Seed " << options.seed << std::endl;
+    select_quirks(options, rom);
+
+    Chip8::Movie movie;
+    movie.seed = options.seed;
+    movie.speed = options.speed;
+    movie.rom_hash = Chip8::hash_rom(rom.data(), rom.size());
+    movie.quirks = options.quirks;
+
+    std::unique_ptr<Chip8::Trace> trace;
+    if (options.trace_file != nullptr)
+        trace.reset(new Chip8::Trace(kTraceCapacity));
+
+    std::unique_ptr<Chip8::Profiler> profiler;
+    if (options.profile_file != nullptr || options.folded_file != nullptr)
+        profiler.reset(new Chip8::Profiler);
 
-    std::cout << "[main] Running program" << std::endl;
-    chip8.run();
+    std::unique_ptr<Chip8::FrameCapture> capture;
+    if (options.capture_path != nullptr) {
+        Chip8::CaptureConfig config;
+        config.format = options.capture_format;
+        config.path = options.capture_path;
+        config.every = options.capture_every;
+        config.queue = options.capture_queue;
+
+        capture.reset(new Chip8::FrameCapture(config));
+        if (!capture->ok())
+            exit(1);
+    }
+
+    std::unique_ptr<Chip8::Debugger> debugger;
+    if (options.debug_socket != nullptr) {
+        debugger.reset(new Chip8::Debugger);
+        if (!debugger->listen(options.debug_socket))
+            exit(1);
+        std::cout << "[main] Debugger listening on " << options.debug_socket << std::endl;
+    }
+
+    std::unique_ptr<Chip8::Metrics> metrics;
+    std::unique_ptr<Chip8::MetricsExporter> exporter;
+    if (options.metrics_file != nullptr || options.metrics_socket != nullptr || options.overlay)
+        metrics.reset(new Chip8::Metrics);
+    if (options.metrics_file != nullptr || options.metrics_socket != nullptr) {
+        Chip8::MetricsExportConfig config;
+        config.format = options.metrics_format;
+        config.file = options.metrics_file ? options.metrics_file : "";
+        config.socket = options.metrics_socket ? options.metrics_socket : "";
+        config.interval_ms = options.metrics_interval;
+
+        exporter.reset(new Chip8::MetricsExporter(*metrics, config));
+        if (!exporter->ok())
+            exit(1);
+    }
+
+    if (options.headless) {
+        Chip8::HeadlessInput input;
+        Chip8::HeadlessVideo video;
+        Chip8::HeadlessAudio audio;
+        Chip8::Chip8 chip8(&input, &video, &audio);
+
+        // Configured first, as the quirks decide how much memory there is
+        configure(chip8, options, trace.get(), profiler.get(), capture.get(), debugger.get(),
+                  metrics.get());
+        std::cout << "[main] Loading program" << std::endl;
+        load_program(chip8, rom);
+        if (options.load_state != nullptr && !load_state(chip8, options.load_state))
+            exit(1);
+        if (options.record_file != nullptr)
+            chip8.set_recorder(&movie);
+
+        run_unthrottled(chip8, options.cycles);
+        write_movie(options, chip8, movie);
+        write_trace(options, trace.get());
+        write_capture(options, capture.get());
+        chip8.write_profile();
+        if (options.save_state != nullptr)
+            save_state(chip8, options.save_state);
+        return 0;
+    }
+
+#ifdef CHIP8_HAVE_SDL
+    SDL_Init(0);
+    {
+        Chip8::KeyMap keymap = Chip8::default_keymap();
+        if (options.keymap != nullptr && !Chip8::parse_keymap(options.keymap, keymap)) {
+            std::cerr << "--keymap takes 16 keys, one for each of 0-F" << std::endl;
+            exit(2);
+        }
+
+        Chip8::SDLInput input(keymap);
+        Chip8::VideoConfig video_config;
+        video_config.vsync = options.vsync;
+        video_config.software = options.software_scale;
+        video_config.display = options.display;
+
+        Chip8::SDLVideo video(video_config);
+        if (options.overlay)
+            video.set_overlay(metrics.get());
+        Chip8::AudioConfig audio_config;
+        audio_config.buffer_samples = options.audio_buffer;
+        audio_config.latency_ms = options.audio_latency;
+
+        Chip8::SDLAudio audio(audio_config);
+        Chip8::Chip8 chip8(&input, &video, &audio);
+
+        // Configured first, as the quirks decide how much memory there is
+        configure(chip8, options, trace.get(), profiler.get(), capture.get(), debugger.get(),
+                  metrics.get());
+        std::cout << "[main] Loading program" << std::endl;
+        load_program(chip8, rom);
+        if (options.load_state != nullptr && !load_state(chip8, options.load_state))
+            exit(1);
+
+        // F5 / F9 save and load the --save-state file (or the loaded one),
+        // backspace rewinds
+        const char* state_file = options.save_state ? options.save_state : options.load_state;
+        if (state_file != nullptr)
+            chip8.set_state_file(state_file);
+
+        // Rewinding would desynchronise a recording from its keypad log, and
+        // so would loading a state (Chip8::load_file() refuses to)
+        std::unique_ptr<Chip8::Rewind> rewind;
+        if (options.record_file != nullptr) {
+            chip8.set_recorder(&movie);
+        } else if (options.rewind_seconds != 0) {
+            rewind.reset(new Chip8::Rewind(options.rewind_seconds * kRewindFramesPerSecond));
+            chip8.set_rewind(rewind.get());
+        }
+
+        if (options.bounded) {
+            run_unthrottled(chip8, options.cycles);
+        } else {
+            std::cout << "[main] Running program" << std::endl;
+            chip8.run();
+        }
+        write_movie(options, chip8, movie);
+        write_capture(options, capture.get());
+        chip8.write_profile();
+    }
+    SDL_Quit();
+    write_trace(options, trace.get());
+#endif
 }
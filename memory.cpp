@@ -26,24 +26,181 @@ namespace Chip8 {
         0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
 
-    Memory::Memory() {
+    const uint16_t kBigFontSetLocation = 0x0A0;
+
+    const uint8_t kBigFontSet[160] = {
+        0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+        0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+        0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+        0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+        0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+    };
+
+    static_assert(kMemorySize / kPageSize <= 64, "dirty pages must fit in a word");
+
+    Memory::Memory() : _mask(kMemorySize - 1), _listener(nullptr), _watcher(nullptr), _watches(nullptr), _dirty_pages(0) {
         std::fill_n(memory, sizeof(memory), 0);
         std::copy(kFontSet, kFontSet + sizeof(kFontSet), &memory[kFontSetLocation]);
+        std::copy(kBigFontSet, kBigFontSet + sizeof(kBigFontSet), &memory[kBigFontSetLocation]);
+    }
+
+    void Memory::set_listener(MemoryListener* listener) {
+        _listener = listener;
+    }
+
+    void Memory::set_address_mask(uint16_t mask) {
+        _mask = mask;
+    }
+
+    void Memory::set_watcher(MemoryWatcher* watcher, const WatchMap* map) {
+        _watcher = watcher;
+        _watches = watcher != nullptr ? map : nullptr;
     }
 
     uint8_t Memory::getByte(int location) {
         //std::cout << "accessing 0x" << std::hex << location << std::endl;
+        location &= _mask;
+        if (_watches != nullptr)
+            return watched_read(location);
+        return memory[location];
+    }
+
+    // The watched paths are out of line and tail called, so accesses with
+    // no watcher stay as cheap as they were
+
+    uint8_t Memory::watched_read(int location) {
+        if ((_watches->reads[location >> 6] >> (location & 63)) & 1)
+            _watcher->on_watch(location, false);
         return memory[location];
     }
 
+    void Memory::watched_write(int location) {
+        if ((_watches->writes[location >> 6] >> (location & 63)) & 1)
+            _watcher->on_watch(location, true);
+        if (_listener != nullptr)
+            _listener->on_write(location);
+    }
+
+    uint8_t Memory::peek(int location) const {
+        return memory[location & _mask];
+    }
+
+    void Memory::getBytes(int location, uint8_t* out, int count) {
+        location &= _mask;
+
+        if (_watches != nullptr) {
+            for (int i = 0; i < count; i++)
+                watched_read((location + i) & _mask);
+        }
+
+        if (location + count <= _mask + 1) {
+            std::copy(memory + location, memory + location + count, out);
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+            out[i] = memory[(location + i) & _mask];
+    }
+
     void Memory::putByte(int location, uint8_t value) {
+        location &= _mask;
         memory[location] = value;
+        _dirty_pages |= uint64_t(1) << (location >> kPageShift);
+
+        if (_watches != nullptr)
+            return watched_write(location);
+        if (_listener != nullptr)
+            _listener->on_write(location);
+    }
+
+    const uint8_t* Memory::data() const {
+        return memory;
+    }
+
+    void Memory::notify(int location, uint8_t value) {
+        if (memory[location] == value)
+            return;
+
+        memory[location] = value;
+        _dirty_pages |= uint64_t(1) << (location >> kPageShift);
+        if (_listener != nullptr)
+            _listener->on_write(location);
+    }
+
+    void Memory::restore(const uint8_t* bytes) {
+        // Pages are compared whole first, as a restore usually changes few
+        for (int first = 0; first < kMemorySize; first += kPageSize) {
+            if (std::equal(memory + first, memory + first + kPageSize, bytes + first))
+                continue;
+            for (int location = first; location < first + kPageSize; location++)
+                notify(location, bytes[location]);
+        }
+    }
+
+    bool Memory::load(int location, const uint8_t* data, size_t size) {
+        if (location < 0 || size > size_t(kMemorySize - location))
+            return false;
+
+        std::copy(data, data + size, memory + location);
+
+        for (size_t i = 0; i < size; i += kPageSize)
+            _dirty_pages |= uint64_t(1) << ((location + i) >> kPageShift);
+        if (size > 0)
+            _dirty_pages |= uint64_t(1) << ((location + size - 1) >> kPageShift);
+
+        if (_listener != nullptr) {
+            for (size_t i = 0; i < size; i++)
+                _listener->on_write(location + i);
+        }
+        return true;
+    }
+
+    void Memory::reset() {
+        uint64_t pages = _dirty_pages;
+
+        while (pages != 0) {
+            int page = __builtin_ctzll(pages);
+            pages &= pages - 1;
+
+            int first = page << kPageShift;
+            for (int location = first; location < first + kPageSize; location++)
+                notify(location, power_on_byte(location));
+        }
+
+        _dirty_pages = 0;
+    }
+
+    uint64_t Memory::dirty_pages() const {
+        return _dirty_pages;
+    }
+
+    uint8_t Memory::power_on_byte(int location) {
+        if (location >= kFontSetLocation && location < kFontSetLocation + int(sizeof(kFontSet)))
+            return kFontSet[location - kFontSetLocation];
+        if (location >= kBigFontSetLocation && location < kBigFontSetLocation + int(sizeof(kBigFontSet)))
+            return kBigFontSet[location - kBigFontSetLocation];
+        return 0;
     }
 
     uint16_t Memory::getFontLocation() {
         return kFontSetLocation;
     }
 
+    uint16_t Memory::getBigFontLocation() {
+        return kBigFontSetLocation;
+    }
+
     void Memory::dump() {
         for (int i = 0; i < (kMemorySize / 16); i++) {
             // Print the header
@@ -1,28 +1,100 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 /**
- * 0xF?? - 0xFFF built in 4x5 pixel font set A-F, 1-9
- * 0x200 - 0xF?? program rom and work ram
- * 0x000 - 0x200 interpreter (reserved)
+ * 0x0000 - 0x01FF interpreter (reserved), with the 4x5 and 8x10 fonts
+ * 0x0200 - 0x0FFF program rom and work ram
+ * 0x1000 - 0xFFFF XO-CHIP's extended memory, mostly reached through I
  */
 
 namespace Chip8 {
 
-    const int kMemorySize = 4 * 1024;
+    const int kMemorySize = 64 * 1024;
+
+    // Granularity of the dirty page tracking
+    const int kPageShift = 10;
+    const int kPageSize = 1 << kPageShift;
+
+    // Notified on every write, e.g. so decoded instructions can be dropped
+    class MemoryListener {
+    public:
+        virtual ~MemoryListener() {}
+        virtual void on_write(int location) = 0;
+    };
+
+    // Locations a watcher wants to hear about, one bit per address
+    struct WatchMap {
+        uint64_t reads[kMemorySize / 64];
+        uint64_t writes[kMemorySize / 64];
+    };
+
+    // Told about reads and writes by instructions to locations in its map
+    class MemoryWatcher {
+    public:
+        virtual ~MemoryWatcher() {}
+        virtual void on_watch(int location, bool write) = 0;
+    };
 
     class Memory {
     public:
         Memory();
 
+        void set_listener(MemoryListener* listener);
+
+        // Accesses wrap around past mask, e.g. 0x0FFF for a 4 KiB machine.
+        // Storage is always kMemorySize; what's past the mask is unused.
+        void set_address_mask(uint16_t mask);
+
+        // Checked on every data access while set, so it's only set while
+        // the map has something in it
+        void set_watcher(MemoryWatcher* watcher, const WatchMap* map);
+
         uint8_t getByte(int location);
         void putByte(int location, uint8_t value);
-        uint16_t getFontLocation();
+        void getBytes(int location, uint8_t* out, int count);
+
+        // Reads without telling the watcher, for fetching instructions
+        uint8_t peek(int location) const;
+        static uint16_t getFontLocation();
+
+        // SUPER-CHIP's 8x10 digits, ten bytes each
+        static uint16_t getBigFontLocation();
+
+        // Contents of a location at power-on, zero outside the fonts
+        static uint8_t power_on_byte(int location);
+
+        // Whole address space, e.g. for save states. restore() only tells
+        // the listener about bytes that actually change.
+        const uint8_t* data() const;
+        void restore(const uint8_t* bytes);
+
+        // Copies a block in at once, e.g. a program. False if it doesn't fit.
+        bool load(int location, const uint8_t* data, size_t size);
+
+        // Back to the power-on contents (zeros and the fonts). Only 1 KiB
+        // pages written since the last reset are touched.
+        void reset();
+
+        // Bit N set if page N may differ from its power-on contents
+        uint64_t dirty_pages() const;
+
         void dump();
 
     private:
+        void notify(int location, uint8_t value);
+        __attribute__((noinline)) uint8_t watched_read(int location);
+        __attribute__((noinline)) void watched_write(int location);
+
         uint8_t memory[kMemorySize];
+        int _mask;
+        MemoryListener* _listener;
+        MemoryWatcher* _watcher;
+        const WatchMap* _watches;
+
+        // Bit N set if page N may differ from its power-on contents
+        uint64_t _dirty_pages;
     };
 
 } // namespace Chip8
@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/**
+ * Dumps, in either format, hold:
+ *
+ *   instructions       Guest instructions executed (a budget, so including
+ *                      any skipped through busy-wait loops)
+ *   frames_emulated    60hz frames completed
+ *   frames_presented   Frames handed to the video backend
+ *   input_polls        Calls to the input backend's poll()
+ *   step               Histogram of CPU::run() calls
+ *   frame              Histogram of the intervals between presented frames
+ *   present            Histogram of Video::present() calls
+ *   poll               Histogram of Input::poll() calls
+ *
+ * Prometheus names them chip8_<name>_total for counts and
+ * chip8_<name>_seconds for histograms, with the usual _bucket{le=...},
+ * _sum and _count series. JSON gives histograms as
+ * {"count", "mean_ms", "p50_ms", "p99_ms", "max_ms", "buckets"} with the
+ * bucket counts (not cumulative) in the order of kBucketBounds.
+ */
+
+namespace Chip8 {
+
+    typedef std::chrono::steady_clock Clock;
+
+    // How often the exporter checks for connections and for stopping
+    const int kExporterPollMs = 50;
+
+    namespace {
+
+        // Single writer, so no read-modify-write instruction is needed
+        inline void bump(std::atomic<uint64_t>& value, uint64_t n) {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        struct Series {
+            const char* name;
+            const char* help;
+        };
+
+        const Series kCounters[4] = {
+            { "instructions", "Guest instructions executed" },
+            { "frames_emulated", "Emulated 60hz frames completed" },
+            { "frames_presented", "Frames handed to the video backend" },
+            { "input_polls", "Calls to the input backend's poll" },
+        };
+
+        const Series kHistograms[4] = {
+            { "step", "Time in one CPU run" },
+            { "frame", "Interval between presented frames" },
+            { "present", "Time in Video::present" },
+            { "poll", "Time in Input::poll" },
+        };
+
+        void counters(const MetricsSnapshot& s, uint64_t values[4]) {
+            values[0] = s.instructions;
+            values[1] = s.frames_emulated;
+            values[2] = s.frames_presented;
+            values[3] = s.polls;
+        }
+
+        void histograms(const MetricsSnapshot& s, const HistogramSnapshot* values[4]) {
+            values[0] = &s.step;
+            values[1] = &s.frame;
+            values[2] = &s.present;
+            values[3] = &s.poll;
+        }
+
+        double rate(uint64_t now, uint64_t before, double seconds) {
+            return seconds > 0 ? (now - before) / seconds : 0;
+        }
+
+        void write_json(std::ostream& out, const MetricsSnapshot& now, const MetricsSnapshot& before) {
+            uint64_t values[4];
+            const HistogramSnapshot* timings[4];
+            counters(now, values);
+            histograms(now, timings);
+
+            out << std::fixed << std::setprecision(3) << "{\"uptime_seconds\":" << now.uptime;
+            for (int i = 0; i < 4; i++)
+                out << ",\"" << kCounters[i].name << "\":" << values[i];
+            out << ",\"instructions_per_second\":" << instructions_per_second(now, before)
+                << ",\"frames_per_second\":" << frames_per_second(now, before);
+
+            for (int i = 0; i < 4; i++) {
+                const HistogramSnapshot& h = *timings[i];
+                out << ",\"" << kHistograms[i].name << "\":{\"count\":" << h.count
+                    << ",\"mean_ms\":" << h.mean() << ",\"p50_ms\":" << h.quantile(0.5)
+                    << ",\"p99_ms\":" << h.quantile(0.99) << ",\"max_ms\":" << h.max()
+                    << ",\"buckets\":[";
+                for (int b = 0; b < kHistogramBuckets; b++)
+                    out << (b ? "," : "") << h.buckets[b];
+                out << "]}";
+            }
+
+            out << ",\"bucket_bounds_us\":[";
+            for (int b = 0; b < kHistogramBuckets - 1; b++)
+                out << (b ? "," : "") << kBucketBounds[b];
+            out << "]}\n";
+        }
+
+        void write_prometheus(std::ostream& out, const MetricsSnapshot& now) {
+            uint64_t values[4];
+            const HistogramSnapshot* timings[4];
+            counters(now, values);
+            histograms(now, timings);
+
+            out << std::fixed << std::setprecision(6);
+            for (int i = 0; i < 4; i++) {
+                std::string name = std::string("chip8_") + kCounters[i].name + "_total";
+                out << "# HELP " << name << " " << kCounters[i].help << "\n"
+                    << "# TYPE " << name << " counter\n"
+                    << name << " " << values[i] << "\n";
+            }
+
+            for (int i = 0; i < 4; i++) {
+                const HistogramSnapshot& h = *timings[i];
+                std::string name = std::string("chip8_") + kHistograms[i].name + "_seconds";
+                out << "# HELP " << name << " " << kHistograms[i].help << "\n"
+                    << "# TYPE " << name << " histogram\n";
+
+                uint64_t cumulative = 0;
+                for (int b = 0; b < kHistogramBuckets; b++) {
+                    cumulative += h.buckets[b];
+                    out << name << "_bucket{le=\"";
+                    if (b < kHistogramBuckets - 1)
+                        out << kBucketBounds[b] / 1e6;
+                    else
+                        out << "+Inf";
+                    out << "\"} " << cumulative << "\n";
+                }
+                out << name << "_sum " << h.sum_ns / 1e9 << "\n"
+                    << name << "_count " << h.count << "\n";
+            }
+        }
+
+    } // namespace
+
+    Counter::Counter() : _value(0) {
+    }
+
+    void Counter::add(uint64_t n) {
+        bump(_value, n);
+    }
+
+    uint64_t Counter::value() const {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+    double HistogramSnapshot::mean() const {
+        return count ? sum_ns / 1e6 / count : 0;
+    }
+
+    double HistogramSnapshot::quantile(double q) const {
+        if (count == 0)
+            return 0;
+
+        uint64_t rank = std::max(uint64_t(q * count + 0.5), uint64_t(1));
+        uint64_t seen = 0;
+        for (int b = 0; b < kHistogramBuckets - 1; b++) {
+            seen += buckets[b];
+            if (seen >= rank)
+                return std::min(kBucketBounds[b] / 1e3, max());
+        }
+        return max();
+    }
+
+    double HistogramSnapshot::max() const {
+        return max_ns / 1e6;
+    }
+
+    Histogram::Histogram() : _sum(0), _max(0), _marked(false) {
+        for (std::atomic<uint64_t>& bucket : _buckets)
+            bucket.store(0);
+    }
+
+    void Histogram::add(Clock::duration sample) {
+        uint64_t ns = uint64_t(std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(sample).count(), 0));
+
+        int bucket = 0;
+        while (bucket < kHistogramBuckets - 1 && ns > kBucketBounds[bucket] * uint64_t(1000))
+            bucket++;
+
+        bump(_buckets[bucket], 1);
+        bump(_sum, ns);
+        if (ns > _max.load(std::memory_order_relaxed))
+            _max.store(ns, std::memory_order_relaxed);
+    }
+
+    void Histogram::mark(Clock::time_point now) {
+        if (_marked)
+            add(now - _last);
+        _last = now;
+        _marked = true;
+    }
+
+    HistogramSnapshot Histogram::snapshot() const {
+        // The count is the buckets' total, so the two always agree even
+        // while another thread is adding
+        HistogramSnapshot s;
+        s.count = 0;
+        for (int b = 0; b < kHistogramBuckets; b++) {
+            s.buckets[b] = _buckets[b].load(std::memory_order_relaxed);
+            s.count += s.buckets[b];
+        }
+        s.sum_ns = _sum.load(std::memory_order_relaxed);
+        s.max_ns = _max.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    Metrics::Metrics() : _start(Clock::now()) {
+    }
+
+    MetricsSnapshot Metrics::snapshot() const {
+        MetricsSnapshot s;
+        s.uptime = std::chrono::duration<double>(Clock::now() - _start).count();
+        s.instructions = emulation.instructions.value();
+        s.frames_emulated = emulation.frames.value();
+        s.frames_presented = host.frames.value();
+        s.polls = host.polls.value();
+        s.step = emulation.step.snapshot();
+        s.frame = host.frame.snapshot();
+        s.present = host.present.snapshot();
+        s.poll = host.poll.snapshot();
+        return s;
+    }
+
+    double instructions_per_second(const MetricsSnapshot& now, const MetricsSnapshot& before) {
+        return rate(now.instructions, before.instructions, now.uptime - before.uptime);
+    }
+
+    double frames_per_second(const MetricsSnapshot& now, const MetricsSnapshot& before) {
+        return rate(now.frames_presented, before.frames_presented, now.uptime - before.uptime);
+    }
+
+    std::vector<std::string> summarize(const MetricsSnapshot& now, const MetricsSnapshot& before) {
+        std::vector<std::string> lines;
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(0) << "IPS " << instructions_per_second(now, before);
+        lines.push_back(line.str());
+
+        line.str("");
+        line << std::setprecision(1) << "FPS " << frames_per_second(now, before);
+        lines.push_back(line.str());
+
+        const char* names[3] = { "STEP", "PRESENT", "POLL" };
+        const HistogramSnapshot* timings[3] = { &now.step, &now.present, &now.poll };
+        for (int i = 0; i < 3; i++) {
+            line.str("");
+            line << std::setprecision(2) << names[i] << " " << timings[i]->mean() << "MS P99 "
+                << timings[i]->quantile(0.99) << "MS";
+            lines.push_back(line.str());
+        }
+        return lines;
+    }
+
+    bool parse_metrics_format(const char* name, MetricsFormat& format) {
+        std::string value = name;
+        if (value == "json")
+            format = kMetricsJSON;
+        else if (value == "prometheus")
+            format = kMetricsPrometheus;
+        else
+            return false;
+        return true;
+    }
+
+    void write_metrics(std::ostream& out, MetricsFormat format, const MetricsSnapshot& now,
+                       const MetricsSnapshot& before) {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+
+        if (format == kMetricsJSON)
+            write_json(out, now, before);
+        else
+            write_prometheus(out, now);
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    MetricsExporter::MetricsExporter(const Metrics& metrics, const MetricsExportConfig& config)
+        : _metrics(metrics), _config(config), _listener(-1), _ok(true), _stopped(false) {
+        _config.interval_ms = std::max(_config.interval_ms, uint32_t(1));
+
+        if (!_config.socket.empty()) {
+            sockaddr_un address;
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (_config.socket.size() >= sizeof(address.sun_path)) {
+                std::cout << "[metrics] socket path '" << _config.socket << "' is too long" << std::endl;
+                _ok = false;
+                return;
+            }
+            std::strcpy(address.sun_path, _config.socket.c_str());
+
+            _listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            ::unlink(_config.socket.c_str());
+            if (_listener < 0 ||
+                ::bind(_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+                ::listen(_listener, 4) != 0) {
+                std::cout << "[metrics] couldn't listen on '" << _config.socket << "': "
+                    << std::strerror(errno) << std::endl;
+                if (_listener >= 0)
+                    ::close(_listener);
+                _listener = -1;
+                _ok = false;
+                return;
+            }
+        }
+
+        _thread = std::thread(&MetricsExporter::serve, this);
+    }
+
+    MetricsExporter::~MetricsExporter() {
+        stop();
+    }
+
+    bool MetricsExporter::ok() const {
+        return _ok;
+    }
+
+    void MetricsExporter::stop() {
+        _stopped.store(true);
+        if (_thread.joinable())
+            _thread.join();
+        if (_listener >= 0) {
+            ::close(_listener);
+            ::unlink(_config.socket.c_str());
+            _listener = -1;
+        }
+    }
+
+    void MetricsExporter::serve() {
+        const Clock::duration interval = std::chrono::milliseconds(_config.interval_ms);
+
+        // Rates are taken over at least one whole interval: the file's from
+        // the last tick, a connection's from the one before
+        MetricsSnapshot older = _metrics.snapshot();
+        MetricsSnapshot last = older;
+        Clock::time_point next = Clock::now() + interval;
+
+        while (!_stopped.load()) {
+            pollfd fds[1] = { { _listener, POLLIN, 0 } };
+            int timeout = int(std::min<int64_t>(kExporterPollMs,
+                std::max<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    next - Clock::now()).count(), 0)));
+            ::poll(fds, _listener >= 0 ? 1 : 0, timeout);
+
+            if (fds[0].revents & POLLIN) {
+                int client = ::accept(_listener, nullptr, nullptr);
+                if (client >= 0) {
+                    std::ostringstream dump;
+                    write_metrics(dump, _config.format, _metrics.snapshot(), older);
+                    std::string text = dump.str();
+                    ::send(client, text.data(), text.size(), MSG_NOSIGNAL);
+                    ::close(client);
+                }
+            }
+
+            if (Clock::now() >= next) {
+                MetricsSnapshot now = _metrics.snapshot();
+                write_file(now, last);
+                older = last;
+                last = now;
+                next = std::max(next + interval, Clock::now());
+            }
+        }
+
+        write_file(_metrics.snapshot(), last);
+    }
+
+    void MetricsExporter::write_file(const MetricsSnapshot& now, const MetricsSnapshot& before) {
+        if (_config.file.empty())
+            return;
+
+        std::string temporary = _config.file + ".tmp";
+        {
+            std::ofstream out(temporary);
+            write_metrics(out, _config.format, now, before);
+            if (!out) {
+                std::cout << "[metrics] couldn't write '" << temporary << "'" << std::endl;
+                return;
+            }
+        }
+
+        if (std::rename(temporary.c_str(), _config.file.c_str()) != 0)
+            std::cout << "[metrics] couldn't replace '" << _config.file << "': "
+                << std::strerror(errno) << std::endl;
+    }
+
+} // namespace Chip8
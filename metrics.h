@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Chip8 {
+
+    // Upper bounds of the histogram buckets in microseconds, plus one more
+    // bucket for everything slower. The 60hz frame period is one of them.
+    const int kHistogramBuckets = 17;
+    const uint32_t kBucketBounds[kHistogramBuckets - 1] = {
+        1, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 16667, 25000, 33333, 50000, 100000
+    };
+
+    /**
+     * A count that only one thread adds to and any thread may read. Adding
+     * is a plain load and store, no locked instruction.
+     */
+    class Counter {
+    public:
+        Counter();
+
+        void add(uint64_t n = 1);
+        uint64_t value() const;
+
+    private:
+        std::atomic<uint64_t> _value;
+    };
+
+    struct HistogramSnapshot {
+        uint64_t buckets[kHistogramBuckets];
+        uint64_t count;
+        uint64_t sum_ns;
+        uint64_t max_ns;
+
+        // In milliseconds. Quantiles are the upper bound of the bucket they
+        // fall in, or the maximum for the last one.
+        double mean() const;
+        double quantile(double q) const;
+        double max() const;
+    };
+
+    /**
+     * Durations counted into fixed buckets, with their sum and maximum.
+     * Single writer, like Counter.
+     */
+    class Histogram {
+    public:
+        Histogram();
+
+        void add(std::chrono::steady_clock::duration sample);
+
+        // Interval since the previous mark(), if any
+        void mark(std::chrono::steady_clock::time_point now);
+
+        HistogramSnapshot snapshot() const;
+
+    private:
+        std::atomic<uint64_t> _buckets[kHistogramBuckets];
+        std::atomic<uint64_t> _sum;
+        std::atomic<uint64_t> _max;
+
+        std::chrono::steady_clock::time_point _last;
+        bool _marked;
+    };
+
+    // Everything in Metrics at one moment
+    struct MetricsSnapshot {
+        double uptime;                  // Seconds since the Metrics was made
+        uint64_t instructions;
+        uint64_t frames_emulated;
+        uint64_t frames_presented;
+        uint64_t polls;
+        HistogramSnapshot step;
+        HistogramSnapshot frame;
+        HistogramSnapshot present;
+        HistogramSnapshot poll;
+    };
+
+    /**
+     * Host-side counters and timings, filled in by Chip8 while set (see
+     * Chip8::set_metrics()) and read from any thread. Each group is only
+     * written by one thread and sits on cache lines of its own, so keeping
+     * them costs a couple of clock reads per frame.
+     */
+    class Metrics {
+    public:
+        Metrics();
+
+        // Written by whichever thread runs the CPU
+        struct Emulation {
+            Counter instructions;
+            Counter frames;
+            Histogram step;             // One CPU::run(), a frame's worth interactively
+        };
+
+        // Written by the thread presenting
+        struct Host {
+            Counter frames;
+            Counter polls;
+            Histogram frame;            // Between presented frames
+            Histogram present;          // In Video::present()
+            Histogram poll;             // In Input::poll()
+        };
+
+        Emulation emulation;
+        uint8_t padding[64];
+        Host host;
+
+        MetricsSnapshot snapshot() const;
+
+    private:
+        std::chrono::steady_clock::time_point _start;
+    };
+
+    // Rates between two snapshots, per second. Zero if no time passed.
+    double instructions_per_second(const MetricsSnapshot& now, const MetricsSnapshot& before);
+    double frames_per_second(const MetricsSnapshot& now, const MetricsSnapshot& before);
+
+    // A few short lines for an on-screen overlay, uppercase only
+    std::vector<std::string> summarize(const MetricsSnapshot& now, const MetricsSnapshot& before);
+
+    enum MetricsFormat {
+        kMetricsJSON,               // One object per dump, on one line
+        kMetricsPrometheus,         // Prometheus text exposition format
+    };
+
+    // "json" or "prometheus"
+    bool parse_metrics_format(const char* name, MetricsFormat& format);
+
+    // Rates are over the time since before, e.g. the previous dump
+    void write_metrics(std::ostream& out, MetricsFormat format, const MetricsSnapshot& now,
+                       const MetricsSnapshot& before);
+
+    struct MetricsExportConfig {
+        MetricsFormat format = kMetricsPrometheus;
+
+        // Rewritten every interval if set, atomically by renaming a
+        // temporary next to it, so a reader never sees half a dump
+        std::string file;
+
+        // If set, a Unix-domain socket that writes one dump to each
+        // connection and closes it
+        std::string socket;
+
+        uint32_t interval_ms = 1000;
+    };
+
+    /**
+     * Dumps a Metrics periodically from a thread of its own.
+     */
+    class MetricsExporter {
+    public:
+        MetricsExporter(const Metrics& metrics, const MetricsExportConfig& config);
+        ~MetricsExporter();
+
+        MetricsExporter(const MetricsExporter&) = delete;
+        MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+        // False if the socket couldn't be set up
+        bool ok() const;
+
+        // Writes the file one last time and stops. Called by the destructor
+        // if need be.
+        void stop();
+
+    private:
+        void serve();
+        void write_file(const MetricsSnapshot& now, const MetricsSnapshot& before);
+
+        const Metrics& _metrics;
+        MetricsExportConfig _config;
+        int _listener;
+        bool _ok;
+        std::atomic<bool> _stopped;
+        std::thread _thread;
+    };
+
+} // namespace Chip8
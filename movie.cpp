@@ -0,0 +1,172 @@
+#include <chrono>
+#include <cstring>
+
+#include "movie.h"
+#include "chip8.h"
+
+/**
+ * File format, host byte order:
+ *
+ *   char     magic[4]      "C8MV"
+ *   uint16_t version       2
+ *   uint16_t quirks        QuirkProfile
+ *   uint64_t seed
+ *   uint64_t rom_hash
+ *   uint32_t speed
+ *   uint32_t event_count
+ *   uint32_t hash_count
+ *   { uint32_t frame; uint16_t keys; }  events[event_count]
+ *   { uint32_t frame; uint64_t hash; }  hashes[hash_count]
+ *
+ * Frames are 32 bits, a bit over two years at 60hz.
+ */
+
+namespace Chip8 {
+
+    const char kMovieMagic[4] = { 'C', '8', 'M', 'V' };
+    const uint16_t kMovieVersion = 2;
+
+    // Frames between recorded screen hashes
+    const uint64_t kHashInterval = 60;
+
+    namespace {
+
+        template <typename T>
+        void put(std::ostream& out, T value) {
+            out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        template <typename T>
+        T get(std::istream& in) {
+            T value = T();
+            in.read(reinterpret_cast<char*>(&value), sizeof(value));
+            return value;
+        }
+
+    } // namespace
+
+    Movie::Movie() : seed(0), speed(0), rom_hash(0), quirks(kDefaultQuirks), _pressed(false), _keys(0) {
+        _last.frame = 0;
+        _last.hash = 0;
+    }
+
+    void Movie::record_keys(uint64_t frame, uint16_t keys) {
+        if (_pressed && keys == _keys)
+            return;
+
+        events.push_back({ frame, keys });
+        _pressed = true;
+        _keys = keys;
+    }
+
+    void Movie::record_hash(uint64_t frame, uint64_t hash) {
+        _last.frame = frame;
+        _last.hash = hash;
+
+        if (frame % kHashInterval == 0)
+            hashes.push_back(_last);
+    }
+
+    void Movie::finish() {
+        if (_last.frame != 0 && (hashes.empty() || hashes.back().frame != _last.frame))
+            hashes.push_back(_last);
+    }
+
+    bool Movie::write(std::ostream& out) const {
+        out.write(kMovieMagic, sizeof(kMovieMagic));
+        put<uint16_t>(out, kMovieVersion);
+        put<uint16_t>(out, quirks);
+        put<uint64_t>(out, seed);
+        put<uint64_t>(out, rom_hash);
+        put<uint32_t>(out, speed);
+        put<uint32_t>(out, events.size());
+        put<uint32_t>(out, hashes.size());
+
+        for (const KeyEvent& event : events) {
+            put<uint32_t>(out, event.frame);
+            put<uint16_t>(out, event.keys);
+        }
+        for (const FrameHash& hash : hashes) {
+            put<uint32_t>(out, hash.frame);
+            put<uint64_t>(out, hash.hash);
+        }
+
+        return bool(out);
+    }
+
+    bool Movie::read(std::istream& in, Movie& movie) {
+        char magic[4];
+        in.read(magic, sizeof(magic));
+        uint16_t version = get<uint16_t>(in);
+        uint16_t quirks = get<uint16_t>(in);
+
+        if (!in || std::memcmp(magic, kMovieMagic, sizeof(magic)) != 0 || version != kMovieVersion ||
+            quirks >= kQuirkProfiles)
+            return false;
+
+        movie.quirks = QuirkProfile(quirks);
+        movie.seed = get<uint64_t>(in);
+        movie.rom_hash = get<uint64_t>(in);
+        movie.speed = get<uint32_t>(in);
+        uint32_t event_count = get<uint32_t>(in);
+        uint32_t hash_count = get<uint32_t>(in);
+        if (!in)
+            return false;
+
+        movie.events.clear();
+        for (uint32_t i = 0; i < event_count && in; i++) {
+            KeyEvent event;
+            event.frame = get<uint32_t>(in);
+            event.keys = get<uint16_t>(in);
+            movie.events.push_back(event);
+        }
+
+        movie.hashes.clear();
+        for (uint32_t i = 0; i < hash_count && in; i++) {
+            FrameHash hash;
+            hash.frame = get<uint32_t>(in);
+            hash.hash = get<uint64_t>(in);
+            movie.hashes.push_back(hash);
+        }
+
+        return bool(in);
+    }
+
+    ReplayResult replay(const Movie& movie, const uint8_t* rom, size_t size, bool jit) {
+        ScriptedInput input(movie.events);
+        HeadlessVideo video;
+        HeadlessAudio audio;
+        Chip8 chip8(&input, &video, &audio);
+        ReplayResult result = ReplayResult();
+
+        chip8.set_quirks(movie.quirks);
+        chip8.load_program(rom, size);
+        chip8.seed(movie.seed);
+        if (movie.speed != 0)
+            chip8.set_speed(movie.speed);
+        if (jit)
+            chip8.set_jit(true);
+
+        auto start = std::chrono::steady_clock::now();
+        result.matched = true;
+
+        for (const FrameHash& expected : movie.hashes) {
+            if (expected.frame > chip8.frame())
+                result.instructions += chip8.run_frames(expected.frame - chip8.frame());
+
+            uint64_t actual = chip8.graphics().hash();
+            if (actual != expected.hash) {
+                result.matched = false;
+                result.expected_hash = expected.hash;
+                result.actual_hash = actual;
+                break;
+            }
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        result.seconds = elapsed.count();
+        result.frames = chip8.frame();
+        return result;
+    }
+
+} // namespace Chip8
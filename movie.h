@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "headless.h"
+#include "quirks.h"
+#include "rom.h"
+
+/**
+ * Input recordings. A movie is the PRNG seed, speed and quirks a run started with,
+ * every change of the keypad keyed by emulated frame, and a screen hash
+ * once a second (plus the last frame). Replaying feeds the keypad changes
+ * back through ScriptedInput and stops at the first hash that differs.
+ */
+
+namespace Chip8 {
+
+    struct FrameHash {
+        uint64_t frame;
+        uint64_t hash;
+    };
+
+    class Movie {
+    public:
+        Movie();
+
+        uint64_t seed;
+        uint32_t speed;
+        uint64_t rom_hash;            // hash_rom() of the program
+        QuirkProfile quirks;
+
+        std::vector<KeyEvent> events;
+        std::vector<FrameHash> hashes;
+
+        // Called as each frame starts and ends, see Chip8::set_recorder().
+        // Only changes of the keypad and every kHashInterval-th hash are kept.
+        void record_keys(uint64_t frame, uint16_t keys);
+        void record_hash(uint64_t frame, uint64_t hash);
+
+        // Adds the hash of the last completed frame if it isn't there yet
+        void finish();
+
+        bool write(std::ostream& out) const;
+        static bool read(std::istream& in, Movie& movie);
+
+    private:
+        bool _pressed;
+        uint16_t _keys;
+        FrameHash _last;
+    };
+
+    struct ReplayResult {
+        bool matched;
+        uint64_t frames;              // Frames run, up to the first mismatch
+        uint64_t instructions;
+        uint64_t expected_hash;       // Only set on a mismatch
+        uint64_t actual_hash;
+        double seconds;
+    };
+
+    // Re-runs a movie headless and unthrottled
+    ReplayResult replay(const Movie& movie, const uint8_t* rom, size_t size, bool jit);
+
+} // namespace Chip8
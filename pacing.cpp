@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+#include "pacing.h"
+
+namespace Chip8 {
+
+    TimingStats::TimingStats(std::chrono::steady_clock::duration late)
+        : _late_threshold(late), _marked(false),
+          _count(0), _late(0), _sum(0), _sum_squares(0), _max(0) {
+    }
+
+    void TimingStats::add(std::chrono::steady_clock::duration sample) {
+        double ms = std::chrono::duration<double, std::milli>(sample).count();
+
+        _count++;
+        if (sample > _late_threshold)
+            _late++;
+        _sum += ms;
+        _sum_squares += ms * ms;
+        _max = std::max(_max, ms);
+    }
+
+    void TimingStats::mark(std::chrono::steady_clock::time_point now) {
+        if (_marked)
+            add(now - _last);
+        _last = now;
+        _marked = true;
+    }
+
+    uint64_t TimingStats::count() const {
+        return _count;
+    }
+
+    uint64_t TimingStats::late() const {
+        return _late;
+    }
+
+    double TimingStats::mean() const {
+        return _count ? _sum / _count : 0;
+    }
+
+    double TimingStats::stddev() const {
+        if (_count < 2)
+            return 0;
+
+        double mean = this->mean();
+        return std::sqrt(std::max(0.0, _sum_squares / _count - mean * mean));
+    }
+
+    double TimingStats::max() const {
+        return _max;
+    }
+
+    void TimingStats::write(std::ostream& out) const {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+
+        out << _count << " samples, " << std::fixed << std::setprecision(2)
+            << "mean " << mean() << "ms, stddev " << stddev() << "ms, max " << max() << "ms";
+        if (_late_threshold != std::chrono::steady_clock::duration::max())
+            out << ", " << _late << " late";
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+} // namespace Chip8
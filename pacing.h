@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace Chip8 {
+
+    /**
+     * Count, mean, standard deviation and maximum of a series of durations,
+     * kept as running sums so adding one is a few arithmetic operations.
+     * Samples over the late threshold are counted separately, e.g. frames
+     * that took more than one and a half frame periods.
+     */
+    class TimingStats {
+    public:
+        explicit TimingStats(std::chrono::steady_clock::duration late =
+                             std::chrono::steady_clock::duration::max());
+
+        void add(std::chrono::steady_clock::duration sample);
+
+        // Interval since the previous mark(), if any
+        void mark(std::chrono::steady_clock::time_point now);
+
+        uint64_t count() const;
+        uint64_t late() const;
+
+        // In milliseconds
+        double mean() const;
+        double stddev() const;
+        double max() const;
+
+        // One line, e.g. "60 samples, mean 16.67ms, stddev 0.05ms, max 16.90ms"
+        void write(std::ostream& out) const;
+
+    private:
+        std::chrono::steady_clock::duration _late_threshold;
+        std::chrono::steady_clock::time_point _last;
+        bool _marked;
+
+        uint64_t _count;
+        uint64_t _late;
+        double _sum;
+        double _sum_squares;
+        double _max;
+    };
+
+} // namespace Chip8
@@ -0,0 +1,94 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "rom.h"
+
+/**
+ * chip8-pack: builds and lists ROM archives (see archive.h).
+ *
+ *     chip8-pack <archive> <rom>...    packs the ROMs, named by file name
+ *     chip8-pack --list <archive>      lists the ROMs and checks their hashes
+ */
+
+namespace {
+
+    void usage(const char* name) {
+        std::cout << "usage: " << name << " <archive> <rom>...\n"
+            << "       " << name << " --list <archive>\n" << std::endl;
+        std::exit(2);
+    }
+
+    std::string base_name(const std::string& path) {
+        size_t slash = path.find_last_of('/');
+        return slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+
+    int list(const char* filename) {
+        Chip8::RomArchive archive;
+        if (!archive.open(filename)) {
+            std::cerr << "couldn't open archive " << filename << std::endl;
+            return 1;
+        }
+
+        int bad = 0;
+        for (size_t i = 0; i < archive.size(); i++) {
+            const Chip8::ArchiveEntry& entry = archive.entry(i);
+            bool ok = archive.verify(i);
+            if (!ok)
+                bad++;
+
+            std::cout << std::setw(4) << i << "  " << std::left << std::setw(32) << archive.name(i)
+                << std::right << std::setw(6) << entry.size << "  " << std::hex << std::setw(16)
+                << std::setfill('0') << entry.hash << std::dec << std::setfill(' ')
+                << (ok ? "" : "  BAD HASH") << std::endl;
+        }
+
+        return bad ? 1 : 0;
+    }
+
+    int pack(const char* filename, int count, char* paths[]) {
+        std::vector<std::string> names;
+        std::vector<std::vector<uint8_t>> roms;
+
+        for (int i = 0; i < count; i++) {
+            Chip8::MappedFile rom;
+            if (!rom.open(paths[i])) {
+                std::cerr << "couldn't open " << paths[i] << std::endl;
+                return 1;
+            }
+            if (rom.size() > Chip8::kMaxProgramSize) {
+                std::cerr << paths[i] << " is too large for a program" << std::endl;
+                return 1;
+            }
+
+            names.push_back(base_name(paths[i]));
+            roms.emplace_back(rom.data(), rom.data() + rom.size());
+        }
+
+        std::ofstream out(filename, std::ofstream::binary);
+        if (!Chip8::RomArchive::write(out, names, roms)) {
+            std::cerr << "couldn't write " << filename << std::endl;
+            return 1;
+        }
+
+        std::cout << "[pack] Wrote " << roms.size() << " programs to " << filename << std::endl;
+        return 0;
+    }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && std::strcmp(argv[1], "--list") == 0)
+        return list(argv[2]);
+
+    if (argc < 3 || argv[1][0] == '-')
+        usage(argv[0]);
+
+    return pack(argv[1], argc - 2, argv + 2);
+}
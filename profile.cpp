@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <iomanip>
+#include <string>
+
+#include "profile.h"
+
+namespace Chip8 {
+
+    // Deeper call chains (runaway recursion wrapping the 16 entry stack)
+    // are folded into the deepest frame
+    const int kMaxDepth = 64;
+
+    Profiler::Profiler() {
+        clear();
+    }
+
+    void Profiler::clear() {
+        _pc_counts.assign(kMemorySize, 0);
+        _pc_ops.assign(kMemorySize, 0);
+        _class_counts.assign(0x10000, 0);
+
+        _nodes.assign(1, Node{ -1, 0x200 });
+        _children.clear();
+        _stack_counts.assign(1, 0);
+        _node = 0;
+        _depth = 0;
+
+        _calls.clear();
+        _instructions = 0;
+        _draws = 0;
+        _draw_time = std::chrono::steady_clock::duration::zero();
+        _start = std::chrono::steady_clock::now();
+    }
+
+    uint16_t Profiler::opcode_class(uint16_t op) {
+        switch (op & 0xF000) {
+            case 0x0000:
+                return (op == 0x00E0 || op == 0x00EE) ? op : 0x0000;
+            case 0x8000:
+                return op & 0xF00F;
+            case 0xE000:
+            case 0xF000:
+                return op & 0xF0FF;
+            default:
+                return op & 0xF000;
+        }
+    }
+
+    void Profiler::call(uint16_t pc, uint16_t target) {
+        _calls[std::make_pair(pc, target)]++;
+
+        if (_depth >= kMaxDepth)
+            return;
+
+        auto key = std::make_pair(_node, target);
+        auto child = _children.find(key);
+        if (child == _children.end()) {
+            child = _children.emplace(key, int(_nodes.size())).first;
+            _nodes.push_back(Node{ _node, target });
+            _stack_counts.push_back(0);
+        }
+
+        _node = child->second;
+        _depth++;
+    }
+
+    void Profiler::ret() {
+        // A return with nothing on the shadow stack (e.g. the program
+        // juggles its stack) is attributed to the entry
+        if (_depth == 0)
+            return;
+
+        _node = _nodes[_node].parent;
+        _depth--;
+    }
+
+    uint64_t Profiler::instructions() const {
+        return _instructions;
+    }
+
+    namespace {
+
+        std::string class_name(uint16_t op) {
+            static const char* kDigits = "0123456789ABCDEF";
+            std::string name(4, '?');
+
+            name[0] = kDigits[op >> 12];
+            switch (op & 0xF000) {
+                case 0x0000:
+                    return op ? (op == 0x00E0 ? "00E0" : "00EE") : "0NNN";
+                case 0x5000: case 0x9000:
+                    return name.substr(0, 1) + "XY0";
+                case 0x8000:
+                    return name.substr(0, 1) + "XY" + kDigits[op & 0xF];
+                case 0xD000:
+                    return "DXYN";
+                case 0xE000: case 0xF000:
+                    return name.substr(0, 1) + "X" + kDigits[(op >> 4) & 0xF] + kDigits[op & 0xF];
+                case 0x1000: case 0x2000: case 0xA000: case 0xB000:
+                    return name.substr(0, 1) + "NNN";
+                default:
+                    return name.substr(0, 1) + "XKK";
+            }
+        }
+
+        void write_hex(std::ostream& out, unsigned value, int width) {
+            out << std::hex << std::uppercase << std::setw(width) << std::setfill('0') << value
+                << std::dec << std::nouppercase << std::setfill(' ');
+        }
+
+        template <typename Key>
+        std::vector<std::pair<Key, uint64_t>> by_count(const std::vector<std::pair<Key, uint64_t>>& counts) {
+            std::vector<std::pair<Key, uint64_t>> sorted = counts;
+            std::stable_sort(sorted.begin(), sorted.end(),
+                [](const std::pair<Key, uint64_t>& a, const std::pair<Key, uint64_t>& b) {
+                    return a.second > b.second;
+                });
+            return sorted;
+        }
+
+    } // namespace
+
+    void Profiler::write_report(std::ostream& out, size_t top) const {
+        double total = _instructions ? double(_instructions) : 1.0;
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - _start;
+        std::chrono::duration<double> draw = _draw_time;
+
+        out << "instructions " << _instructions << ", wall " << wall.count() << "s\n";
+        out << "DXYN " << _draws << " draws, " << draw.count() << "s";
+        if (_draws > 0)
+            out << " (" << draw.count() * 1e9 / _draws << " ns/draw, "
+                << 100.0 * draw.count() / wall.count() << "% of wall time)";
+        out << "\n";
+
+        std::vector<std::pair<uint16_t, uint64_t>> pcs;
+        for (int pc = 0; pc < kMemorySize; pc++) {
+            if (_pc_counts[pc] != 0)
+                pcs.push_back(std::make_pair(uint16_t(pc), _pc_counts[pc]));
+        }
+
+        out << "\nhot addresses\n";
+        pcs = by_count(pcs);
+        for (size_t i = 0; i < pcs.size() && i < top; i++) {
+            out << "  ";
+            write_hex(out, pcs[i].first, 3);
+            out << "  ";
+            write_hex(out, _pc_ops[pcs[i].first], 4);
+            out << std::setw(14) << pcs[i].second << std::fixed << std::setprecision(2)
+                << std::setw(8) << 100.0 * pcs[i].second / total << "%\n" << std::defaultfloat;
+        }
+
+        std::vector<std::pair<uint16_t, uint64_t>> classes;
+        for (size_t op = 0; op < _class_counts.size(); op++) {
+            if (_class_counts[op] != 0)
+                classes.push_back(std::make_pair(uint16_t(op), _class_counts[op]));
+        }
+
+        out << "\nopcodes\n";
+        for (const auto& entry : by_count(classes)) {
+            out << "  " << class_name(entry.first) << std::setw(14) << entry.second << std::fixed
+                << std::setprecision(2) << std::setw(8) << 100.0 * entry.second / total << "%\n"
+                << std::defaultfloat;
+        }
+
+        std::vector<std::pair<std::pair<uint16_t, uint16_t>, uint64_t>> calls(_calls.begin(), _calls.end());
+
+        out << "\ncalls\n";
+        for (const auto& entry : by_count(calls)) {
+            out << "  ";
+            write_hex(out, entry.first.first, 3);
+            out << " -> ";
+            write_hex(out, entry.first.second, 3);
+            out << std::setw(14) << entry.second << "\n";
+        }
+    }
+
+    void Profiler::write_folded(std::ostream& out) const {
+        for (size_t node = 0; node < _nodes.size(); node++) {
+            if (_stack_counts[node] == 0)
+                continue;
+
+            std::vector<uint16_t> functions;
+            for (int n = int(node); n > 0; n = _nodes[n].parent)
+                functions.push_back(_nodes[n].function);
+
+            out << "main";
+            for (auto function = functions.rbegin(); function != functions.rend(); ++function) {
+                out << ";sub_";
+                write_hex(out, *function, 3);
+            }
+            out << " " << _stack_counts[node] << "\n";
+        }
+    }
+
+} // namespace Chip8
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "memory.h"
+
+/**
+ * Guest profiler: where a program spends its instructions. While attached
+ * (CPU::set_profiler) the CPU interprets and reports every instruction, so
+ * the numbers are the same whichever CPU is selected. When nothing is
+ * attached the check happens once per CPU::run call, never per instruction.
+ */
+
+namespace Chip8 {
+
+    class Profiler {
+    public:
+        Profiler();
+
+        // Called by the CPU for every instruction before it runs
+        void instruction(uint16_t pc, uint16_t op) {
+            _pc_counts[pc & (kMemorySize - 1)]++;
+            _pc_ops[pc & (kMemorySize - 1)] = op;
+            _class_counts[opcode_class(op)]++;
+            _stack_counts[_node]++;
+            _instructions++;
+        }
+
+        // 2NNN at pc, and 00EE
+        void call(uint16_t pc, uint16_t target);
+        void ret();
+
+        // Host time spent inside one DXYN
+        void draw(std::chrono::steady_clock::duration elapsed) {
+            _draw_time += elapsed;
+            _draws++;
+        }
+
+        uint64_t instructions() const;
+
+        // Hot addresses and opcode classes, call edges and drawing time,
+        // each sorted by count
+        void write_report(std::ostream& out, size_t top = 32) const;
+
+        // One line per call stack, "main;sub_2a0;sub_310 <instructions>",
+        // as taken by flamegraph.pl and similar tools
+        void write_folded(std::ostream& out) const;
+
+        void clear();
+
+        // The opcode with its operand fields masked out, e.g. 0x8004 for
+        // 8XY4 or 0xF033 for FX33
+        static uint16_t opcode_class(uint16_t op);
+
+    private:
+        struct Node {
+            int parent;
+            uint16_t function;
+        };
+
+        std::vector<uint64_t> _pc_counts;
+        std::vector<uint16_t> _pc_ops;      // Last opcode seen at each address
+        std::vector<uint64_t> _class_counts;
+
+        // Call tree, node 0 is the program's entry. Children are interned by
+        // (parent, function) so a stack is just a node index.
+        std::vector<Node> _nodes;
+        std::map<std::pair<int, uint16_t>, int> _children;
+        std::vector<uint64_t> _stack_counts;
+        int _node;
+        int _depth;
+
+        std::map<std::pair<uint16_t, uint16_t>, uint64_t> _calls;
+
+        uint64_t _instructions;
+        uint64_t _draws;
+        std::chrono::steady_clock::duration _draw_time;
+        std::chrono::steady_clock::time_point _start;
+    };
+
+} // namespace Chip8
@@ -0,0 +1,70 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "quirks.h"
+
+namespace Chip8 {
+
+    const char* kQuirkNames[kQuirkProfiles] = { "vip", "chip48", "schip", "modern" };
+
+    const char* quirks_name(QuirkProfile profile) {
+        return profile < kQuirkProfiles ? kQuirkNames[profile] : "unknown";
+    }
+
+    bool parse_quirks(const std::string& name, QuirkProfile& profile) {
+        for (int i = 0; i < kQuirkProfiles; i++) {
+            if (name == kQuirkNames[i]) {
+                profile = QuirkProfile(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool QuirkTable::load(const char* filename) {
+        std::ifstream in(filename);
+        if (!in)
+            return false;
+
+        std::string line;
+        int number = 0;
+
+        while (std::getline(in, line)) {
+            number++;
+
+            std::istringstream fields(line);
+            std::string hash, name;
+            if (!(fields >> hash) || hash[0] == '#')
+                continue;
+
+            char* end = nullptr;
+            uint64_t value = std::strtoull(hash.c_str(), &end, 16);
+            QuirkProfile profile;
+
+            if (*end != '\0' || !(fields >> name) || !parse_quirks(name, profile)) {
+                std::cerr << "[quirks] " << filename << ":" << number << ": expected '<hash> <profile>'"
+                    << std::endl;
+                return false;
+            }
+            _roms[value] = profile;
+        }
+
+        return true;
+    }
+
+    bool QuirkTable::find(uint64_t rom_hash, QuirkProfile& profile) const {
+        auto rom = _roms.find(rom_hash);
+        if (rom == _roms.end())
+            return false;
+
+        profile = rom->second;
+        return true;
+    }
+
+    size_t QuirkTable::size() const {
+        return _roms.size();
+    }
+
+} // namespace Chip8
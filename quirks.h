@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+/**
+ * Behaviours that differ between CHIP-8 interpreters. A profile is picked
+ * once per program, and the CPU instantiates its handlers for each profile
+ * so none of these are tested while running.
+ */
+
+namespace Chip8 {
+
+    enum QuirkProfile : uint8_t {
+        kQuirksVip,                 // COSMAC VIP, the original interpreter
+        kQuirksChip48,              // CHIP-48 on the HP-48
+        kQuirksSuperChip,           // SUPER-CHIP 1.1
+        kQuirksModern               // Octo and XO-CHIP
+    };
+
+    const int kQuirkProfiles = 4;
+
+    // What FX55 / FX65 leave in I
+    enum IndexQuirk : uint8_t {
+        kIndexUnchanged,
+        kIndexPlusX,                // I += X
+        kIndexPlusX1                // I += X + 1
+    };
+
+    struct Quirks {
+        bool shift_vx;              // 8XY6 / 8XYE shift VX in place rather than VY
+        bool reset_vf;              // 8XY1-8XY3 clear VF
+        IndexQuirk index;
+        bool jump_vx;               // BNNN is BXNN, jumping to XNN + VX
+        bool wrap;                  // DXYN wraps sprites around the edges rather than clipping
+        bool long_skip;             // Skips step over all four bytes of XO-CHIP's F000 NNNN
+        bool big_sprite;            // DXY0 draws a 16x16 sprite rather than nothing
+        uint16_t address_mask;      // I and PC wrap past it: 4 KiB, or XO-CHIP's 64 KiB
+    };
+
+    constexpr Quirks kProfileQuirks[kQuirkProfiles] = {
+        { false, true,  kIndexPlusX1,    false, false, false, false, 0x0FFF },   // VIP
+        { true,  false, kIndexPlusX,     true,  false, false, false, 0x0FFF },   // CHIP-48
+        { true,  false, kIndexUnchanged, true,  false, false, true,  0x0FFF },   // SUPER-CHIP
+        { false, false, kIndexPlusX1,    false, true,  true,  true,  0xFFFF },   // Modern
+    };
+
+    const QuirkProfile kDefaultQuirks = kQuirksModern;
+
+    // "vip", "chip48", "schip" or "modern"
+    const char* quirks_name(QuirkProfile profile);
+    bool parse_quirks(const std::string& name, QuirkProfile& profile);
+
+    /**
+     * Known ROMs by hash_rom(), read from a text file with one ROM per line:
+     *
+     *   <hash in hex> <profile> [comment]
+     *
+     * Blank lines and lines starting with '#' are skipped.
+     */
+    class QuirkTable {
+    public:
+        bool load(const char* filename);
+
+        // Returns false if the ROM isn't listed
+        bool find(uint64_t rom_hash, QuirkProfile& profile) const;
+        size_t size() const;
+
+    private:
+        std::map<uint64_t, QuirkProfile> _roms;
+    };
+
+} // namespace Chip8
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <cstring>
+
+#include "rewind.h"
+
+namespace Chip8 {
+
+    Rewind::Rewind(size_t frames, size_t keyframe_interval)
+        : _interval(std::max(keyframe_interval, size_t(1))), _next(0), _oldest(0), _base_frame(0) {
+        size_t keyframes = std::max((frames + _interval - 1) / _interval, size_t(1));
+        _slots.resize(keyframes * _interval);
+    }
+
+    std::vector<uint8_t>& Rewind::slot(uint64_t frame) {
+        return _slots[frame % _slots.size()];
+    }
+
+    uint64_t Rewind::keyframe(uint64_t frame) const {
+        return frame - frame % _interval;
+    }
+
+    bool Rewind::load_base(uint64_t keyframe) {
+        if (!_base.empty() && _base_frame == keyframe)
+            return true;
+
+        const std::vector<uint8_t>& encoded = slot(keyframe);
+        _base.resize(sizeof(MachineState));
+        _base_frame = keyframe;
+        if (decode_delta(nullptr, encoded.data(), encoded.size(), _base.data(), _base.size()))
+            return true;
+
+        _base.clear();
+        return false;
+    }
+
+    void Rewind::push(const MachineState& state) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&state);
+        uint64_t frame = _next++;
+
+        // Overwriting a keyframe strands the deltas that depend on it.
+        // The capacity is a multiple of the interval, so keyframes only
+        // ever overwrite keyframes.
+        if (frame == keyframe(frame)) {
+            if (frame >= _slots.size())
+                _oldest = std::max(_oldest, frame - _slots.size() + _interval);
+
+            encode_delta(nullptr, bytes, sizeof(MachineState), slot(frame));
+            _base.assign(bytes, bytes + sizeof(MachineState));
+            _base_frame = frame;
+            return;
+        }
+
+        if (load_base(keyframe(frame)))
+            encode_delta(_base.data(), bytes, sizeof(MachineState), slot(frame));
+    }
+
+    bool Rewind::pop(MachineState& state) {
+        if (size() == 0)
+            return false;
+
+        uint64_t frame = --_next;
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(&state);
+        if (!load_base(keyframe(frame)))
+            return false;
+
+        if (frame == keyframe(frame)) {
+            std::memcpy(bytes, _base.data(), sizeof(MachineState));
+            return true;
+        }
+
+        const std::vector<uint8_t>& delta = slot(frame);
+        return decode_delta(_base.data(), delta.data(), delta.size(), bytes, sizeof(MachineState));
+    }
+
+    size_t Rewind::size() const {
+        return size_t(_next - _oldest);
+    }
+
+    size_t Rewind::bytes() const {
+        size_t total = 0;
+        for (const auto& slot : _slots)
+            total += slot.capacity();
+        return total + _base.capacity();
+    }
+
+    void Rewind::clear() {
+        _next = 0;
+        _oldest = 0;
+        _base.clear();
+    }
+
+} // namespace Chip8
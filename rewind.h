@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "savestate.h"
+
+namespace Chip8 {
+
+    /**
+     * Ring buffer of per-frame snapshots for stepping back in time. Every
+     * keyframe_interval-th snapshot is run-length encoded on its own; the
+     * rest are deltas against the latest keyframe (see encode_delta), which
+     * for most games is a few dozen bytes a frame. Only one keyframe is
+     * kept decoded at a time. Slot storage is reused, so once the ring has
+     * wrapped pushing a snapshot doesn't allocate.
+     */
+    class Rewind {
+    public:
+        // Capacity is rounded up to a whole number of keyframe intervals
+        Rewind(size_t frames, size_t keyframe_interval = 60);
+
+        void push(const MachineState& state);
+
+        // Removes the newest snapshot into state. False when empty.
+        bool pop(MachineState& state);
+
+        // Snapshots that can still be popped
+        size_t size() const;
+
+        // Heap memory held by the snapshots
+        size_t bytes() const;
+
+        void clear();
+
+    private:
+        std::vector<uint8_t>& slot(uint64_t frame);
+        uint64_t keyframe(uint64_t frame) const;
+        bool load_base(uint64_t keyframe);
+
+        std::vector<std::vector<uint8_t>> _slots;
+        size_t _interval;
+        uint64_t _next;
+        uint64_t _oldest;
+
+        // The keyframe _base_frame decoded, if _base isn't empty
+        std::vector<uint8_t> _base;
+        uint64_t _base_frame;
+    };
+
+} // namespace Chip8
@@ -0,0 +1,70 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rom.h"
+
+namespace Chip8 {
+
+    uint64_t hash_rom(const uint8_t* data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= data[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    MappedFile::MappedFile() : _data(nullptr), _size(0) {
+    }
+
+    MappedFile::~MappedFile() {
+        close();
+    }
+
+    bool MappedFile::open(const char* filename) {
+        close();
+
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+
+        // mmap can't map nothing, an empty file is just an empty ROM
+        if (info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            _data = data;
+            _size = info.st_size;
+        }
+
+        ::close(fd);
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (_data != nullptr)
+            munmap(_data, _size);
+
+        _data = nullptr;
+        _size = 0;
+    }
+
+    const uint8_t* MappedFile::data() const {
+        return static_cast<const uint8_t*>(_data);
+    }
+
+    size_t MappedFile::size() const {
+        return _size;
+    }
+
+} // namespace Chip8
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "memory.h"
+#include "quirks.h"
+
+namespace Chip8 {
+
+    // Programs load at 0x200 and may fill the rest of memory
+    const int kProgramStart = 0x200;
+    const size_t kMaxProgramSize = kMemorySize - kProgramStart;
+
+    // Less for profiles that only address 4 KiB
+    inline size_t max_program_size(QuirkProfile profile) {
+        return size_t(kProfileQuirks[profile].address_mask) + 1 - kProgramStart;
+    }
+
+    // FNV-1a of a ROM image, e.g. to tell programs apart
+    uint64_t hash_rom(const uint8_t* data, size_t size);
+
+    /**
+     * Read-only memory mapping of a whole file, so a ROM (or an archive of
+     * them) is copied once, straight into machine memory. Unmapped when
+     * destroyed.
+     */
+    class MappedFile {
+    public:
+        MappedFile();
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool open(const char* filename);
+        void close();
+
+        const uint8_t* data() const;
+        size_t size() const;
+
+    private:
+        void* _data;
+        size_t _size;
+    };
+
+} // namespace Chip8
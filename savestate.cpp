@@ -0,0 +1,166 @@
+#include <cstring>
+
+#include "savestate.h"
+
+/**
+ * File format, host byte order:
+ *
+ *   char     magic[4]      "C8ST"
+ *   uint16_t version       4
+ *   uint16_t reserved
+ *   uint32_t state_size    sizeof(MachineState)
+ *   uint32_t encoded_size
+ *   uint8_t  encoded[encoded_size], the state delta encoded against zeros
+ *
+ * Most of memory is usually zero, so a typical save is a few KiB at most.
+ */
+
+namespace Chip8 {
+
+    const char kStateMagic[4] = { 'C', '8', 'S', 'T' };
+    // 2: keypad and FX0A wait state
+    // 3: CXNN generator state
+    // 4: 64 KiB of memory, hi-res bitplanes and the flag registers
+    const uint16_t kStateVersion = 4;
+
+    namespace {
+
+        void put_length(std::vector<uint8_t>& out, size_t length) {
+            while (length >= 0x80) {
+                out.push_back(uint8_t(length) | 0x80);
+                length >>= 7;
+            }
+            out.push_back(uint8_t(length));
+        }
+
+        bool get_length(const uint8_t*& in, const uint8_t* end, size_t& length) {
+            length = 0;
+            for (int shift = 0; in < end && shift < 64; shift += 7) {
+                uint8_t byte = *in++;
+                length |= size_t(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                    return true;
+            }
+            return false;
+        }
+
+        inline uint8_t delta_at(const uint8_t* base, const uint8_t* data, size_t i) {
+            return base ? (base[i] ^ data[i]) : data[i];
+        }
+
+        // First byte at or after i whose delta isn't zero. States are mostly
+        // unchanged memory, so this compares a word at a time.
+        size_t skip_zeros(const uint8_t* base, const uint8_t* data, size_t i, size_t size) {
+            while (i + sizeof(uint64_t) <= size) {
+                uint64_t a, b = 0;
+                std::memcpy(&a, data + i, sizeof(a));
+                if (base)
+                    std::memcpy(&b, base + i, sizeof(b));
+                if (a != b)
+                    break;
+                i += sizeof(uint64_t);
+            }
+
+            while (i < size && delta_at(base, data, i) == 0)
+                i++;
+            return i;
+        }
+
+    } // namespace
+
+    void encode_delta(const uint8_t* base, const uint8_t* data, size_t size,
+                      std::vector<uint8_t>& out) {
+        out.clear();
+        size_t i = 0;
+
+        while (i < size) {
+            size_t zeros = skip_zeros(base, data, i, size);
+
+            // A single zero between changes is cheaper as a literal than
+            // as a new triple
+            size_t literal = zeros;
+            while (literal < size && (delta_at(base, data, literal) != 0 ||
+                   (literal + 1 < size && delta_at(base, data, literal + 1) != 0)))
+                literal++;
+
+            put_length(out, zeros - i);
+            put_length(out, literal - zeros);
+            for (size_t j = zeros; j < literal; j++)
+                out.push_back(delta_at(base, data, j));
+
+            i = literal;
+        }
+    }
+
+    bool decode_delta(const uint8_t* base, const uint8_t* delta, size_t delta_size,
+                      uint8_t* data, size_t size) {
+        const uint8_t* in = delta;
+        const uint8_t* end = delta + delta_size;
+        size_t i = 0;
+
+        if (base)
+            std::memcpy(data, base, size);
+        else
+            std::memset(data, 0, size);
+
+        while (in < end) {
+            size_t zeros, literal;
+            if (!get_length(in, end, zeros) || !get_length(in, end, literal))
+                return false;
+            if (zeros > size - i || literal > size - i - zeros || literal > size_t(end - in))
+                return false;
+
+            i += zeros;
+            for (size_t j = 0; j < literal; j++)
+                data[i++] ^= *in++;
+        }
+
+        return true;
+    }
+
+    bool write_state(std::ostream& out, const MachineState& state) {
+        std::vector<uint8_t> encoded;
+        encode_delta(nullptr, reinterpret_cast<const uint8_t*>(&state), sizeof(state), encoded);
+
+        uint16_t version = kStateVersion;
+        uint16_t reserved = 0;
+        uint32_t state_size = sizeof(MachineState);
+        uint32_t encoded_size = encoded.size();
+
+        out.write(kStateMagic, sizeof(kStateMagic));
+        out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        out.write(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+        out.write(reinterpret_cast<const char*>(&state_size), sizeof(state_size));
+        out.write(reinterpret_cast<const char*>(&encoded_size), sizeof(encoded_size));
+        out.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+
+        return bool(out);
+    }
+
+    bool read_state(std::istream& in, MachineState& state) {
+        char magic[4];
+        uint16_t version;
+        uint16_t reserved;
+        uint32_t state_size;
+        uint32_t encoded_size;
+
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+        in.read(reinterpret_cast<char*>(&reserved), sizeof(reserved));
+        in.read(reinterpret_cast<char*>(&state_size), sizeof(state_size));
+        in.read(reinterpret_cast<char*>(&encoded_size), sizeof(encoded_size));
+
+        if (!in || std::memcmp(magic, kStateMagic, sizeof(magic)) != 0 ||
+            version != kStateVersion || state_size != sizeof(MachineState))
+            return false;
+
+        std::vector<uint8_t> encoded(encoded_size);
+        in.read(reinterpret_cast<char*>(encoded.data()), encoded_size);
+        if (!in)
+            return false;
+
+        return decode_delta(nullptr, encoded.data(), encoded.size(),
+                            reinterpret_cast<uint8_t*>(&state), sizeof(state));
+    }
+
+} // namespace Chip8
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "cpu.h"
+#include "graphics.h"
+#include "memory.h"
+
+/**
+ * Snapshot of a whole machine. Everything that affects what the machine
+ * does next is in here, including the position within the current 60hz
+ * frame, so restoring a state and running it is indistinguishable from
+ * never having stopped.
+ */
+
+namespace Chip8 {
+
+    struct MachineState {
+        CPUState cpu;
+        uint8_t memory[kMemorySize];
+        GraphicsState graphics;
+        uint64_t frame_left;
+        uint64_t frame_error;
+    };
+
+    // Written and diffed as raw bytes, so there must be no padding
+    static_assert(sizeof(MachineState) == sizeof(CPUState) + kMemorySize +
+                  sizeof(GraphicsState) + sizeof(uint64_t) * 2, "MachineState has padding");
+
+    /**
+     * Delta encoding shared by save files and the rewind buffer. The data is
+     * XORed against a base of the same size and the result run-length
+     * encoded as (zero run, literal length, literal bytes) triples with
+     * LEB128 lengths. Unchanged bytes cost nothing beyond their run length.
+     * A null base encodes the data itself.
+     */
+    void encode_delta(const uint8_t* base, const uint8_t* data, size_t size,
+                      std::vector<uint8_t>& out);
+    bool decode_delta(const uint8_t* base, const uint8_t* delta, size_t delta_size,
+                      uint8_t* data, size_t size);
+
+    // Versioned save file, see savestate.cpp for the layout
+    bool write_state(std::ostream& out, const MachineState& state);
+    bool read_state(std::istream& in, MachineState& state);
+
+} // namespace Chip8
@@ -0,0 +1,428 @@
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "sdl_backend.h"
+#include "graphics.h"
+
+namespace Chip8 {
+
+    const int kFramesPerSecond = 60;
+    const double kToneFrequency = 440.0;
+    const int16_t kToneAmplitude = 6000;
+
+    // Metrics overlay: a 3x5 pixel font, each row's pixels in the low
+    // three bits with the leftmost highest, drawn 2 window pixels a dot
+    const int kOverlayDot = 2;
+    const int kOverlayMargin = 4;
+    const uint8_t kOverlayAlpha = 160;
+    const double kOverlayRefresh = 0.5;
+
+    const char kOverlayCharacters[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ./%-";
+    const uint8_t kOverlayFont[][5] = {
+        { 0x7, 0x5, 0x5, 0x5, 0x7 }, { 0x2, 0x6, 0x2, 0x2, 0x7 }, { 0x7, 0x1, 0x7, 0x4, 0x7 }, { 0x7, 0x1, 0x7, 0x1, 0x7 },
+        { 0x5, 0x5, 0x7, 0x1, 0x1 }, { 0x7, 0x4, 0x7, 0x1, 0x7 }, { 0x7, 0x4, 0x7, 0x5, 0x7 }, { 0x7, 0x1, 0x1, 0x1, 0x1 },
+        { 0x7, 0x5, 0x7, 0x5, 0x7 }, { 0x7, 0x5, 0x7, 0x1, 0x7 }, { 0x2, 0x5, 0x7, 0x5, 0x5 }, { 0x6, 0x5, 0x6, 0x5, 0x6 },
+        { 0x3, 0x4, 0x4, 0x4, 0x3 }, { 0x6, 0x5, 0x5, 0x5, 0x6 }, { 0x7, 0x4, 0x6, 0x4, 0x7 }, { 0x7, 0x4, 0x6, 0x4, 0x4 },
+        { 0x3, 0x4, 0x5, 0x5, 0x3 }, { 0x5, 0x5, 0x7, 0x5, 0x5 }, { 0x7, 0x2, 0x2, 0x2, 0x7 }, { 0x1, 0x1, 0x1, 0x5, 0x2 },
+        { 0x5, 0x5, 0x6, 0x5, 0x5 }, { 0x4, 0x4, 0x4, 0x4, 0x7 }, { 0x5, 0x7, 0x7, 0x5, 0x5 }, { 0x6, 0x5, 0x5, 0x5, 0x5 },
+        { 0x2, 0x5, 0x5, 0x5, 0x2 }, { 0x6, 0x5, 0x6, 0x4, 0x4 }, { 0x2, 0x5, 0x5, 0x6, 0x3 }, { 0x6, 0x5, 0x6, 0x5, 0x5 },
+        { 0x3, 0x4, 0x2, 0x1, 0x6 }, { 0x7, 0x2, 0x2, 0x2, 0x2 }, { 0x5, 0x5, 0x5, 0x5, 0x7 }, { 0x5, 0x5, 0x5, 0x5, 0x2 },
+        { 0x5, 0x5, 0x7, 0x7, 0x5 }, { 0x5, 0x5, 0x2, 0x5, 0x5 }, { 0x5, 0x5, 0x2, 0x2, 0x2 }, { 0x7, 0x1, 0x2, 0x4, 0x7 },
+        { 0x0, 0x0, 0x0, 0x0, 0x2 }, { 0x1, 0x1, 0x2, 0x4, 0x4 }, { 0x5, 0x1, 0x2, 0x4, 0x5 }, { 0x0, 0x0, 0x7, 0x0, 0x0 },
+    };
+
+    const SDL_Keycode kKeyCodeMap[16] = {
+        SDLK_0, SDLK_1, SDLK_2, SDLK_3,
+        SDLK_4, SDLK_5, SDLK_6, SDLK_7,
+        SDLK_8, SDLK_9, SDLK_a, SDLK_b,
+        SDLK_c, SDLK_d, SDLK_e, SDLK_f,
+    };
+
+    KeyMap default_keymap() {
+        KeyMap keymap;
+        std::copy(kKeyCodeMap, kKeyCodeMap + 16, keymap.begin());
+        return keymap;
+    }
+
+    bool parse_keymap(const char* keys, KeyMap& keymap) {
+        if (std::strlen(keys) != 16)
+            return false;
+
+        // Printable ASCII keys have keycodes equal to their lowercase character
+        for (int key = 0; key < 16; key++) {
+            if (keys[key] <= ' ' || keys[key] > '~')
+                return false;
+            keymap[key] = SDL_Keycode(std::tolower(static_cast<unsigned char>(keys[key])));
+        }
+        return true;
+    }
+
+    SDLInput::SDLInput(const KeyMap& keymap)
+        : _keymap(keymap), _keys(0), _quit(false), _rewind(false), _steps(0),
+          _saves(0), _loads(0), _profiles(0) {
+    }
+
+    bool SDLInput::mapped(SDL_Keycode sym) const {
+        return std::find(_keymap.begin(), _keymap.end(), sym) != _keymap.end();
+    }
+
+    void SDLInput::poll() {
+        SDL_Event event;
+
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT)
+                _quit = true;
+
+            if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+                bool down = (event.type == SDL_KEYDOWN);
+                SDL_Keycode sym = event.key.keysym.sym;
+
+                for (int key = 0; key < 16; key++) {
+                    if (sym != _keymap[key])
+                        continue;
+
+                    if (down)
+                        _keys |= 1 << key;
+                    else
+                        _keys &= ~(1 << key);
+                }
+
+                if (down && sym == SDLK_s && !mapped(sym))
+                    _steps++;
+                if (down && sym == SDLK_q && !mapped(sym))
+                    _quit = true;
+                if (down && sym == SDLK_ESCAPE)
+                    _quit = true;
+                if (sym == SDLK_BACKSPACE)
+                    _rewind = down;
+                if (down && sym == SDLK_F5)
+                    _saves++;
+                if (down && sym == SDLK_F9)
+                    _loads++;
+                if (down && sym == SDLK_F2)
+                    _profiles++;
+            }
+        }
+    }
+
+    uint16_t SDLInput::keys() const {
+        return _keys;
+    }
+
+    bool SDLInput::quit_requested() const {
+        return _quit;
+    }
+
+    bool SDLInput::step_requested() {
+        if (_steps == 0)
+            return false;
+
+        _steps--;
+        return true;
+    }
+
+    bool SDLInput::rewind_held() const {
+        return _rewind;
+    }
+
+    bool SDLInput::save_requested() {
+        if (_saves == 0)
+            return false;
+
+        _saves--;
+        return true;
+    }
+
+    bool SDLInput::load_requested() {
+        if (_loads == 0)
+            return false;
+
+        _loads--;
+        return true;
+    }
+
+    bool SDLInput::profile_requested() {
+        if (_profiles == 0)
+            return false;
+
+        _profiles--;
+        return true;
+    }
+
+    SDLVideo::SDLVideo(const VideoConfig& config)
+        : _renderer(nullptr), _texture(nullptr), _palette(config.display.palette), _metrics(nullptr) {
+        if (SDL_InitSubSystem(SDL_INIT_VIDEO) != 0)
+            std::cout << "[graphics] init error: " << SDL_GetError() << std::endl;
+
+        int scale = std::max(config.display.scale, 1);
+        if (config.software || config.display.filter != kScaleNearest || config.display.persistence > 0) {
+            _upscaler.reset(new Upscaler(config.display));
+            scale = _upscaler->scale();
+            std::cout << "[graphics] Scaling by " << scale << " on the CPU ("
+                << kernel_name(_upscaler->kernel()) << ")" << std::endl;
+        }
+
+        _window = SDL_CreateWindow(
+            "Chip8",
+            SDL_WINDOWPOS_CENTERED,
+            SDL_WINDOWPOS_CENTERED,
+            kGraphicsWidth * scale,
+            kGraphicsHeight * scale,
+            SDL_WINDOW_SHOWN
+        );
+
+        if (_window == nullptr)
+            std::cout << "error: " << SDL_GetError() << std::endl;
+
+        Uint32 flags = config.vsync ? SDL_RENDERER_PRESENTVSYNC : 0;
+        _renderer = SDL_CreateRenderer(_window, -1, SDL_RENDERER_ACCELERATED | flags);
+
+        if (_renderer == nullptr)
+            _renderer = SDL_CreateRenderer(_window, -1, SDL_RENDERER_SOFTWARE);
+
+        if (_renderer == nullptr)
+            std::cout << "error: " << SDL_GetError() << std::endl;
+
+        // Scale up with hard pixel edges
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+
+        _texture = SDL_CreateTexture(
+            _renderer,
+            SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING,
+            _upscaler ? _upscaler->width() : kMaxGraphicsWidth,
+            _upscaler ? _upscaler->height() : kMaxGraphicsHeight
+        );
+
+        if (_texture == nullptr)
+            std::cout << "error: " << SDL_GetError() << std::endl;
+
+        _hires = false;
+        std::memset(_uploaded, 0, sizeof(_uploaded));
+        std::fill_n(_pixels, kMaxGraphicsWidth * kMaxGraphicsHeight, _palette.colors[0]);
+        if (!_upscaler)
+            SDL_UpdateTexture(_texture, nullptr, _pixels, kMaxGraphicsWidth * sizeof(uint32_t));
+    }
+
+    SDLVideo::~SDLVideo() {
+        SDL_DestroyTexture(_texture);
+        SDL_DestroyRenderer(_renderer);
+        SDL_DestroyWindow(_window);
+        SDL_QuitSubSystem(SDL_INIT_VIDEO);
+    }
+
+    void SDLVideo::present(const Graphics& graphics) {
+        if (_upscaler) {
+            present_scaled(graphics);
+            return;
+        }
+
+        int width = graphics.width();
+        int height = graphics.height();
+        int first = height;
+        int last = -1;
+
+        // A change of resolution redraws everything
+        bool all = graphics.hires() != _hires;
+        _hires = graphics.hires();
+
+        for (int y = 0; y < height; y++) {
+            bool same = !all;
+            for (int plane = 0; plane < kGraphicsPlanes && same; plane++)
+                same = std::equal(_uploaded[plane][y], _uploaded[plane][y] + kRowWords,
+                                  graphics.row(plane, y));
+            if (same)
+                continue;
+
+            uint8_t colors[kMaxGraphicsWidth];
+            graphics.compose(y, colors);
+
+            uint32_t* pixels = &_pixels[y * kMaxGraphicsWidth];
+            for (int x = 0; x < width; x++)
+                pixels[x] = _palette.colors[colors[x]];
+
+            for (int plane = 0; plane < kGraphicsPlanes; plane++)
+                std::copy(graphics.row(plane, y), graphics.row(plane, y) + kRowWords, _uploaded[plane][y]);
+            first = std::min(first, y);
+            last = y;
+        }
+
+        if (last >= 0) {
+            SDL_Rect rows = { 0, first, width, last - first + 1 };
+            if (SDL_UpdateTexture(_texture, &rows, &_pixels[first * kMaxGraphicsWidth],
+                                  kMaxGraphicsWidth * sizeof(uint32_t)) != 0)
+                std::cout << "[graphics] upload error: " << SDL_GetError() << std::endl;
+        }
+
+        // Only the top left of the texture is in use in low resolution
+        SDL_Rect screen = { 0, 0, width, height };
+        if (SDL_RenderCopy(_renderer, _texture, &screen, nullptr) != 0) {
+            std::cout << "[graphics] copy error: " << SDL_GetError() << std::endl;
+        }
+
+        if (_metrics != nullptr)
+            draw_overlay();
+        SDL_RenderPresent(_renderer);
+    }
+
+    bool SDLVideo::animating() const {
+        return (_upscaler && _upscaler->fading()) || _metrics != nullptr;
+    }
+
+    void SDLVideo::present_scaled(const Graphics& graphics) {
+        if (_upscaler->render(graphics) &&
+            SDL_UpdateTexture(_texture, nullptr, _upscaler->pixels(),
+                              _upscaler->width() * sizeof(uint32_t)) != 0)
+            std::cout << "[graphics] upload error: " << SDL_GetError() << std::endl;
+
+        if (SDL_RenderCopy(_renderer, _texture, nullptr, nullptr) != 0)
+            std::cout << "[graphics] copy error: " << SDL_GetError() << std::endl;
+
+        if (_metrics != nullptr)
+            draw_overlay();
+        SDL_RenderPresent(_renderer);
+    }
+
+    void SDLVideo::set_overlay(const Metrics* metrics) {
+        _metrics = metrics;
+        if (metrics != nullptr) {
+            _overlay_since = metrics->snapshot();
+            _overlay.clear();
+        }
+    }
+
+    void SDLVideo::draw_overlay() {
+        // The text is redone a couple of times a second, with rates over
+        // the time since it was last redone
+        MetricsSnapshot now = _metrics->snapshot();
+        if (_overlay.empty() || now.uptime - _overlay_since.uptime >= kOverlayRefresh) {
+            _overlay = summarize(now, _overlay_since);
+            _overlay_since = now;
+        }
+
+        size_t columns = 0;
+        for (const std::string& line : _overlay)
+            columns = std::max(columns, line.size());
+
+        const int advance = 4 * kOverlayDot;
+        const int line_height = 6 * kOverlayDot;
+        SDL_Rect panel = { 0, 0, int(columns) * advance + 2 * kOverlayMargin - kOverlayDot,
+                           int(_overlay.size()) * line_height + 2 * kOverlayMargin - kOverlayDot };
+
+        std::vector<SDL_Rect> dots;
+        for (size_t row = 0; row < _overlay.size(); row++) {
+            for (size_t column = 0; column < _overlay[row].size(); column++) {
+                const char* found = std::strchr(kOverlayCharacters, _overlay[row][column]);
+                if (_overlay[row][column] == '\0' || found == nullptr)
+                    continue;
+
+                const uint8_t* glyph = kOverlayFont[found - kOverlayCharacters];
+                int left = kOverlayMargin + int(column) * advance;
+                int top = kOverlayMargin + int(row) * line_height;
+                for (int y = 0; y < 5; y++) {
+                    for (int x = 0; x < 3; x++) {
+                        if ((glyph[y] >> (2 - x)) & 1)
+                            dots.push_back({ left + x * kOverlayDot, top + y * kOverlayDot,
+                                             kOverlayDot, kOverlayDot });
+                    }
+                }
+            }
+        }
+
+        SDL_SetRenderDrawBlendMode(_renderer, SDL_BLENDMODE_BLEND);
+        SDL_SetRenderDrawColor(_renderer, 0, 0, 0, kOverlayAlpha);
+        SDL_RenderFillRect(_renderer, &panel);
+        SDL_SetRenderDrawColor(_renderer, 0x40, 0xFF, 0x40, 0xFF);
+        if (!dots.empty())
+            SDL_RenderFillRects(_renderer, dots.data(), int(dots.size()));
+    }
+
+    SDLAudio::SDLAudio(const AudioConfig& config)
+        : _device(0), _sample_rate(config.sample_rate), _frame_error(0),
+          _prime(size_t(config.sample_rate) * config.latency_ms / 1000), _primed(false),
+          _ring(2 * _prime + config.buffer_samples),
+          _wave(config.sample_rate, kToneFrequency, kToneAmplitude),
+          _scratch(config.sample_rate / kFramesPerSecond + 1), _underruns(0), _dropped(0) {
+        if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+            std::cout << "[audio] init error: " << SDL_GetError() << std::endl;
+            return;
+        }
+
+        SDL_AudioSpec want = SDL_AudioSpec();
+        want.freq = config.sample_rate;
+        want.format = AUDIO_S16SYS;
+        want.channels = 1;
+        want.samples = Uint16(config.buffer_samples);
+        want.callback = &SDLAudio::callback;
+        want.userdata = this;
+
+        SDL_AudioSpec have;
+        _device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
+        if (_device == 0) {
+            std::cout << "[audio] open error: " << SDL_GetError() << std::endl;
+            return;
+        }
+
+        std::cout << "[audio] " << SDL_GetCurrentAudioDriver() << ", " << have.freq
+            << "hz, " << have.samples << " sample buffer, " << config.latency_ms
+            << "ms latency" << std::endl;
+        SDL_PauseAudioDevice(_device, 0);
+    }
+
+    SDLAudio::~SDLAudio() {
+        if (_device != 0) {
+            SDL_CloseAudioDevice(_device);
+            std::cout << "[audio] " << underruns() << " underruns, "
+                << dropped_frames() << " dropped frames" << std::endl;
+        }
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    }
+
+    void SDLAudio::frame(bool tone) {
+        if (_device == 0)
+            return;
+
+        int total = _sample_rate + _frame_error;
+        size_t count = total / kFramesPerSecond;
+        _frame_error = total % kFramesPerSecond;
+
+        if (_ring.capacity() - _ring.size() < count) {
+            _dropped++;
+            return;
+        }
+
+        _wave.render(_scratch.data(), count, tone);
+        _ring.write(_scratch.data(), count);
+    }
+
+    void SDLAudio::callback(void* userdata, Uint8* stream, int length) {
+        SDLAudio& audio = *static_cast<SDLAudio*>(userdata);
+        int16_t* samples = reinterpret_cast<int16_t*>(stream);
+        size_t count = length / sizeof(int16_t);
+        size_t filled = 0;
+
+        if (!audio._primed && audio._ring.size() >= audio._prime)
+            audio._primed = true;
+
+        if (audio._primed) {
+            filled = audio._ring.read(samples, count);
+            if (filled < count) {
+                audio._underruns++;
+                audio._primed = false;
+            }
+        }
+
+        std::fill(samples + filled, samples + count, int16_t(0));
+    }
+
+    uint64_t SDLAudio::underruns() const {
+        return _underruns.load();
+    }
+
+    uint64_t SDLAudio::dropped_frames() const {
+        return _dropped;
+    }
+
+} // namespace Chip8
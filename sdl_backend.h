@@ -0,0 +1,163 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "SDL2/SDL.h"
+
+#include "audio.h"
+#include "backend.h"
+#include "graphics.h"
+#include "metrics.h"
+#include "upscale.h"
+
+namespace Chip8 {
+
+    // Host key for each keypad key 0-F
+    typedef std::array<SDL_Keycode, 16> KeyMap;
+
+    // 0-9 and a-f map to themselves
+    KeyMap default_keymap();
+
+    // Sixteen characters naming the host keys for keypad keys 0-F in order,
+    // e.g. "x123qweasdzc4rfv" for the usual 4x4 block on a QWERTY keyboard
+    bool parse_keymap(const char* keys, KeyMap& keymap);
+
+    /**
+     * Keyboard keypad. Events are drained once per poll into a bitmask;
+     * the step (s) and quit (q) hotkeys only apply when the keymap doesn't
+     * use those keys. Escape always quits.
+     */
+    class SDLInput : public Input {
+    public:
+        explicit SDLInput(const KeyMap& keymap = default_keymap());
+
+        void poll() override;
+        uint16_t keys() const override;
+        bool quit_requested() const override;
+        bool step_requested() override;
+        bool rewind_held() const override;
+        bool save_requested() override;
+        bool load_requested() override;
+        bool profile_requested() override;
+
+    private:
+        bool mapped(SDL_Keycode sym) const;
+
+        KeyMap _keymap;
+        uint16_t _keys;
+        bool _quit;
+        bool _rewind;
+        int _steps;
+        int _saves;
+        int _loads;
+        int _profiles;
+    };
+
+    struct VideoConfig {
+        bool vsync = true;
+
+        // Scale up on the CPU with an Upscaler instead of leaving it to the
+        // renderer. Implied by a filter or phosphor persistence.
+        bool software = false;
+
+        // Window size and palette, and the Upscaler's settings
+        UpscaleConfig display;
+    };
+
+    /**
+     * Keeps the screen in a 128x64 streaming texture (only the top left 64x32
+     * in low resolution) and lets the renderer scale it to the window. Only
+     * rows that changed since the last present are expanded to pixels, and
+     * they go up in a single texture update.
+     * Falls back to SDL's software renderer when there's no accelerated one,
+     * e.g. under SDL_VIDEODRIVER=dummy.
+     *
+     * With software scaling the texture is window sized instead, filled by
+     * an Upscaler and only uploaded on frames where it renders something.
+     */
+    class SDLVideo : public Video {
+    public:
+        explicit SDLVideo(const VideoConfig& config = VideoConfig());
+        ~SDLVideo();
+
+        void present(const Graphics& graphics) override;
+
+        // While phosphor persistence is fading, or the overlay is up
+        bool animating() const override;
+
+        // Draws a few lines of metrics over the top left corner while set
+        void set_overlay(const Metrics* metrics);
+
+    private:
+        void present_scaled(const Graphics& graphics);
+        void draw_overlay();
+
+        SDL_Window* _window;
+        SDL_Renderer* _renderer;
+        SDL_Texture* _texture;
+        Palette _palette;
+        std::unique_ptr<Upscaler> _upscaler;
+
+        const Metrics* _metrics;
+        MetricsSnapshot _overlay_since;
+        std::vector<std::string> _overlay;
+
+        // What the texture currently holds, as rows and as pixels
+        bool _hires;
+        uint64_t _uploaded[kGraphicsPlanes][kMaxGraphicsHeight][kRowWords];
+        uint32_t _pixels[kMaxGraphicsWidth * kMaxGraphicsHeight];
+    };
+
+    struct AudioConfig {
+        int sample_rate = 48000;
+
+        // Samples per device callback
+        int buffer_samples = 512;
+
+        // Audio queued ahead of the device before playback (re)starts
+        int latency_ms = 40;
+    };
+
+    /**
+     * Buzzer on an SDL audio device. Each emulated frame renders exactly
+     * its share of samples (sample_rate / 60, with the remainder carried)
+     * into a lock-free ring that the device callback drains, so tone edges
+     * land on the sample where their frame starts. Works with any SDL
+     * driver, including SDL_AUDIODRIVER=dummy or disk.
+     *
+     * When the ring runs dry the callback plays silence and counts an
+     * underrun, then waits for latency_ms of audio before resuming. When it
+     * is full, e.g. running unthrottled, the frame is dropped.
+     */
+    class SDLAudio : public Audio {
+    public:
+        explicit SDLAudio(const AudioConfig& config = AudioConfig());
+        ~SDLAudio();
+
+        void frame(bool tone) override;
+
+        uint64_t underruns() const;
+        uint64_t dropped_frames() const;
+
+    private:
+        static void callback(void* userdata, Uint8* stream, int length);
+
+        SDL_AudioDeviceID _device;
+        int _sample_rate;
+        int _frame_error;
+        size_t _prime;
+        bool _primed;
+
+        SampleRing _ring;
+        SquareWave _wave;
+        std::vector<int16_t> _scratch;
+
+        std::atomic<uint64_t> _underruns;
+        uint64_t _dropped;
+    };
+
+} // namespace Chip8
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+
+#include "trace.h"
+
+/**
+ * File format, host byte order:
+ *
+ *   char     magic[4]     "C8TR"
+ *   uint16_t version      1
+ *   uint16_t record_size  sizeof(TraceRecord)
+ *   uint64_t count
+ *   TraceRecord records[count], oldest first
+ */
+
+namespace Chip8 {
+
+    const char kTraceMagic[4] = { 'C', '8', 'T', 'R' };
+    const uint16_t kTraceVersion = 1;
+
+    // Records read() allocates at a time
+    const uint64_t kTraceReadChunk = 65536;
+
+    Trace::Trace(size_t capacity) : _next(0), _level(kTraceRegisters) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+
+        _records.resize(size);
+        _mask = size - 1;
+    }
+
+    TraceLevel Trace::level() const {
+        return _level;
+    }
+
+    void Trace::set_level(TraceLevel level) {
+        _level = level;
+    }
+
+    size_t Trace::size() const {
+        return (_next < _records.size()) ? size_t(_next) : _records.size();
+    }
+
+    void Trace::clear() {
+        _next = 0;
+    }
+
+    bool Trace::write(std::ostream& out) const {
+        uint16_t version = kTraceVersion;
+        uint16_t record_size = sizeof(TraceRecord);
+        uint64_t count = size();
+
+        out.write(kTraceMagic, sizeof(kTraceMagic));
+        out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        out.write(reinterpret_cast<const char*>(&record_size), sizeof(record_size));
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+
+        for (uint64_t i = _next - count; i < _next; i++)
+            out.write(reinterpret_cast<const char*>(&_records[i & _mask]), sizeof(TraceRecord));
+
+        return bool(out);
+    }
+
+    bool Trace::read(std::istream& in, std::vector<TraceRecord>& records) {
+        char magic[4];
+        uint16_t version;
+        uint16_t record_size;
+        uint64_t count;
+
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+        in.read(reinterpret_cast<char*>(&record_size), sizeof(record_size));
+        in.read(reinterpret_cast<char*>(&count), sizeof(count));
+
+        if (!in || std::memcmp(magic, kTraceMagic, sizeof(magic)) != 0 ||
+            version != kTraceVersion || record_size != sizeof(TraceRecord))
+            return false;
+
+        // The count comes from the file, so records are read in bounded
+        // chunks rather than allocated up front: a truncated or corrupt
+        // header runs out of data instead of asking for gigabytes
+        records.clear();
+        while (records.size() < count) {
+            size_t done = records.size();
+            size_t chunk = size_t(std::min<uint64_t>(count - done, kTraceReadChunk));
+
+            records.resize(done + chunk);
+            in.read(reinterpret_cast<char*>(records.data() + done), chunk * sizeof(TraceRecord));
+            if (!in) {
+                records.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void print_registers(std::ostream& out, const uint8_t registers[16], uint16_t pc,
+                         uint16_t index_register, uint16_t stack_pointer,
+                         uint8_t delay_timer, uint8_t sound_timer) {
+        out << "-------- CPU Registers --------" << std::endl;
+        for (int i=0; i<4; i++) {
+            out << std::hex << std::setfill('0') <<
+                std::setw(1) << i + 0  << ": 0x" << std::setw(2) << int(registers[i+0])  << " " <<
+                std::setw(1) << i + 4  << ": 0x" << std::setw(2) << int(registers[i+4])  << " " <<
+                std::setw(1) << i + 8  << ": 0x" << std::setw(2) << int(registers[i+8])  << " " <<
+                std::setw(1) << i + 12 << ": 0x" << std::setw(2) << int(registers[i+12]) << " " <<
+                std::endl;
+        }
+        out << std::endl;
+
+        out << "pc: 0x" << std::setw(3) << int(pc) << std::endl
+            << "ix: 0x" << std::setw(3) << int(index_register) << std::endl
+            << "sp: 0x" << std::setw(3) << int(stack_pointer) << std::endl
+            << "dt: 0x" << std::setw(2) << int(delay_timer) << std::endl
+            << "st: 0x" << std::setw(2) << int(sound_timer) << std::endl;
+
+        out << "-------------------------------" << std::endl;
+        out << std::endl;
+    }
+
+    void print_record(std::ostream& out, const TraceRecord& record) {
+        out << "Operation at 0x"
+            << std::hex << record.pc << " -> " << std::setfill('0') << std::setw(4) << int(record.op)
+            << std::endl;
+
+        if (record.level >= kTraceRegisters)
+            print_registers(out, record.registers, record.next_pc, record.index_register,
+                            record.stack_pointer, record.delay_timer, record.sound_timer);
+    }
+
+} // namespace Chip8
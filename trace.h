@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+/**
+ * Instruction tracing into a fixed-size in-memory ring buffer. Records are
+ * plain binary so tracing every instruction costs a copy, not a formatted
+ * write. Written traces are turned back into text by chip8-trace.
+ *
+ * Tracing is compiled in when CHIP8_TRACE is defined (the default, see
+ * CMakeLists.txt). Whether to trace is decided once per CPU::run(), so
+ * an untraced run checks nothing per instruction; without CHIP8_TRACE the
+ * CPU has no tracing code at all. A traced run doesn't skip idle loops
+ * (see idle.h), so the trace has every instruction executed.
+ */
+
+namespace Chip8 {
+
+    enum TraceLevel {
+        kTraceOff,
+
+        // Program counter and opcode only
+        kTraceInstructions,
+
+        // Also registers, timers and which registers the instruction changed
+        kTraceRegisters,
+    };
+
+    struct TraceRecord {
+        uint16_t pc;
+        uint16_t op;
+        uint16_t next_pc;
+        uint16_t index_register;
+        uint16_t stack_pointer;
+        uint16_t changed;         // Bit N set if VN was written
+        uint8_t delay_timer;
+        uint8_t sound_timer;
+        uint8_t level;
+        uint8_t padding;
+        uint8_t registers[16];    // Values after the instruction ran
+    };
+
+    static_assert(sizeof(TraceRecord) == 32, "trace records are written as-is");
+
+    class Trace {
+    public:
+        // Capacity is rounded up to a power of two
+        explicit Trace(size_t capacity);
+
+        TraceLevel level() const;
+        void set_level(TraceLevel level);
+
+        void record(const TraceRecord& record) {
+            _records[_next & _mask] = record;
+            _next++;
+        }
+
+        // Number of records held, at most the capacity
+        size_t size() const;
+        void clear();
+
+        // Writes the held records, oldest first
+        bool write(std::ostream& out) const;
+        static bool read(std::istream& in, std::vector<TraceRecord>& records);
+
+    private:
+        std::vector<TraceRecord> _records;
+        uint64_t _mask;
+        uint64_t _next;
+        TraceLevel _level;
+    };
+
+    // Text form used by CPU::dump and chip8-trace
+    void print_registers(std::ostream& out, const uint8_t registers[16], uint16_t pc,
+                         uint16_t index_register, uint16_t stack_pointer,
+                         uint8_t delay_timer, uint8_t sound_timer);
+    void print_record(std::ostream& out, const TraceRecord& record);
+
+} // namespace Chip8
@@ -0,0 +1,33 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdlib>
+
+#include "trace.h"
+
+/**
+ * chip8-trace: prints a binary trace written by chip8 --trace in the same
+ * format the CPU used to print while running.
+ */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cout << "usage: " << argv[0] << " <trace file>\n" << std::endl;
+        std::exit(2);
+    }
+
+    std::ifstream file(argv[1], std::ifstream::binary);
+    if (!file.is_open()) {
+        std::cerr << "couldn't open trace" << std::endl;
+        exit(1);
+    }
+
+    std::vector<Chip8::TraceRecord> records;
+    if (!Chip8::Trace::read(file, records)) {
+        std::cerr << "not a chip8 trace, or truncated" << std::endl;
+        exit(1);
+    }
+
+    for (size_t i = 0; i < records.size(); i++)
+        Chip8::print_record(std::cout, records[i]);
+}
@@ -0,0 +1,443 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "upscale.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace Chip8 {
+
+    // Pixels a vector kernel may store past the end of a row
+    const int kOverhang = 8;
+
+    namespace {
+
+        struct NamedPalette {
+            const char* name;
+            Palette palette;
+        };
+
+        const NamedPalette kPalettes[] = {
+            { "mono",  kDefaultPalette },
+            { "amber", { { 0xFF1A1000, 0xFFFFB000, 0xFFB07800, 0xFF604000 } } },
+            { "green", { { 0xFF001400, 0xFF33FF66, 0xFF22AA44, 0xFF115522 } } },
+            { "lcd",   { { 0xFF9BBC0F, 0xFF0F380F, 0xFF306230, 0xFF8BAC0F } } },
+            { "octo",  { { 0xFF996600, 0xFFFFCC00, 0xFFFF6600, 0xFF662200 } } },
+        };
+
+        // Part of the way from one colour to another, channel by channel
+        uint32_t mix(uint32_t from, uint32_t to, int thirds) {
+            uint32_t color = 0xFF000000;
+            for (int shift = 0; shift < 24; shift += 8) {
+                int a = (from >> shift) & 0xFF;
+                int b = (to >> shift) & 0xFF;
+                color |= uint32_t(a + (b - a) * thirds / 3) << shift;
+            }
+            return color;
+        }
+
+        // One colour channel of the phosphor blend: the new value, plus
+        // persistence / 256 of the gap back to the last one, rounded
+        // towards the new value so a fade always settles
+        inline uint32_t fade_channel(uint32_t last, uint32_t target, int persistence) {
+            int p = last & 0xFF;
+            int c = target & 0xFF;
+            int step = (std::abs(p - c) * persistence) >> 8;
+            return uint32_t(p >= c ? c + step : c - step);
+        }
+
+        // Colours count pixels through the palette, blending each with
+        // what colors held. True while any of them is still fading.
+        bool shade_scalar(const uint8_t* indices, size_t count, const uint32_t* palette,
+                          uint32_t* colors, int persistence) {
+            bool fading = false;
+            for (size_t i = 0; i < count; i++) {
+                uint32_t target = palette[indices[i] & 3];
+                if (persistence == 0) {
+                    colors[i] = target;
+                    continue;
+                }
+
+                uint32_t out = 0;
+                for (int shift = 0; shift < 32; shift += 8)
+                    out |= fade_channel(colors[i] >> shift, target >> shift, persistence) << shift;
+                colors[i] = out;
+                fading |= out != target;
+            }
+            return fading;
+        }
+
+        // Writes each of count pixels factor times
+        void expand_scalar(const uint32_t* source, int count, int factor, uint32_t* row) {
+            for (int i = 0; i < count; i++, row += factor)
+                std::fill_n(row, factor, source[i]);
+        }
+
+#if defined(__x86_64__)
+        // SSE2 is part of x86-64, so this needs no target attribute
+
+        inline __m128i fade_sse2(__m128i last, __m128i target, __m128i persistence) {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i high = _mm_max_epu8(last, target);
+            __m128i gap = _mm_sub_epi8(high, _mm_min_epu8(last, target));
+
+            __m128i low_half = _mm_mullo_epi16(_mm_unpacklo_epi8(gap, zero), persistence);
+            __m128i high_half = _mm_mullo_epi16(_mm_unpackhi_epi8(gap, zero), persistence);
+            __m128i step = _mm_packus_epi16(_mm_srli_epi16(low_half, 8), _mm_srli_epi16(high_half, 8));
+
+            __m128i darkening = _mm_cmpeq_epi8(high, last);
+            return _mm_or_si128(_mm_and_si128(darkening, _mm_add_epi8(target, step)),
+                                _mm_andnot_si128(darkening, _mm_sub_epi8(target, step)));
+        }
+
+        bool shade_sse2(const uint8_t* indices, size_t count, const uint32_t* palette,
+                        uint32_t* colors, int persistence) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i amount = _mm_set1_epi16(short(persistence));
+            __m128i entries[4], values[4];
+            for (int e = 0; e < 4; e++) {
+                entries[e] = _mm_set1_epi32(int(palette[e]));
+                values[e] = _mm_set1_epi32(e);
+            }
+
+            // Bytes of the output that equal their target, and together
+            __m128i settled = _mm_set1_epi8(-1);
+
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                uint32_t four;
+                std::memcpy(&four, indices + i, sizeof(four));
+                __m128i index = _mm_unpacklo_epi16(
+                    _mm_unpacklo_epi8(_mm_cvtsi32_si128(int(four)), zero), zero);
+
+                __m128i target = zero;
+                for (int e = 0; e < 4; e++)
+                    target = _mm_or_si128(target, _mm_and_si128(_mm_cmpeq_epi32(index, values[e]), entries[e]));
+
+                __m128i* out = reinterpret_cast<__m128i*>(colors + i);
+                if (persistence == 0) {
+                    _mm_storeu_si128(out, target);
+                    continue;
+                }
+
+                __m128i color = fade_sse2(_mm_loadu_si128(out), target, amount);
+                settled = _mm_and_si128(settled, _mm_cmpeq_epi8(color, target));
+                _mm_storeu_si128(out, color);
+            }
+
+            bool fading = shade_scalar(indices + i, count - i, palette, colors + i, persistence);
+            return fading || _mm_movemask_epi8(settled) != 0xFFFF;
+        }
+
+        void expand_sse2(const uint32_t* source, int count, int factor, uint32_t* row) {
+            for (int i = 0; i < count; i++, row += factor) {
+                __m128i pixel = _mm_set1_epi32(int(source[i]));
+                for (int j = 0; j < factor; j += 4)
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(row + j), pixel);
+            }
+        }
+
+        __attribute__((target("avx2")))
+        inline __m256i fade_avx2(__m256i last, __m256i target, __m256i persistence) {
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i high = _mm256_max_epu8(last, target);
+            __m256i gap = _mm256_sub_epi8(high, _mm256_min_epu8(last, target));
+
+            // Unpacking and packing both work within 128-bit lanes, so the
+            // bytes come back in order
+            __m256i low_half = _mm256_mullo_epi16(_mm256_unpacklo_epi8(gap, zero), persistence);
+            __m256i high_half = _mm256_mullo_epi16(_mm256_unpackhi_epi8(gap, zero), persistence);
+            __m256i step = _mm256_packus_epi16(_mm256_srli_epi16(low_half, 8), _mm256_srli_epi16(high_half, 8));
+
+            __m256i darkening = _mm256_cmpeq_epi8(high, last);
+            return _mm256_blendv_epi8(_mm256_sub_epi8(target, step), _mm256_add_epi8(target, step), darkening);
+        }
+
+        __attribute__((target("avx2")))
+        bool shade_avx2(const uint8_t* indices, size_t count, const uint32_t* palette,
+                        uint32_t* colors, int persistence) {
+            const __m256i amount = _mm256_set1_epi16(short(persistence));
+            const __m256i entries = _mm256_setr_epi32(
+                int(palette[0]), int(palette[1]), int(palette[2]), int(palette[3]),
+                int(palette[0]), int(palette[1]), int(palette[2]), int(palette[3]));
+            __m256i settled = _mm256_set1_epi8(-1);
+
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8) {
+                __m256i index = _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices + i)));
+                __m256i target = _mm256_permutevar8x32_epi32(entries, index);
+
+                __m256i* out = reinterpret_cast<__m256i*>(colors + i);
+                if (persistence == 0) {
+                    _mm256_storeu_si256(out, target);
+                    continue;
+                }
+
+                __m256i color = fade_avx2(_mm256_loadu_si256(out), target, amount);
+                settled = _mm256_and_si256(settled, _mm256_cmpeq_epi8(color, target));
+                _mm256_storeu_si256(out, color);
+            }
+
+            bool fading = shade_scalar(indices + i, count - i, palette, colors + i, persistence);
+            return fading || _mm256_movemask_epi8(settled) != -1;
+        }
+
+        __attribute__((target("avx2")))
+        void expand_avx2(const uint32_t* source, int count, int factor, uint32_t* row) {
+            for (int i = 0; i < count; i++, row += factor) {
+                __m256i pixel = _mm256_set1_epi32(int(source[i]));
+                for (int j = 0; j < factor; j += 8)
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + j), pixel);
+            }
+        }
+#endif
+
+        struct Kernel {
+            bool (*shade)(const uint8_t* indices, size_t count, const uint32_t* palette,
+                          uint32_t* colors, int persistence);
+            void (*expand)(const uint32_t* source, int count, int factor, uint32_t* row);
+        };
+
+        Kernel kernel_functions(UpscaleKernel kernel) {
+#if defined(__x86_64__)
+            if (kernel == kKernelAVX2)
+                return { shade_avx2, expand_avx2 };
+            if (kernel == kKernelSSE2)
+                return { shade_sse2, expand_sse2 };
+#endif
+            (void)kernel;
+            return { shade_scalar, expand_scalar };
+        }
+
+        int filter_factor(ScaleFilter filter) {
+            switch (filter) {
+                case kScale2x: return 2;
+                case kScale3x: return 3;
+                default: return 1;
+            }
+        }
+
+    } // namespace
+
+    bool parse_scale_filter(const char* name, ScaleFilter& filter) {
+        std::string value = name;
+        if (value == "nearest")
+            filter = kScaleNearest;
+        else if (value == "scale2x")
+            filter = kScale2x;
+        else if (value == "scale3x")
+            filter = kScale3x;
+        else
+            return false;
+        return true;
+    }
+
+    bool parse_palette(const char* name, Palette& palette) {
+        for (const NamedPalette& named : kPalettes) {
+            if (std::strcmp(name, named.name) == 0) {
+                palette = named.palette;
+                return true;
+            }
+        }
+
+        // RRGGBB[,RRGGBB...]
+        uint32_t colors[4];
+        int count = 0;
+        const char* p = name;
+        for (;;) {
+            if (count == 4 || std::strspn(p, "0123456789abcdefABCDEF") != 6)
+                return false;
+            colors[count++] = 0xFF000000 | uint32_t(std::strtoul(std::string(p, 6).c_str(), nullptr, 16));
+            if (p[6] == '\0')
+                break;
+            if (p[6] != ',')
+                return false;
+            p += 7;
+        }
+
+        if (count < 2)
+            return false;
+
+        // With only off and on, the XO-CHIP shades go in between like the
+        // default palette's
+        palette.colors[0] = colors[0];
+        palette.colors[1] = colors[1];
+        palette.colors[2] = count > 2 ? colors[2] : mix(colors[0], colors[1], 2);
+        palette.colors[3] = count > 3 ? colors[3] : mix(colors[0], colors[1], 1);
+        return true;
+    }
+
+    const char* kernel_name(UpscaleKernel kernel) {
+        switch (kernel) {
+            case kKernelSSE2: return "sse2";
+            case kKernelAVX2: return "avx2";
+            default: return "scalar";
+        }
+    }
+
+    bool kernel_supported(UpscaleKernel kernel) {
+#if defined(__x86_64__)
+        if (kernel == kKernelAVX2)
+            return __builtin_cpu_supports("avx2");
+        return true;
+#else
+        return kernel == kKernelScalar;
+#endif
+    }
+
+    UpscaleKernel best_kernel() {
+        if (kernel_supported(kKernelAVX2))
+            return kKernelAVX2;
+        if (kernel_supported(kKernelSSE2))
+            return kKernelSSE2;
+        return kKernelScalar;
+    }
+
+    Upscaler::Upscaler(const UpscaleConfig& config, UpscaleKernel kernel)
+        : _config(config), _kernel(kernel_supported(kernel) ? kernel : kKernelScalar),
+          _factor(filter_factor(config.filter)), _hires(false), _fading(false), _rendered(false) {
+        // High resolution takes half the scale, and both have to divide
+        // evenly by the filter's own factor
+        int step = 2 * _factor;
+        _config.scale = std::max((config.scale + step - 1) / step * step, step);
+        _config.persistence = std::min(std::max(config.persistence, 0), 255);
+
+        std::memset(_shown, 0, sizeof(_shown));
+        _source.resize(kMaxGraphicsWidth * kMaxGraphicsHeight);
+        _smoothed.resize(_source.size() * _factor * _factor);
+        _colors.resize(_smoothed.size());
+        _pixels.resize(size_t(width()) * height() + kOverhang, _config.palette.colors[0]);
+    }
+
+    int Upscaler::width() const {
+        return kGraphicsWidth * _config.scale;
+    }
+
+    int Upscaler::height() const {
+        return kGraphicsHeight * _config.scale;
+    }
+
+    int Upscaler::scale() const {
+        return _config.scale;
+    }
+
+    UpscaleKernel Upscaler::kernel() const {
+        return _kernel;
+    }
+
+    bool Upscaler::fading() const {
+        return _fading;
+    }
+
+    const uint32_t* Upscaler::pixels() const {
+        return _pixels.data();
+    }
+
+    bool Upscaler::changed(const Graphics& graphics) const {
+        for (int plane = 0; plane < kGraphicsPlanes; plane++) {
+            for (int y = 0; y < graphics.height(); y++) {
+                if (!std::equal(_shown[plane][y], _shown[plane][y] + kRowWords, graphics.row(plane, y)))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    bool Upscaler::render(const Graphics& graphics) {
+        // A change of resolution starts over rather than fading between sizes
+        bool fresh = !_rendered || graphics.hires() != _hires;
+        if (!fresh && !_fading && !changed(graphics))
+            return false;
+
+        int width = graphics.width();
+        int height = graphics.height();
+        for (int y = 0; y < height; y++) {
+            graphics.compose(y, &_source[y * width]);
+            for (int plane = 0; plane < kGraphicsPlanes; plane++)
+                std::copy(graphics.row(plane, y), graphics.row(plane, y) + kRowWords, _shown[plane][y]);
+        }
+        _hires = graphics.hires();
+        _rendered = true;
+
+        const uint8_t* indices = _source.data();
+        if (_factor > 1) {
+            smooth(width, height);
+            indices = _smoothed.data();
+        }
+
+        Kernel kernel = kernel_functions(_kernel);
+        int columns = width * _factor;
+        int rows = height * _factor;
+        _fading = kernel.shade(indices, size_t(columns) * rows, _config.palette.colors,
+                               _colors.data(), fresh ? 0 : _config.persistence);
+
+        // Widen each row once, then copy it down. A vector store running
+        // past the end of the row only touches the next one, which is
+        // overwritten after, or the spare pixels at the very end.
+        int factor = (_hires ? _config.scale / 2 : _config.scale) / _factor;
+        size_t stride = size_t(this->width());
+        for (int y = 0; y < rows; y++) {
+            uint32_t* row = &_pixels[y * factor * stride];
+            kernel.expand(&_colors[y * columns], columns, factor, row);
+            for (int i = 1; i < factor; i++)
+                std::memcpy(row + i * stride, row, stride * sizeof(uint32_t));
+        }
+        return true;
+    }
+
+    void Upscaler::smooth(int width, int height) {
+        // Scale2x and Scale3x as described by Andrea Mazzoleni, with the
+        // edge pixels standing in for neighbours off the screen:
+        //
+        //   A B C
+        //   D E F
+        //   G H I
+        //
+        // Corners of E take the colour of the two neighbours meeting there
+        // when they agree and the other two don't.
+        const uint8_t* s = _source.data();
+        int columns = width * _factor;
+
+        for (int y = 0; y < height; y++) {
+            int up = std::max(y - 1, 0) * width;
+            int middle = y * width;
+            int down = std::min(y + 1, height - 1) * width;
+
+            for (int x = 0; x < width; x++) {
+                int left = std::max(x - 1, 0);
+                int right = std::min(x + 1, width - 1);
+
+                uint8_t a = s[up + left], b = s[up + x], c = s[up + right];
+                uint8_t d = s[middle + left], e = s[middle + x], f = s[middle + right];
+                uint8_t g = s[down + left], h = s[down + x], i = s[down + right];
+
+                uint8_t* out = &_smoothed[(y * _factor) * columns + x * _factor];
+                bool edge = b != h && d != f;
+
+                if (_factor == 2) {
+                    out[0] = edge && d == b ? d : e;
+                    out[1] = edge && b == f ? f : e;
+                    out[columns] = edge && d == h ? d : e;
+                    out[columns + 1] = edge && h == f ? f : e;
+                    continue;
+                }
+
+                out[0] = edge && d == b ? d : e;
+                out[1] = edge && ((d == b && e != c) || (b == f && e != a)) ? b : e;
+                out[2] = edge && b == f ? f : e;
+                out[columns] = edge && ((d == b && e != g) || (d == h && e != a)) ? d : e;
+                out[columns + 1] = e;
+                out[columns + 2] = edge && ((b == f && e != i) || (h == f && e != c)) ? f : e;
+                out[2 * columns] = edge && d == h ? d : e;
+                out[2 * columns + 1] = edge && ((d == h && e != i) || (h == f && e != g)) ? h : e;
+                out[2 * columns + 2] = edge && h == f ? f : e;
+            }
+        }
+    }
+
+} // namespace Chip8
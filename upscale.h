@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "graphics.h"
+
+namespace Chip8 {
+
+    // Edge smoothing applied before scaling up
+    enum ScaleFilter {
+        kScaleNearest,      // Plain square pixels
+        kScale2x,           // Scale2x (AdvMAME2x) on each pixel
+        kScale3x,           // Scale3x (AdvMAME3x) on each pixel
+    };
+
+    // "nearest", "scale2x" or "scale3x"
+    bool parse_scale_filter(const char* name, ScaleFilter& filter);
+
+    // ARGB8888 colour for each pixel value: off, plane 0, plane 1, both
+    struct Palette {
+        uint32_t colors[4];
+    };
+
+    const Palette kDefaultPalette = { { 0xFF000000, 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555 } };
+
+    // A named palette (mono, amber, green, lcd, octo), or two to four
+    // comma-separated RRGGBB colours in the order above
+    bool parse_palette(const char* name, Palette& palette);
+
+    // The same pipeline in plain C++ and with SSE2 and AVX2 intrinsics,
+    // giving bit-identical output
+    enum UpscaleKernel {
+        kKernelScalar,
+        kKernelSSE2,
+        kKernelAVX2,
+    };
+
+    const char* kernel_name(UpscaleKernel kernel);
+    bool kernel_supported(UpscaleKernel kernel);
+
+    // The widest kernel this host runs
+    UpscaleKernel best_kernel();
+
+    struct UpscaleConfig {
+        // Output pixels per low resolution pixel, half that in high
+        // resolution so the output size never changes. Rounded up to an
+        // even number, or a multiple of 4 or 6 for Scale2x or Scale3x.
+        int scale = 10;
+
+        ScaleFilter filter = kScaleNearest;
+        Palette palette = kDefaultPalette;
+
+        // Phosphor persistence, 0-255: how much of the gap between the last
+        // colour shown and the new one remains after a frame. Hides the
+        // flicker of sprites erased and redrawn every frame.
+        int persistence = 0;
+    };
+
+    /**
+     * Turns the packed framebuffer into an ARGB8888 image of
+     * 64 * scale by 32 * scale pixels on the CPU.
+     *
+     * Each frame is composed into colour indices, optionally smoothed with
+     * Scale2x or Scale3x, mapped through the palette and blended with the
+     * last frame at that small size, and only then expanded to full size:
+     * one row is widened with vector stores and copied down for the rest
+     * of its height. A frame whose rows haven't changed, with nothing
+     * still fading, costs a comparison and nothing else.
+     */
+    class Upscaler {
+    public:
+        // Falls back to the scalar kernel if the host can't run the one
+        // asked for
+        explicit Upscaler(const UpscaleConfig& config, UpscaleKernel kernel = best_kernel());
+
+        int width() const;
+        int height() const;
+        int scale() const;
+        UpscaleKernel kernel() const;
+
+        // Renders the screen into pixels(). False if the last image still
+        // stands and nothing was written.
+        bool render(const Graphics& graphics);
+
+        // True while the last render hasn't settled yet, so rendering the
+        // same screen again would still change the picture
+        bool fading() const;
+
+        // width() * height() pixels, row after row
+        const uint32_t* pixels() const;
+
+    private:
+        bool changed(const Graphics& graphics) const;
+        void smooth(int width, int height);
+
+        UpscaleConfig _config;
+        UpscaleKernel _kernel;
+        int _factor;                    // Of the filter: 1, 2 or 3
+
+        // What was last rendered
+        bool _hires;
+        bool _fading;
+        bool _rendered;
+        uint64_t _shown[kGraphicsPlanes][kMaxGraphicsHeight][kRowWords];
+
+        std::vector<uint8_t> _source;   // Colour index per screen pixel
+        std::vector<uint8_t> _smoothed; // Same after the filter
+        std::vector<uint32_t> _colors;  // Blended colours at that size
+        std::vector<uint32_t> _pixels;  // Full size, plus room for overhanging stores
+    };
+
+} // namespace Chip8